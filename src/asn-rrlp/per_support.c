@@ -335,9 +335,12 @@ per_put_few_bits(asn_per_outp_t *po, uint32_t bits, int obits) {
 		buf[2] = bits >> 8,
 		buf[3] = bits;
 	else {
+		/* the halves advance the position themselves */
+		po->nboff -= obits;
 		ASN_DEBUG("->[PER out split %d]", obits);
-		per_put_few_bits(po, bits >> 8, 24);
-		per_put_few_bits(po, bits, obits - 24);
+		if(per_put_few_bits(po, bits >> (obits - 24), 24)
+		|| per_put_few_bits(po, bits, obits - 24))
+			return -1;
 		ASN_DEBUG("<-[PER out split %d]", obits);
 	}
 
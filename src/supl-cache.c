@@ -0,0 +1,1483 @@
+/*
+** SUPL library - assistance cache with per element validity
+**
+** Copyright (c) 2007 Tatu Mannisto <tatu a-t tajuma d-o-t com>
+** All rights reserved.
+** Redistribution and modifications are permitted subject to BSD license.
+**
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "supl.h"
+
+#define GPS_WEEK_SEC 604800
+#define GPS_TOW_UNITS 7560000 /* 0.08 s units in a week */
+
+#define REFRESH_RETRY 30 /* seconds after a failed refresh */
+#define REFRESH_TIMEOUT 30000 /* ms, default cache->refresh_timeout */
+
+#define SEG_PROBATION 0
+#define SEG_PROTECTED 1
+
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX 15 /* counters saturate, TinyLFU only needs to tell hot from cold */
+
+#define GRID_KEY (-1)            /* key.set of a grid square */
+#define KM_PER_DEG 111.195       /* along a meridian */
+#define RAD (3.14159265358979 / 180.0)
+
+/* almanac shared by all entries holding an identical one */
+struct supl_alm_blob_s {
+  struct supl_alm_blob_s *next;
+  unsigned int hash;
+  int refs;
+  int week;
+  int cnt;
+  struct supl_almanac_s alm[1];
+};
+
+/*
+** Entries are compact: ephemerides and acquisition assistance are sized to
+** what was received and the almanac is shared. entry_expand() gives back
+** the supl_cached_t form.
+*/
+
+struct supl_cache_entry_s {
+  struct supl_cache_entry_s *next;
+  struct supl_cache_entry_s *lru_prev, *lru_next;
+  int segment;
+  size_t bytes;
+  supl_cache_key_t key;
+
+  int set;
+  time_t at[SUPL_ASSIST_PARTS];
+  __typeof__(((supl_assist_t *)0)->time) time;
+  __typeof__(((supl_assist_t *)0)->pos) pos;
+  struct supl_ionospheric_s iono;
+  struct supl_utc_s utc;
+  int cnt_eph;
+  struct supl_ephemeris_s *eph;
+  int cnt_acq, acq_time;
+  struct supl_acquis_s *acq;
+  struct supl_alm_blob_s *alm;
+  int has_grid;
+  int grid[2]; /* square with the shared parts of a cell entry */
+  int prefetched; /* fetched ahead for a predicted cell, not looked up since */
+
+  /* refresh-ahead state */
+  time_t due;
+  int uses;
+  unsigned int use_epoch; /* of cache->use_epoch when uses was counted */
+  int heap_at;            /* index in cache->refresh_heap plus one, 0 if not in it */
+  time_t refresh_at;      /* key in the heap */
+  int jitter;
+  int refreshing;
+  time_t retry_at;
+  int has_param;
+  supl_param_t p;
+};
+
+/* an upstream session other callers with the same key can wait for */
+struct supl_flight_s {
+  struct supl_flight_s *next;
+  supl_cache_key_t key;
+  int request;
+  int refs;
+  int done;
+  int err;
+  supl_assist_t assist;
+  pthread_cond_t cond;
+};
+
+/* a cell to fetch ahead, see supl_cache_prefetch() */
+struct supl_prefetch_s {
+  struct supl_prefetch_s *next;
+  supl_cache_key_t key;
+  supl_param_t p;
+};
+
+static const supl_valid_t default_valid = {
+  24 * 3600,	 /* reference time, propagated with the local clock */
+  24 * 3600,	 /* reference location */
+  24 * 3600,	 /* ionospheric model */
+  24 * 3600,	 /* UTC model */
+  2 * 3600,	 /* ephemeris, after toe */
+  7 * 24 * 3600, /* almanac */
+  300		 /* acquisition assistance */
+};
+
+/* index of a SUPL_RRLP_ASSIST_* flag in supl_cached_t.at[] */
+static int part_index(int part) {
+  int i;
+
+  for (i = 0; i < SUPL_ASSIST_PARTS; i++) {
+    if (part == 1 << i) return i;
+  }
+
+  return 0;
+}
+
+static int part_fresh(supl_cached_t *c, int part, int valid, time_t now) {
+  return (c->assist.set & part) && now - c->at[part_index(part)] < valid;
+}
+
+// signed difference a - b of two times of week, in seconds
+static long tow_diff(long a, long b) {
+  long d = a - b;
+
+  if (d > GPS_WEEK_SEC / 2) d -= GPS_WEEK_SEC;
+  if (d < -GPS_WEEK_SEC / 2) d += GPS_WEEK_SEC;
+
+  return d;
+}
+
+/* reference time advanced to now with the local clock */
+static void propagate_time(supl_assist_t *a, struct timeval *now) {
+  long long tow;
+  long ms;
+
+  ms = (now->tv_sec - a->time.stamp.tv_sec) * 1000 + (now->tv_usec - a->time.stamp.tv_usec) / 1000;
+  tow = a->time.gps_tow + ms / 80;
+
+  while (tow >= GPS_TOW_UNITS) {
+    tow -= GPS_TOW_UNITS;
+    a->time.gps_week = (a->time.gps_week + 1) % 1024;
+  }
+
+  a->time.gps_tow = tow;
+  a->time.stamp = *now;
+}
+
+/*
+** Copy the still valid parts of cached data to out. Reference time is
+** propagated to now, ephemerides are checked one by one against their toe.
+** Returns the SUPL_RRLP_ASSIST_* flags of the parts copied.
+*/
+
+int EXPORT supl_assist_fresh(supl_cached_t *c, const supl_valid_t *valid, struct timeval *now, supl_assist_t *out) {
+  supl_assist_t *a = &c->assist;
+  int i;
+
+  if (!valid) valid = &default_valid;
+
+  memset(out, 0, sizeof(supl_assist_t));
+
+  if (part_fresh(c, SUPL_RRLP_ASSIST_REFTIME, valid->time, now->tv_sec)) {
+    out->set |= SUPL_RRLP_ASSIST_REFTIME;
+    out->time = a->time;
+    propagate_time(out, now);
+  }
+
+  if (part_fresh(c, SUPL_RRLP_ASSIST_REFLOC, valid->loc, now->tv_sec)) {
+    out->set |= SUPL_RRLP_ASSIST_REFLOC;
+    out->pos = a->pos;
+  }
+
+  if (part_fresh(c, SUPL_RRLP_ASSIST_IONO, valid->iono, now->tv_sec)) {
+    out->set |= SUPL_RRLP_ASSIST_IONO;
+    out->iono = a->iono;
+  }
+
+  if (part_fresh(c, SUPL_RRLP_ASSIST_UTC, valid->utc, now->tv_sec)) {
+    out->set |= SUPL_RRLP_ASSIST_UTC;
+    out->utc = a->utc;
+  }
+
+  if (c->assist.set & SUPL_RRLP_ASSIST_EPHEMERIS) {
+    for (i = 0; i < a->cnt_eph; i++) {
+      if (supl_eph_expiry(c, i, valid) > now->tv_sec) {
+	out->eph[out->cnt_eph++] = a->eph[i];
+      }
+    }
+    if (out->cnt_eph) out->set |= SUPL_RRLP_ASSIST_EPHEMERIS;
+  }
+
+  if (part_fresh(c, SUPL_RRLP_ASSIST_ALMANAC, valid->alm, now->tv_sec)) {
+    out->set |= SUPL_RRLP_ASSIST_ALMANAC;
+    out->alm_week = a->alm_week;
+    out->cnt_alm = a->cnt_alm;
+    memcpy(out->alm, a->alm, a->cnt_alm * sizeof(struct supl_almanac_s));
+  }
+
+  if (part_fresh(c, SUPL_RRLP_ASSIST_ACQUIS, valid->acq, now->tv_sec)) {
+    out->set |= SUPL_RRLP_ASSIST_ACQUIS;
+    out->acq_time = a->acq_time;
+    out->cnt_acq = a->cnt_acq;
+    memcpy(out->acq, a->acq, a->cnt_acq * sizeof(struct supl_acquis_s));
+  }
+
+  return out->set;
+}
+
+/*
+** Unix time when ephemeris i stops being usable, toe + valid->eph. Without
+** reference time we only know when it was fetched.
+*/
+
+time_t EXPORT supl_eph_expiry(supl_cached_t *c, int i, const supl_valid_t *valid) {
+  supl_assist_t *a = &c->assist;
+  time_t at = c->at[part_index(SUPL_RRLP_ASSIST_EPHEMERIS)];
+
+  if (!valid) valid = &default_valid;
+
+  if (!(a->set & SUPL_RRLP_ASSIST_REFTIME)) return at + valid->eph;
+
+  /* toe relative to the reference time, both seconds of the GPS week */
+  return a->time.stamp.tv_sec + tow_diff(a->eph[i].toe * 16, a->time.gps_tow * 8 / 100) + valid->eph;
+}
+
+/* merge freshly fetched parts into cached data, ephemerides per PRN */
+void EXPORT supl_cached_merge(supl_cached_t *c, supl_assist_t *in, time_t now) {
+  supl_assist_t *a = &c->assist;
+  int i, j;
+
+  if (in->set & SUPL_RRLP_ASSIST_REFTIME) a->time = in->time;
+  if (in->set & SUPL_RRLP_ASSIST_REFLOC) a->pos = in->pos;
+  if (in->set & SUPL_RRLP_ASSIST_IONO) a->iono = in->iono;
+  if (in->set & SUPL_RRLP_ASSIST_UTC) a->utc = in->utc;
+
+  if (in->set & SUPL_RRLP_ASSIST_EPHEMERIS) {
+    for (i = 0; i < in->cnt_eph; i++) {
+      for (j = 0; j < a->cnt_eph; j++) {
+	if (a->eph[j].prn == in->eph[i].prn) break;
+      }
+      if (j == a->cnt_eph) {
+	if (a->cnt_eph >= MAX_EPHEMERIS) continue;
+	a->cnt_eph++;
+      }
+      a->eph[j] = in->eph[i];
+    }
+  }
+
+  if (in->set & SUPL_RRLP_ASSIST_ALMANAC) {
+    a->alm_week = in->alm_week;
+    a->cnt_alm = in->cnt_alm;
+    memcpy(a->alm, in->alm, in->cnt_alm * sizeof(struct supl_almanac_s));
+  }
+
+  if (in->set & SUPL_RRLP_ASSIST_ACQUIS) {
+    a->acq_time = in->acq_time;
+    a->cnt_acq = in->cnt_acq;
+    memcpy(a->acq, in->acq, in->cnt_acq * sizeof(struct supl_acquis_s));
+  }
+
+  for (i = 0; i < SUPL_ASSIST_PARTS; i++) {
+    if (in->set & (1 << i)) c->at[i] = now;
+  }
+
+  a->set |= in->set;
+}
+
+/*
+** Set up ctx to ask only for what the cached data c lacks. Ephemeris is
+** always asked for, but the satellites we have current ephemerides for are
+** listed in navigationModelData so that the SLP sends only new and changed
+** ones. Returns the SUPL_RRLP_ASSIST_* parts asked for.
+*/
+
+int EXPORT supl_assist_plan(supl_ctx_t *ctx, supl_cached_t *c, const supl_valid_t *valid) {
+  supl_assist_t fresh;
+  struct timeval now;
+  int parts = 0, toe = -1, i;
+
+  if (!valid) valid = &default_valid;
+
+  gettimeofday(&now, 0);
+  if (c) parts = supl_assist_fresh(c, valid, &now, &fresh);
+
+  ctx->p.assist = (((1 << SUPL_ASSIST_PARTS) - 1) & ~parts) | SUPL_RRLP_ASSIST_EPHEMERIS;
+  ctx->p.nav.cnt = 0;
+
+  /* the navigation model needs the GPS week */
+  if (!(parts & SUPL_RRLP_ASSIST_EPHEMERIS) || !(parts & SUPL_RRLP_ASSIST_REFTIME)) return ctx->p.assist;
+
+  for (i = 0; i < c->assist.cnt_eph && ctx->p.nav.cnt < 31; i++) {
+    struct supl_ephemeris_s *e = &c->assist.eph[i];
+
+    /* let the SLP replace the ones running out soon */
+    if (supl_eph_expiry(c, i, valid) - now.tv_sec <= valid->eph / 2) continue;
+
+    ctx->p.nav.sat[ctx->p.nav.cnt].prn = e->prn;
+    ctx->p.nav.sat[ctx->p.nav.cnt].iode = e->IODC & 0xff;
+    ctx->p.nav.cnt++;
+
+    if (e->toe > toe) toe = e->toe;
+  }
+
+  ctx->p.nav.gps_week = fresh.time.gps_week % 1024;
+  ctx->p.nav.gps_toe = toe * 16 / 3600 % 168;
+  ctx->p.nav.toe_limit = valid->eph / 7200 < 10 ? valid->eph / 7200 : 10;
+
+  return ctx->p.assist;
+}
+
+void EXPORT supl_cache_key(supl_cache_key_t *key, supl_ctx_t *ctx, char *server) {
+  memset(key, 0, sizeof(supl_cache_key_t));
+
+  strncpy(key->server, server ? server : "", sizeof(key->server) - 1);
+  key->set = ctx->p.set;
+  key->gsm[0] = ctx->p.gsm.mcc;
+  key->gsm[1] = ctx->p.gsm.mnc;
+  key->gsm[2] = ctx->p.gsm.lac;
+  key->gsm[3] = ctx->p.gsm.ci;
+  key->wcdma[0] = ctx->p.wcdma.mcc;
+  key->wcdma[1] = ctx->p.wcdma.mnc;
+  key->wcdma[2] = ctx->p.wcdma.uc;
+  key->known[0] = ctx->p.known.mcc;
+  key->known[1] = ctx->p.known.mnc;
+  key->known[2] = ctx->p.known.lac;
+  key->known[3] = ctx->p.known.ci;
+}
+
+static unsigned int key_hash(supl_cache_key_t *key) {
+  const unsigned char *p = (const unsigned char *)key;
+  unsigned int h = 2166136261u;
+  size_t i;
+
+  /* FNV-1a */
+  for (i = 0; i < sizeof(supl_cache_key_t); i++) {
+    h = (h ^ p[i]) * 16777619u;
+  }
+
+  return h;
+}
+
+/*
+** Count-min sketch of key frequencies with small saturating counters,
+** halved every time it has seen ten times its width so that it follows
+** what is popular now.
+*/
+
+static unsigned int sketch_index(supl_cache_t *cache, unsigned int h, int row) {
+  static const unsigned int mult[SKETCH_DEPTH] = { 0x9e3779b1u, 0x85ebca6bu, 0xc2b2ae35u, 0x27d4eb2fu };
+
+  h *= mult[row];
+
+  return row * (cache->sketch_mask + 1) + ((h ^ (h >> 15)) & cache->sketch_mask);
+}
+
+static int sketch_estimate(supl_cache_t *cache, unsigned int h) {
+  int row, min = SKETCH_MAX;
+
+  for (row = 0; row < SKETCH_DEPTH; row++) {
+    int v = cache->sketch[sketch_index(cache, h, row)];
+
+    if (v < min) min = v;
+  }
+
+  return min;
+}
+
+static void sketch_add(supl_cache_t *cache, unsigned int h) {
+  int row, i;
+
+  for (row = 0; row < SKETCH_DEPTH; row++) {
+    unsigned char *v = &cache->sketch[sketch_index(cache, h, row)];
+
+    if (*v < SKETCH_MAX) (*v)++;
+  }
+
+  if (++cache->sketch_adds >= 10ul * (cache->sketch_mask + 1)) {
+    for (i = 0; i < SKETCH_DEPTH * (cache->sketch_mask + 1); i++) {
+      cache->sketch[i] >>= 1;
+    }
+    cache->sketch_adds = 0;
+  }
+}
+
+/* segmented LRU, new entries go to probation and move to protected on a hit */
+
+static void lru_unlink(supl_cache_t *cache, struct supl_cache_entry_s *e) {
+  int s = e->segment;
+
+  if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+  else cache->lru_head[s] = e->lru_next;
+  if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+  else cache->lru_tail[s] = e->lru_prev;
+
+  e->lru_prev = e->lru_next = 0;
+  cache->seg_bytes[s] -= e->bytes;
+}
+
+static void lru_push(supl_cache_t *cache, struct supl_cache_entry_s *e, int s) {
+  e->segment = s;
+  e->lru_prev = 0;
+  e->lru_next = cache->lru_head[s];
+  if (e->lru_next) e->lru_next->lru_prev = e;
+  else cache->lru_tail[s] = e;
+  cache->lru_head[s] = e;
+  cache->seg_bytes[s] += e->bytes;
+}
+
+static void lru_touch(supl_cache_t *cache, struct supl_cache_entry_s *e) {
+  lru_unlink(cache, e);
+  lru_push(cache, e, SEG_PROTECTED);
+
+  /* protected gets 80% of the budget, the overflow goes back to probation */
+  while (cache->max_bytes && cache->seg_bytes[SEG_PROTECTED] > cache->max_bytes / 5 * 4 &&
+	 cache->lru_tail[SEG_PROTECTED] != e) {
+    struct supl_cache_entry_s *d = cache->lru_tail[SEG_PROTECTED];
+
+    lru_unlink(cache, d);
+    lru_push(cache, d, SEG_PROBATION);
+  }
+}
+
+static struct supl_alm_blob_s *alm_get(supl_cache_t *cache, supl_assist_t *a) {
+  struct supl_alm_blob_s *b;
+  size_t size = a->cnt_alm * sizeof(struct supl_almanac_s);
+  unsigned int h = 2166136261u ^ a->alm_week;
+  const unsigned char *p = (const unsigned char *)a->alm;
+  size_t i;
+
+  for (i = 0; i < size; i++) {
+    h = (h ^ p[i]) * 16777619u;
+  }
+
+  for (b = cache->almanac; b; b = b->next) {
+    if (b->hash == h && b->week == a->alm_week && b->cnt == a->cnt_alm && memcmp(b->alm, a->alm, size) == 0) {
+      b->refs++;
+      return b;
+    }
+  }
+
+  b = malloc(sizeof(struct supl_alm_blob_s) + size);
+  if (!b) return 0;
+
+  b->hash = h;
+  b->refs = 1;
+  b->week = a->alm_week;
+  b->cnt = a->cnt_alm;
+  memcpy(b->alm, a->alm, size);
+  b->next = cache->almanac;
+  cache->almanac = b;
+  cache->almanacs++;
+  cache->bytes += sizeof(struct supl_alm_blob_s) + size;
+
+  return b;
+}
+
+static void alm_put(supl_cache_t *cache, struct supl_alm_blob_s *b) {
+  struct supl_alm_blob_s **bp;
+
+  if (!b || --b->refs > 0) return;
+
+  for (bp = &cache->almanac; *bp != b; bp = &(*bp)->next);
+  *bp = b->next;
+
+  cache->almanacs--;
+  cache->bytes -= sizeof(struct supl_alm_blob_s) + b->cnt * sizeof(struct supl_almanac_s);
+  free(b);
+}
+
+static void entry_expand(struct supl_cache_entry_s *e, supl_cached_t *c) {
+  supl_assist_t *a = &c->assist;
+
+  a->set = e->set;
+  memcpy(c->at, e->at, sizeof(c->at));
+  a->time = e->time;
+  a->pos = e->pos;
+  a->iono = e->iono;
+  a->utc = e->utc;
+
+  a->cnt_eph = e->cnt_eph;
+  memcpy(a->eph, e->eph, e->cnt_eph * sizeof(struct supl_ephemeris_s));
+
+  a->cnt_acq = e->cnt_acq;
+  a->acq_time = e->acq_time;
+  memcpy(a->acq, e->acq, e->cnt_acq * sizeof(struct supl_acquis_s));
+
+  a->cnt_alm = 0;
+  if (e->alm) {
+    a->alm_week = e->alm->week;
+    a->cnt_alm = e->alm->cnt;
+    memcpy(a->alm, e->alm->alm, e->alm->cnt * sizeof(struct supl_almanac_s));
+  }
+}
+
+/*
+** Time the entry should be refreshed, before lead and jitter: when the
+** reference time gets stale or the first ephemeris expires. Ephemerides
+** which were already about to expire when last fetched belong to
+** satellites the server no longer sends and are not waited for.
+*/
+
+static time_t refresh_due(supl_cache_t *cache, supl_cached_t *c) {
+  time_t due = 0, fetched, t;
+  int i;
+
+  if (c->assist.set & SUPL_RRLP_ASSIST_REFTIME) {
+    due = c->at[part_index(SUPL_RRLP_ASSIST_REFTIME)] + cache->valid.time;
+  }
+
+  fetched = c->at[part_index(SUPL_RRLP_ASSIST_EPHEMERIS)];
+  for (i = 0; i < c->assist.cnt_eph; i++) {
+    t = supl_eph_expiry(c, i, &cache->valid);
+    if (t <= fetched + cache->refresh_lead) continue;
+    if (!due || t < due) due = t;
+  }
+
+  return due;
+}
+
+/*
+** Refresh-ahead schedule. Entries which can be refreshed are kept in a
+** binary heap by the time they may be, so the refresh thread only looks
+** at those due. Lookup counts are halved for every minute passed when
+** they are read, not by visiting every entry.
+*/
+
+static int entry_uses(supl_cache_t *cache, struct supl_cache_entry_s *e) {
+  unsigned int age = cache->use_epoch - e->use_epoch;
+
+  return age >= 8 * sizeof(int) ? 0 : e->uses >> age;
+}
+
+static void heap_set(supl_cache_t *cache, int i, struct supl_cache_entry_s *e) {
+  cache->refresh_heap[i] = e;
+  e->heap_at = i + 1;
+}
+
+static void heap_up(supl_cache_t *cache, int i) {
+  struct supl_cache_entry_s *e = cache->refresh_heap[i];
+
+  while (i > 0 && cache->refresh_heap[(i - 1) / 2]->refresh_at > e->refresh_at) {
+    heap_set(cache, i, cache->refresh_heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  heap_set(cache, i, e);
+}
+
+static void heap_down(supl_cache_t *cache, int i) {
+  struct supl_cache_entry_s *e = cache->refresh_heap[i];
+  int n = cache->refresh_heap_n, c;
+
+  while ((c = 2 * i + 1) < n) {
+    if (c + 1 < n && cache->refresh_heap[c + 1]->refresh_at < cache->refresh_heap[c]->refresh_at) c++;
+    if (cache->refresh_heap[c]->refresh_at >= e->refresh_at) break;
+    heap_set(cache, i, cache->refresh_heap[c]);
+    i = c;
+  }
+  heap_set(cache, i, e);
+}
+
+static void heap_remove(supl_cache_t *cache, struct supl_cache_entry_s *e) {
+  int i = e->heap_at - 1;
+
+  if (i < 0) return;
+
+  e->heap_at = 0;
+  if (i == --cache->refresh_heap_n) return;
+
+  heap_set(cache, i, cache->refresh_heap[cache->refresh_heap_n]);
+  heap_up(cache, i);
+  heap_down(cache, cache->refresh_heap[i] == e ? i : cache->refresh_heap[i]->heap_at - 1);
+}
+
+// (re)place e in the heap by when it may be refreshed, called with cache->lock held
+static void refresh_schedule(supl_cache_t *cache, struct supl_cache_entry_s *e) {
+  time_t at;
+
+  if (!e->has_param || !e->due || e->refreshing) {
+    heap_remove(cache, e);
+    return;
+  }
+
+  /* refresh_lead, less the jitter, before it goes stale */
+  at = e->due - cache->refresh_lead - e->jitter;
+  e->refresh_at = e->retry_at > at ? e->retry_at : at;
+
+  if (!e->heap_at) {
+    if (cache->refresh_heap_n == cache->refresh_heap_alloc) {
+      int alloc = cache->refresh_heap_alloc ? 2 * cache->refresh_heap_alloc : 64;
+      struct supl_cache_entry_s **heap = realloc(cache->refresh_heap, alloc * sizeof(*heap));
+
+      if (!heap) return;
+      cache->refresh_heap = heap;
+      cache->refresh_heap_alloc = alloc;
+    }
+    heap_set(cache, cache->refresh_heap_n++, e);
+  }
+
+  heap_up(cache, e->heap_at - 1);
+  heap_down(cache, e->heap_at - 1);
+}
+
+static void entry_use(supl_cache_t *cache, struct supl_cache_entry_s *e) {
+  e->uses = entry_uses(cache, e) + 1;
+  e->use_epoch = cache->use_epoch;
+
+  /* dropped from the heap while cold */
+  if (!e->heap_at) refresh_schedule(cache, e);
+}
+
+// replace the data of e with c, called with cache->lock held
+static int entry_store(supl_cache_t *cache, struct supl_cache_entry_s *e, supl_cached_t *c) {
+  supl_assist_t *a = &c->assist;
+  struct supl_ephemeris_s *eph = 0;
+  struct supl_acquis_s *acq = 0;
+  struct supl_alm_blob_s *alm = 0;
+  size_t bytes;
+
+  if (a->cnt_eph && !(eph = malloc(a->cnt_eph * sizeof(struct supl_ephemeris_s)))) goto fail;
+  if (a->cnt_acq && !(acq = malloc(a->cnt_acq * sizeof(struct supl_acquis_s)))) goto fail;
+  if ((a->set & SUPL_RRLP_ASSIST_ALMANAC) && a->cnt_alm && !(alm = alm_get(cache, a))) goto fail;
+
+  free(e->eph);
+  free(e->acq);
+  alm_put(cache, e->alm);
+
+  e->set = a->set;
+  memcpy(e->at, c->at, sizeof(e->at));
+  e->time = a->time;
+  e->pos = a->pos;
+  e->iono = a->iono;
+  e->utc = a->utc;
+
+  e->cnt_eph = a->cnt_eph;
+  e->eph = eph;
+  memcpy(eph, a->eph, a->cnt_eph * sizeof(struct supl_ephemeris_s));
+
+  e->cnt_acq = a->cnt_acq;
+  e->acq_time = a->acq_time;
+  e->acq = acq;
+  memcpy(acq, a->acq, a->cnt_acq * sizeof(struct supl_acquis_s));
+
+  e->alm = alm;
+  e->due = refresh_due(cache, c);
+  refresh_schedule(cache, e);
+
+  bytes = sizeof(struct supl_cache_entry_s) +
+    a->cnt_eph * sizeof(struct supl_ephemeris_s) + a->cnt_acq * sizeof(struct supl_acquis_s);
+
+  if (e->lru_prev || cache->lru_head[e->segment] == e) {
+    cache->seg_bytes[e->segment] += bytes - e->bytes;
+  }
+  cache->bytes += bytes - e->bytes;
+  e->bytes = bytes;
+
+  return 0;
+
+ fail:
+  free(eph);
+  free(acq);
+  alm_put(cache, alm);
+  return E_SUPL_INTERNAL;
+}
+
+static struct supl_cache_entry_s *cache_find(supl_cache_t *cache, supl_cache_key_t *key) {
+  unsigned int b = key_hash(key) % cache->size;
+  struct supl_cache_entry_s *e;
+
+  for (e = cache->bucket[b]; e; e = e->next) {
+    if (memcmp(&e->key, key, sizeof(supl_cache_key_t)) == 0) return e;
+  }
+
+  return 0;
+}
+
+/*
+** Grid squares. Time, the models, ephemerides and almanac are the same for
+** SETs a few kilometres apart, only reference location and acquisition
+** assistance are local. With grid_km set the shared parts are kept once
+** per grid square, under a key of their own, and a cell entry keeps the
+** local parts and the square it is in. Rows are grid_km high and have
+** fewer squares towards the poles, so squares are about grid_km wide
+** everywhere.
+*/
+
+static void grid_of(supl_cache_t *cache, double lat, double lon, int *grid) {
+  double h = cache->grid_km / KM_PER_DEG;
+  int rows = ceil(180.0 / h), cols;
+
+  grid[0] = floor((lat + 90.0) / h);
+  if (grid[0] < 0) grid[0] = 0;
+  if (grid[0] >= rows) grid[0] = rows - 1;
+
+  cols = floor(360.0 * cos((-90.0 + (grid[0] + 0.5) * h) * RAD) / h);
+  if (cols < 1) cols = 1;
+
+  grid[1] = floor((lon + 180.0) / 360.0 * cols);
+  if (grid[1] < 0) grid[1] = 0;
+  if (grid[1] >= cols) grid[1] = cols - 1;
+}
+
+static void grid_key(supl_cache_t *cache, supl_cache_key_t *gk, char *server, int *grid) {
+  memset(gk, 0, sizeof(supl_cache_key_t));
+
+  memcpy(gk->server, server, sizeof(gk->server));
+  gk->set = GRID_KEY;
+  gk->gsm[0] = grid[0];
+  gk->gsm[1] = grid[1];
+  gk->gsm[2] = cache->grid_km;
+}
+
+// parts of src over dst, with their fetch times
+static void cached_take(supl_cached_t *dst, supl_cached_t *src, int parts) {
+  supl_assist_t *d = &dst->assist, *a = &src->assist;
+  int i;
+
+  parts &= a->set;
+
+  if (parts & SUPL_RRLP_ASSIST_REFTIME) d->time = a->time;
+  if (parts & SUPL_RRLP_ASSIST_REFLOC) d->pos = a->pos;
+  if (parts & SUPL_RRLP_ASSIST_IONO) d->iono = a->iono;
+  if (parts & SUPL_RRLP_ASSIST_UTC) d->utc = a->utc;
+
+  if (parts & SUPL_RRLP_ASSIST_EPHEMERIS) {
+    d->cnt_eph = a->cnt_eph;
+    memcpy(d->eph, a->eph, a->cnt_eph * sizeof(struct supl_ephemeris_s));
+  }
+
+  if (parts & SUPL_RRLP_ASSIST_ALMANAC) {
+    d->alm_week = a->alm_week;
+    d->cnt_alm = a->cnt_alm;
+    memcpy(d->alm, a->alm, a->cnt_alm * sizeof(struct supl_almanac_s));
+  }
+
+  if (parts & SUPL_RRLP_ASSIST_ACQUIS) {
+    d->acq_time = a->acq_time;
+    d->cnt_acq = a->cnt_acq;
+    memcpy(d->acq, a->acq, a->cnt_acq * sizeof(struct supl_acquis_s));
+  }
+
+  for (i = 0; i < SUPL_ASSIST_PARTS; i++) {
+    if (parts & (1 << i)) dst->at[i] = src->at[i];
+  }
+
+  d->set |= parts;
+}
+
+static void entry_free(supl_cache_t *cache, struct supl_cache_entry_s *e) {
+  struct supl_cache_entry_s **ep = &cache->bucket[key_hash(&e->key) % cache->size];
+
+  while (*ep != e) ep = &(*ep)->next;
+  *ep = e->next;
+
+  lru_unlink(cache, e);
+  heap_remove(cache, e);
+  alm_put(cache, e->alm);
+  free(e->eph);
+  free(e->acq);
+
+  cache->bytes -= e->bytes;
+  cache->entries--;
+  free(e);
+}
+
+// next entry to evict, coldest of probation first, never keep
+static struct supl_cache_entry_s *cache_victim(supl_cache_t *cache, struct supl_cache_entry_s *keep) {
+  struct supl_cache_entry_s *victim = cache->lru_tail[SEG_PROBATION];
+
+  if (victim == keep) victim = victim->lru_prev;
+  if (!victim) victim = cache->lru_tail[SEG_PROTECTED];
+  if (victim == keep) victim = victim->lru_prev;
+
+  return victim;
+}
+
+/*
+** Evict until the budget holds, keeping keep. With a candidate, the
+** first victim must be less popular than it or the candidate is turned
+** away instead (TinyLFU admission) and nothing is evicted, returns 0
+** then.
+*/
+
+static int cache_make_room(supl_cache_t *cache, struct supl_cache_entry_s *keep, int candidate_freq) {
+  struct supl_cache_entry_s *victim;
+
+  if (!cache->max_bytes || cache->bytes <= cache->max_bytes) return 1;
+
+  victim = cache_victim(cache, keep);
+  if (candidate_freq >= 0 && victim && sketch_estimate(cache, key_hash(&victim->key)) >= candidate_freq) return 0;
+
+  while (cache->bytes > cache->max_bytes) {
+    victim = cache_victim(cache, keep);
+    if (!victim) return 0;
+
+    entry_free(cache, victim);
+    cache->evictions++;
+  }
+
+  return 1;
+}
+
+/* merge assist into the entry of key, creating it if admitted */
+static void cache_merge(supl_cache_t *cache, supl_cache_key_t *key, supl_assist_t *assist, supl_cached_t *c) {
+  struct supl_cache_entry_s *e = cache_find(cache, key);
+  unsigned int b;
+
+  memset(c, 0, sizeof(supl_cached_t));
+  if (e) entry_expand(e, c);
+  supl_cached_merge(c, assist, time(0));
+
+  if (e) {
+    if (entry_store(cache, e, c) == 0) cache_make_room(cache, e, -1);
+    return;
+  }
+
+  e = calloc(1, sizeof(struct supl_cache_entry_s));
+  if (!e) return;
+
+  e->key = *key;
+  e->use_epoch = cache->use_epoch;
+  e->jitter = cache->refresh_lead > 1 ? rand_r(&cache->refresh_seed) % (cache->refresh_lead / 2) : 0;
+
+  if (entry_store(cache, e, c) < 0) {
+    free(e);
+    return;
+  }
+
+  b = key_hash(key) % cache->size;
+  e->next = cache->bucket[b];
+  cache->bucket[b] = e;
+  cache->entries++;
+  lru_push(cache, e, SEG_PROBATION);
+
+  if (!cache_make_room(cache, e, sketch_estimate(cache, key_hash(key)))) {
+    entry_free(cache, e);
+    cache->rejections++;
+  }
+}
+
+/*
+** Merge assist under key. With grid squares the shared parts go to the
+** square of the cell, at pos if its position is known or else at the
+** reference location, and the cell keeps the local parts. c gets the
+** merged view.
+*/
+
+static void cache_store(supl_cache_t *cache, supl_cache_key_t *key, supl_cell_pos_t *pos,
+			supl_assist_t *assist, supl_cached_t *c) {
+  struct supl_cache_entry_s *e = cache_find(cache, key);
+  supl_cache_key_t gk;
+  supl_cached_t shared;
+  supl_assist_t part;
+  int grid[2];
+
+  if (!cache->grid_km) {
+    cache_merge(cache, key, assist, c);
+    return;
+  }
+
+  if (pos) {
+    grid_of(cache, pos->lat, pos->lon, grid);
+  } else if (assist->set & SUPL_RRLP_ASSIST_REFLOC) {
+    grid_of(cache, assist->pos.lat, assist->pos.lon, grid);
+  } else if (e && e->has_grid) {
+    grid[0] = e->grid[0];
+    grid[1] = e->grid[1];
+  } else {
+    cache_merge(cache, key, assist, c);
+    return;
+  }
+
+  grid_key(cache, &gk, key->server, grid);
+
+  part = *assist;
+  part.set &= ~SUPL_ASSIST_LOCAL;
+  if (part.set) {
+    cache_merge(cache, &gk, &part, &shared);
+  } else {
+    struct supl_cache_entry_s *g = cache_find(cache, &gk);
+
+    memset(&shared, 0, sizeof(shared));
+    if (g) entry_expand(g, &shared);
+  }
+
+  part.set = assist->set & SUPL_ASSIST_LOCAL;
+  cache_merge(cache, key, &part, c);
+
+  e = cache_find(cache, key);
+  if (e) {
+    e->has_grid = 1;
+    e->grid[0] = grid[0];
+    e->grid[1] = grid[1];
+  }
+
+  cached_take(c, &shared, ~SUPL_ASSIST_LOCAL);
+}
+
+/*
+** Cached data for key: the cell entry with the shared parts of its grid
+** square. A cell not seen before gets the shared parts of the square at
+** pos, if given, and pos as its reference location. Returns 0 if there
+** is nothing, 2 if the data is from the square only. Lookups, with touch,
+** count as uses of both.
+*/
+
+static int cache_view(supl_cache_t *cache, supl_cache_key_t *key, supl_cell_pos_t *pos, supl_cached_t *c, int touch) {
+  struct supl_cache_entry_s *e, *g;
+  supl_cache_key_t gk;
+  supl_cached_t shared;
+  int grid[2];
+
+  memset(c, 0, sizeof(supl_cached_t));
+
+  e = cache_find(cache, key);
+  if (e) {
+    entry_expand(e, c);
+    if (touch) {
+      entry_use(cache, e);
+      lru_touch(cache, e);
+    }
+    if (!e->has_grid) return 1;
+    grid_key(cache, &gk, key->server, e->grid);
+  } else {
+    if (!cache->grid_km || !pos) return 0;
+    grid_of(cache, pos->lat, pos->lon, grid);
+    grid_key(cache, &gk, key->server, grid);
+  }
+
+  if (touch) sketch_add(cache, key_hash(&gk));
+
+  g = cache_find(cache, &gk);
+  if (g) {
+    memset(&shared, 0, sizeof(shared));
+    entry_expand(g, &shared);
+    cached_take(c, &shared, ~SUPL_ASSIST_LOCAL);
+    if (touch) {
+      entry_use(cache, g);
+      lru_touch(cache, g);
+    }
+  }
+
+  if (e) return 1;
+  if (!g) return 0;
+
+  c->assist.set |= SUPL_RRLP_ASSIST_REFLOC;
+  c->assist.pos.lat = pos->lat;
+  c->assist.pos.lon = pos->lon;
+  c->assist.pos.uncertainty = pos->uncert;
+  c->at[part_index(SUPL_RRLP_ASSIST_REFLOC)] = time(0);
+
+  return 2;
+}
+
+int EXPORT supl_cache_new(supl_cache_t *cache, int size) {
+  int width = 1024;
+
+  memset(cache, 0, sizeof(supl_cache_t));
+
+  if (size <= 0) size = 1021;
+
+  /* about four counters per entry the table is sized for */
+  while (width < 4 * size) width <<= 1;
+
+  cache->bucket = calloc(size, sizeof(struct supl_cache_entry_s *));
+  cache->sketch = calloc(SKETCH_DEPTH, width);
+  if (!cache->bucket || !cache->sketch) {
+    free(cache->bucket);
+    free(cache->sketch);
+    return E_SUPL_INTERNAL;
+  }
+
+  cache->size = size;
+  cache->sketch_mask = width - 1;
+  cache->valid = default_valid;
+  cache->required = SUPL_RRLP_ASSIST_REFTIME | SUPL_RRLP_ASSIST_EPHEMERIS;
+  cache->min_eph = 4;
+  cache->refresh_lead = 300;
+  cache->refresh_hot = 2;
+  cache->refresh_timeout = REFRESH_TIMEOUT;
+  cache->refresh_seed = time(0) ^ (unsigned long)cache;
+  cache->prefetch_max = 64;
+  pthread_mutex_init(&cache->lock, 0);
+  pthread_cond_init(&cache->refresh_cond, 0);
+
+  return 0;
+}
+
+void EXPORT supl_cache_free(supl_cache_t *cache) {
+  int i;
+
+  supl_cache_refresh_stop(cache);
+
+  while (cache->prefetch_head) {
+    struct supl_prefetch_s *q = cache->prefetch_head;
+
+    cache->prefetch_head = q->next;
+    free(q);
+  }
+
+  for (i = 0; i < cache->size; i++) {
+    while (cache->bucket[i]) entry_free(cache, cache->bucket[i]);
+  }
+  free(cache->bucket);
+  free(cache->sketch);
+  free(cache->refresh_heap);
+  pthread_cond_destroy(&cache->refresh_cond);
+  pthread_mutex_destroy(&cache->lock);
+
+  memset(cache, 0, sizeof(supl_cache_t));
+}
+
+void EXPORT supl_cache_get_stats(supl_cache_t *cache, supl_cache_stats_t *stats) {
+  pthread_mutex_lock(&cache->lock);
+
+  stats->hits = cache->hits;
+  stats->misses = cache->misses;
+  stats->evictions = cache->evictions;
+  stats->rejections = cache->rejections;
+  stats->shared = cache->shared;
+  stats->flights = cache->flights;
+  stats->coalesced = cache->coalesced;
+  stats->refreshes = cache->refreshes;
+  stats->refresh_failures = cache->refresh_failures;
+  stats->prefetches = cache->prefetches;
+  stats->prefetch_used = cache->prefetch_used;
+  stats->prefetch_dropped = cache->prefetch_dropped;
+  stats->entries = cache->entries;
+  stats->almanacs = cache->almanacs;
+  stats->bytes = cache->bytes;
+  stats->max_bytes = cache->max_bytes;
+
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/* does assist have all of required and, if ephemerides are required, at least min_eph of them */
+int EXPORT supl_assist_enough(supl_assist_t *assist, int required, int min_eph) {
+  if ((assist->set & required) != required) return 0;
+
+  return !(required & SUPL_RRLP_ASSIST_EPHEMERIS) || assist->cnt_eph >= min_eph;
+}
+
+// called with cache->lock held
+static int cache_lookup(supl_cache_t *cache, supl_cache_key_t *key, supl_cell_pos_t *pos, int required,
+			supl_assist_t *assist) {
+  supl_cached_t c;
+  struct timeval now;
+  int ok = 0, found;
+
+  gettimeofday(&now, 0);
+
+  sketch_add(cache, key_hash(key));
+
+  found = cache_view(cache, key, pos, &c, 1);
+  if (found) {
+    supl_assist_fresh(&c, &cache->valid, &now, assist);
+    ok = supl_assist_enough(assist, required, cache->min_eph);
+  }
+
+  if (ok) cache->hits++;
+  else cache->misses++;
+  if (ok && found == 2) cache->shared++;
+
+  if (ok && found == 1) {
+    struct supl_cache_entry_s *e = cache_find(cache, key);
+
+    if (e && e->prefetched) {
+      e->prefetched = 0;
+      cache->prefetch_used++;
+    }
+  }
+
+  return ok;
+}
+
+/* fresh data for the key, 0 if the cache can not satisfy cache->required */
+int EXPORT supl_cache_lookup(supl_cache_t *cache, supl_cache_key_t *key, supl_assist_t *assist) {
+  return supl_cache_lookup_at(cache, key, 0, assist);
+}
+
+/*
+** The same, but a cell not seen before can be served from the grid
+** square at pos, see supl_cache_t.grid_km
+*/
+
+int EXPORT supl_cache_lookup_at(supl_cache_t *cache, supl_cache_key_t *key, supl_cell_pos_t *pos, supl_assist_t *assist) {
+  int ok;
+
+  pthread_mutex_lock(&cache->lock);
+  ok = cache_lookup(cache, key, pos, cache->required, assist);
+  pthread_mutex_unlock(&cache->lock);
+
+  return ok;
+}
+
+void EXPORT supl_cache_put(supl_cache_t *cache, supl_cache_key_t *key, supl_assist_t *assist) {
+  supl_cached_t c;
+
+  pthread_mutex_lock(&cache->lock);
+  cache_store(cache, key, 0, assist, &c);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// called with cache->lock held
+static void flight_release(supl_cache_t *cache, struct supl_flight_s *f) {
+  if (--f->refs > 0) return;
+
+  pthread_cond_destroy(&f->cond);
+  free(f);
+}
+
+/*
+** Fetch for key from the network, called with cache->lock held and
+** returns with it released. Concurrent fetches for the same key and
+** request wait for the session of the first one instead of starting their
+** own.
+*/
+
+static int cache_fetch(supl_cache_t *cache, supl_cache_key_t *key, supl_cell_pos_t *pos,
+		       supl_ctx_t *ctx, char *server, supl_assist_t *assist) {
+  struct supl_flight_s *f, **fp;
+  struct supl_cache_entry_s *e;
+  supl_cache_key_t gk;
+  supl_cached_t c;
+  supl_param_t p;
+  struct timeval now;
+  int err, found;
+
+  for (f = cache->flight; f; f = f->next) {
+    if (f->request == ctx->p.request && memcmp(&f->key, key, sizeof(supl_cache_key_t)) == 0) break;
+  }
+
+  if (f) {
+    cache->coalesced++;
+    f->refs++;
+
+    while (!f->done) {
+      pthread_cond_wait(&f->cond, &cache->lock);
+    }
+
+    err = f->err;
+    if (err == 0) memcpy(assist, &f->assist, sizeof(supl_assist_t));
+
+    flight_release(cache, f);
+    pthread_mutex_unlock(&cache->lock);
+
+    return err;
+  }
+
+  f = calloc(1, sizeof(struct supl_flight_s));
+  if (!f) {
+    pthread_mutex_unlock(&cache->lock);
+    return E_SUPL_INTERNAL;
+  }
+
+  f->key = *key;
+  f->request = ctx->p.request;
+  f->refs = 1;
+  pthread_cond_init(&f->cond, 0);
+  f->next = cache->flight;
+  cache->flight = f;
+  cache->flights++;
+
+  /* ask only for what has expired */
+  p = ctx->p;
+  found = cache_view(cache, key, pos, &c, 0);
+  supl_assist_plan(ctx, found ? &c : 0, &cache->valid);
+
+  pthread_mutex_unlock(&cache->lock);
+
+  if (!key->server[0] && cache->pool) err = supl_get_assist_pool(ctx, cache->pool, &f->assist);
+  else err = supl_get_assist(ctx, server, &f->assist);
+  ctx->p = p;
+
+  pthread_mutex_lock(&cache->lock);
+
+  if (err == 0) {
+    cache_store(cache, key, pos, &f->assist, &c);
+
+    /* the square is refreshed with the parameters of its last cell */
+    e = cache_find(cache, key);
+    if (e) {
+      e->p = p;
+      e->has_param = 1;
+      refresh_schedule(cache, e);
+      if (e->has_grid) {
+	grid_key(cache, &gk, key->server, e->grid);
+	e = cache_find(cache, &gk);
+	if (e) {
+	  e->p = p;
+	  e->has_param = 1;
+	  refresh_schedule(cache, e);
+	}
+      }
+    }
+
+    /* the reply may be partial, hand out the merged data */
+    gettimeofday(&now, 0);
+    supl_assist_fresh(&c, &cache->valid, &now, &f->assist);
+    memcpy(assist, &f->assist, sizeof(supl_assist_t));
+  }
+
+  for (fp = &cache->flight; *fp != f; fp = &(*fp)->next);
+  *fp = f->next;
+
+  f->err = err;
+  f->done = 1;
+  pthread_cond_broadcast(&f->cond);
+  flight_release(cache, f);
+
+  pthread_mutex_unlock(&cache->lock);
+
+  return err;
+}
+
+/*
+** supl_get_assist() which goes to the network only when the cached data for
+** the server and cell has expired. With server 0 the data is kept for the
+** cell only and fetched from the best server of cache->pool. The almanac
+** is required on top of cache->required when ctx requests it.
+*/
+
+int EXPORT supl_get_assist_cached(supl_cache_t *cache, supl_ctx_t *ctx, char *server, supl_assist_t *assist) {
+  supl_cache_key_t key;
+  supl_cell_pos_t pos, *at = 0;
+  int required = cache->required;
+
+  if (ctx->p.request & SUPL_REQUEST_ALMANAC) required |= SUPL_RRLP_ASSIST_ALMANAC;
+
+  supl_cache_key(&key, ctx, server);
+
+  /* a known cell position finds the grid square of a new cell */
+  if (ctx->p.known.lat != 0 || ctx->p.known.lon != 0) {
+    pos.lat = ctx->p.known.lat;
+    pos.lon = ctx->p.known.lon;
+    pos.uncert = ctx->p.known.uncert;
+    at = &pos;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+
+  if (cache_lookup(cache, &key, at, required, assist)) {
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+  }
+
+  return cache_fetch(cache, &key, at, ctx, server, assist);
+}
+
+/*
+** Hot entry due for refresh, soonest first, called with cache->lock held.
+** Cold ones due are dropped from the heap until looked up again.
+*/
+
+static struct supl_cache_entry_s *refresh_pick(supl_cache_t *cache, time_t now) {
+  struct supl_cache_entry_s *e;
+
+  while (cache->refresh_heap_n && (e = cache->refresh_heap[0])->refresh_at <= now) {
+    heap_remove(cache, e);
+    if (entry_uses(cache, e) >= cache->refresh_hot) return e;
+  }
+
+  return 0;
+}
+
+// a session of the refresh thread, bounded and cancelled by supl_cache_refresh_stop()
+static void refresh_ctx(supl_cache_t *cache, supl_ctx_t *ctx, supl_param_t *p) {
+  supl_ctx_new(ctx);
+  ctx->p = *p;
+  if (cache->tls) supl_set_tls(ctx, cache->tls);
+  supl_set_cancel_fd(ctx, cache->refresh_cancel[0]);
+  supl_set_timeout(ctx, cache->refresh_timeout);
+}
+
+static void *refresh_main(void *arg) {
+  supl_cache_t *cache = arg;
+  double tokens = cache->refresh_burst;
+  time_t last = time(0), decayed = last;
+
+  pthread_mutex_lock(&cache->lock);
+
+  while (cache->refresh_run) {
+    struct supl_cache_entry_s *e;
+    struct timespec deadline;
+    time_t now = time(0);
+
+    /* token bucket */
+    tokens += (now - last) * cache->refresh_rate;
+    if (tokens > cache->refresh_burst) tokens = cache->refresh_burst;
+    last = now;
+
+    /* hotness is lookups in roughly the last minute */
+    if (now - decayed >= 60) {
+      cache->use_epoch++;
+      decayed = now;
+    }
+
+    while (cache->refresh_run && tokens >= 1.0 && (e = refresh_pick(cache, now))) {
+      supl_cache_key_t picked = e->key, key = e->key;
+      supl_assist_t assist;
+      supl_ctx_t ctx;
+      int err;
+
+      tokens -= 1.0;
+      e->refreshing = 1;
+
+      refresh_ctx(cache, &ctx, &e->p);
+
+      /* a grid square is fetched as the cell it was last fetched for */
+      if (key.set == GRID_KEY) supl_cache_key(&key, &ctx, picked.server);
+
+      err = cache_fetch(cache, &key, 0, &ctx, picked.server, &assist);
+      supl_ctx_free(&ctx);
+
+      pthread_mutex_lock(&cache->lock);
+
+      e = cache_find(cache, &picked);
+      if (e) {
+	e->refreshing = 0;
+	e->jitter = cache->refresh_lead > 1 ? rand_r(&cache->refresh_seed) % (cache->refresh_lead / 2) : 0;
+	if (err < 0) e->retry_at = time(0) + REFRESH_RETRY;
+	refresh_schedule(cache, e);
+      }
+
+      if (err < 0) cache->refresh_failures++;
+      else cache->refreshes++;
+    }
+
+    /* predicted cells get what the refreshes leave */
+    while (cache->refresh_run && tokens >= 1.0 && cache->prefetch_head) {
+      struct supl_prefetch_s *q = cache->prefetch_head;
+      supl_assist_t assist;
+      supl_ctx_t ctx;
+      int err;
+
+      cache->prefetch_head = q->next;
+      if (!cache->prefetch_head) cache->prefetch_tail = 0;
+      cache->prefetch_queued--;
+      tokens -= 1.0;
+
+      refresh_ctx(cache, &ctx, &q->p);
+
+      err = cache_fetch(cache, &q->key, 0, &ctx, q->key.server, &assist);
+      supl_ctx_free(&ctx);
+
+      pthread_mutex_lock(&cache->lock);
+
+      if (err == 0) {
+	e = cache_find(cache, &q->key);
+	if (e) e->prefetched = 1;
+	cache->prefetches++;
+      }
+      free(q);
+    }
+
+    deadline.tv_sec = time(0) + 1;
+    deadline.tv_nsec = 0;
+    pthread_cond_timedwait(&cache->refresh_cond, &cache->lock, &deadline);
+  }
+
+  pthread_mutex_unlock(&cache->lock);
+
+  return 0;
+}
+
+/*
+** Queue a background fetch of the cell in p from server, for a cell a SET
+** is expected to move to. The refresh thread fetches it with the tokens
+** the refreshes leave, so prefetches never delay them. Cells which are
+** fresh, queued or being fetched already are skipped, and everything is
+** dropped while prefetch_max cells wait. Returns 1 if the cell was queued.
+*/
+
+int EXPORT supl_cache_prefetch(supl_cache_t *cache, char *server, supl_param_t *p) {
+  struct supl_prefetch_s *q;
+  struct supl_flight_s *f;
+  supl_cache_key_t key;
+  supl_assist_t assist;
+  struct timeval now;
+  supl_cached_t c;
+  supl_ctx_t ctx;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.p = *p;
+  supl_cache_key(&key, &ctx, server);
+
+  pthread_mutex_lock(&cache->lock);
+
+  if (!cache->refresh_run) goto skip;
+
+  /* the predicted visit counts for admission like a lookup would */
+  sketch_add(cache, key_hash(&key));
+
+  for (q = cache->prefetch_head; q; q = q->next) {
+    if (memcmp(&q->key, &key, sizeof(supl_cache_key_t)) == 0) goto skip;
+  }
+  for (f = cache->flight; f; f = f->next) {
+    if (memcmp(&f->key, &key, sizeof(supl_cache_key_t)) == 0) goto skip;
+  }
+
+  if (cache_view(cache, &key, 0, &c, 0)) {
+    gettimeofday(&now, 0);
+    supl_assist_fresh(&c, &cache->valid, &now, &assist);
+    if (supl_assist_enough(&assist, cache->required, cache->min_eph)) goto skip;
+  }
+
+  if (cache->prefetch_queued >= cache->prefetch_max) {
+    cache->prefetch_dropped++;
+    goto skip;
+  }
+
+  q = malloc(sizeof(struct supl_prefetch_s));
+  if (!q) goto skip;
+
+  q->next = 0;
+  q->key = key;
+  q->p = *p;
+  if (cache->prefetch_tail) cache->prefetch_tail->next = q;
+  else cache->prefetch_head = q;
+  cache->prefetch_tail = q;
+  cache->prefetch_queued++;
+
+  pthread_cond_signal(&cache->refresh_cond);
+  pthread_mutex_unlock(&cache->lock);
+
+  return 1;
+
+ skip:
+  pthread_mutex_unlock(&cache->lock);
+  return 0;
+}
+
+/*
+** Start a thread which refetches assistance of hot keys shortly before it
+** expires, at most rate sessions per second with bursts of burst. Only
+** entries filled by supl_get_assist_cached() are refreshed, as the
+** request parameters are needed.
+*/
+
+int EXPORT supl_cache_refresh_start(supl_cache_t *cache, double rate, int burst) {
+  if (cache->refresh_run) return 0;
+
+  cache->refresh_rate = rate > 0 ? rate : 1.0;
+  cache->refresh_burst = burst > 0 ? burst : 1;
+  if (pipe(cache->refresh_cancel) < 0) return E_SUPL_INTERNAL;
+  cache->refresh_run = 1;
+
+  if (pthread_create(&cache->refresh_thread, 0, refresh_main, cache) != 0) {
+    cache->refresh_run = 0;
+    close(cache->refresh_cancel[0]);
+    close(cache->refresh_cancel[1]);
+    return E_SUPL_INTERNAL;
+  }
+
+  return 0;
+}
+
+void EXPORT supl_cache_refresh_stop(supl_cache_t *cache) {
+  if (!cache->refresh_run) return;
+
+  pthread_mutex_lock(&cache->lock);
+  cache->refresh_run = 0;
+  pthread_cond_signal(&cache->refresh_cond);
+  pthread_mutex_unlock(&cache->lock);
+
+  /* end the session it may be waiting for, left readable for any later one */
+  (void)write(cache->refresh_cancel[1], "x", 1);
+
+  pthread_join(cache->refresh_thread, 0);
+
+  close(cache->refresh_cancel[0]);
+  close(cache->refresh_cancel[1]);
+}
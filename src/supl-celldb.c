@@ -0,0 +1,112 @@
+/*
+** supl-celldb - build and query the cell id to position index
+**
+** Copyright (c) 2007 Tatu Mannisto <tatu a-t tajuma d-o-t com>
+** All rights reserved.
+** Redistribution and modifications are permitted subject to BSD license.
+**
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "supl.h"
+
+static void usage(char *progname) {
+  fprintf(stderr,
+	  "Usage:\n"
+	  "%s [options] index [csv-file]\n"
+	  "Options:\n"
+	  "  --lookup gsm:mcc,mnc:lac,ci	print the position of the cell\n"
+	  "  --help			show this help\n"
+	  "Without --lookup the index is built from the CSV file, or from\n"
+	  "standard input. Rows are mcc,mnc,lac,ci,lat,lon,range or OpenCellID\n"
+	  "radio,mcc,net,area,cell,unit,lon,lat,range,...\n",
+	  progname);
+}
+
+static struct option long_opts[] = {
+  { "lookup", 1, 0, 0 },
+  { "help", 0, 0, 'h' },
+  { 0, 0, 0, 0 }
+};
+
+static int lookup(char *index, char *cell) {
+  supl_celldb_t db;
+  supl_cell_pos_t pos;
+  int mcc, mnc, lac, ci, err;
+
+  if (sscanf(cell, "gsm:%d,%d:%x,%x", &mcc, &mnc, &lac, &ci) != 4) {
+    fprintf(stderr, "Ugh, cell\n");
+    return 1;
+  }
+
+  err = supl_celldb_open(&db, index);
+  if (err < 0) {
+    fprintf(stderr, "Error: open %s (%d)\n", index, err);
+    return 1;
+  }
+
+  if (!supl_celldb_lookup(&db, mcc, mnc, lac, ci, &pos)) {
+    fprintf(stderr, "Cell not found\n");
+    supl_celldb_close(&db);
+    return 1;
+  }
+
+  /* the same as the position part of --cell */
+  printf("%f,%f,%d\n", pos.lat, pos.lon, pos.uncert);
+  supl_celldb_close(&db);
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  char *cell = 0, *index;
+  unsigned long skipped = 0;
+  FILE *in = stdin;
+  long n;
+  int c, opt_index;
+
+  while ((c = getopt_long(argc, argv, "h", long_opts, &opt_index)) != -1) {
+    switch (c) {
+    case 0:
+      cell = optarg;
+      break;
+    case 'h':
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (optind >= argc || optind + 2 < argc) {
+    usage(argv[0]);
+    exit(1);
+  }
+  index = argv[optind++];
+
+  if (cell) return lookup(index, cell);
+
+  if (optind < argc) {
+    in = fopen(argv[optind], "r");
+    if (!in) {
+      fprintf(stderr, "Error: open %s (%s)\n", argv[optind], strerror(errno));
+      exit(1);
+    }
+  }
+
+  n = supl_celldb_build(in, index, &skipped);
+  if (in != stdin) fclose(in);
+
+  if (n < 0) {
+    fprintf(stderr, "Error: build %s (%ld)\n", index, n);
+    exit(1);
+  }
+
+  fprintf(stderr, "%ld cells, %lu rows skipped\n", n, skipped);
+
+  return 0;
+}
@@ -0,0 +1,329 @@
+/*
+** SUPL library - cell id to position index in a memory mapped file
+**
+** Copyright (c) 2007 Tatu Mannisto <tatu a-t tajuma d-o-t com>
+** All rights reserved.
+** Redistribution and modifications are permitted subject to BSD license.
+**
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "supl.h"
+
+/*
+** File layout: a header, the sorted cell keys, the positions in the same
+** order and every CELLDB_BLOCK'th key again as fences. A lookup binary
+** searches the fences, which stay in the CPU cache, and then one block of
+** keys, so it touches a couple of pages at most. Nothing is parsed on
+** open, the file is used as mapped.
+*/
+
+#define CELLDB_MAGIC 0x4c4c4543 /* "CELL" */
+#define CELLDB_VERSION 1
+#define CELLDB_BLOCK 64
+
+struct celldb_header_s {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t cells;
+  uint32_t block;
+  uint32_t pos_size;
+  uint64_t fences;
+  uint64_t key_off, pos_off, fence_off;
+};
+
+struct celldb_pos_s {
+  int32_t lat, lon; /* 1e-7 degrees */
+  uint32_t range;   /* meters */
+};
+
+// one CSV row while building
+struct celldb_row_s {
+  uint64_t key;
+  struct celldb_pos_s pos;
+};
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+/* mcc and mnc 10 bits, lac 16 bits and ci 28 bits, 0 if they do not fit */
+static uint64_t cell_key(long mcc, long mnc, long lac, long ci) {
+  if (mcc <= 0 || mcc >= 1 << 10 || mnc < 0 || mnc >= 1 << 10 ||
+      lac < 0 || lac >= 1 << 16 || ci < 0 || ci >= 1 << 28) return 0;
+
+  return (uint64_t)mcc << 54 | (uint64_t)mnc << 44 | (uint64_t)lac << 28 | (uint64_t)ci;
+}
+
+int EXPORT supl_celldb_open(supl_celldb_t *db, char *file) {
+  struct celldb_header_s *hdr;
+  struct stat sb;
+
+  memset(db, 0, sizeof(supl_celldb_t));
+
+  db->fd = open(file, O_RDONLY);
+  if (db->fd < 0) return E_SUPL_READ;
+
+  if (fstat(db->fd, &sb) < 0 || sb.st_size < (off_t)sizeof(struct celldb_header_s)) goto fail;
+
+  db->size = sb.st_size;
+  db->map = mmap(0, db->size, PROT_READ, MAP_SHARED, db->fd, 0);
+  if (db->map == MAP_FAILED) {
+    db->map = 0;
+    goto fail;
+  }
+
+  hdr = db->map;
+  if (hdr->magic != CELLDB_MAGIC || hdr->version != CELLDB_VERSION ||
+      hdr->pos_size != sizeof(struct celldb_pos_s) || hdr->block == 0 ||
+      hdr->fences != (hdr->cells + hdr->block - 1) / hdr->block ||
+      hdr->key_off + hdr->cells * sizeof(uint64_t) > db->size ||
+      hdr->pos_off + hdr->cells * sizeof(struct celldb_pos_s) > db->size ||
+      hdr->fence_off + hdr->fences * sizeof(uint64_t) > db->size) {
+    supl_celldb_close(db);
+    return E_SUPL_DECODE;
+  }
+
+  db->cells = hdr->cells;
+
+  return 0;
+
+ fail:
+  close(db->fd);
+  db->fd = -1;
+  return E_SUPL_READ;
+}
+
+void EXPORT supl_celldb_close(supl_celldb_t *db) {
+  if (db->map) munmap(db->map, db->size);
+  if (db->fd >= 0) close(db->fd);
+
+  memset(db, 0, sizeof(supl_celldb_t));
+  db->fd = -1;
+}
+
+/* 3GPP TS 23.032 uncertainty code for r meters, r = 10 * (1.1^k - 1) */
+static int uncert_code(double r) {
+  int k = ceil(log(r / 10.0 + 1.0) / log(1.1));
+
+  if (k < 0) return 0;
+  if (k > 127) return 127;
+
+  return k;
+}
+
+/* position of a GSM cell, 1 if the cell is in the index */
+int EXPORT supl_celldb_lookup(supl_celldb_t *db, int mcc, int mnc, int lac, int ci, supl_cell_pos_t *pos) {
+  struct celldb_header_s *hdr = db->map;
+  const uint64_t *key, *fence;
+  const struct celldb_pos_s *p;
+  uint64_t k = cell_key(mcc, mnc, lac, ci);
+  unsigned long lo, hi, mid;
+
+  if (!hdr || !k || !db->cells) return 0;
+
+  key = (const uint64_t *)((char *)db->map + hdr->key_off);
+  fence = (const uint64_t *)((char *)db->map + hdr->fence_off);
+
+  // last block starting at or before k
+  lo = 0;
+  hi = hdr->fences;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (fence[mid] <= k) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == 0) return 0;
+
+  hi = lo * hdr->block;
+  if (hi > db->cells) hi = db->cells;
+  lo = (lo - 1) * hdr->block;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (key[mid] < k) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo >= db->cells || key[lo] != k) return 0;
+
+  p = (const struct celldb_pos_s *)((char *)db->map + hdr->pos_off) + lo;
+  pos->lat = p->lat / 1e7;
+  pos->lon = p->lon / 1e7;
+  pos->range = p->range;
+  pos->uncert = uncert_code(p->range);
+
+  return 1;
+}
+
+/*
+** CSV rows are either mcc,mnc,lac,ci,lat,lon,range or, when the first
+** field is the radio type, the OpenCellID export
+** radio,mcc,net,area,cell,unit,lon,lat,range,... Anything else, a header
+** line for example, is skipped.
+*/
+
+static int parse_row(char *line, struct celldb_row_s *row) {
+  char *f[9], *s = line;
+  long mcc, mnc, lac, ci;
+  double lat, lon, range;
+  int n = 0, ocid;
+
+  while (n < 9) {
+    f[n++] = s;
+    s = strchr(s, ',');
+    if (!s) break;
+    *s++ = 0;
+  }
+
+  ocid = isalpha((unsigned char)line[0]);
+  if (n < (ocid ? 9 : 7)) return 0;
+
+  if (ocid) {
+    mcc = strtol(f[1], 0, 10);
+    mnc = strtol(f[2], 0, 10);
+    lac = strtol(f[3], 0, 10);
+    ci = strtol(f[4], 0, 10);
+    lon = strtod(f[6], 0);
+    lat = strtod(f[7], 0);
+    range = strtod(f[8], 0);
+  } else {
+    mcc = strtol(f[0], 0, 10);
+    mnc = strtol(f[1], 0, 10);
+    lac = strtol(f[2], 0, 10);
+    ci = strtol(f[3], 0, 10);
+    lat = strtod(f[4], 0);
+    lon = strtod(f[5], 0);
+    range = strtod(f[6], 0);
+  }
+
+  row->key = cell_key(mcc, mnc, lac, ci);
+  if (!row->key || lat < -90 || lat > 90 || lon < -180 || lon > 180) return 0;
+
+  row->pos.lat = lrint(lat * 1e7);
+  row->pos.lon = lrint(lon * 1e7);
+  row->pos.range = range < 0 ? 0 : range > 2e9 ? 2000000000u : (uint32_t)range;
+
+  return 1;
+}
+
+static int row_cmp(const void *a, const void *b) {
+  uint64_t ka = ((const struct celldb_row_s *)a)->key;
+  uint64_t kb = ((const struct celldb_row_s *)b)->key;
+
+  return ka < kb ? -1 : ka > kb;
+}
+
+static int write_at(int fd, const void *buf, size_t size, off_t off) {
+  const char *p = buf;
+  ssize_t n;
+
+  while (size) {
+    n = pwrite(fd, p, size, off);
+    if (n <= 0) return -1;
+    p += n;
+    size -= n;
+    off += n;
+  }
+
+  return 0;
+}
+
+/*
+** Build the index file from CSV rows in in. A cell given twice keeps the
+** smallest range. The file is written aside and renamed over file, so
+** readers which have the old one mapped are not disturbed. Returns the
+** number of cells indexed, *skipped tells how many rows were not usable.
+*/
+
+long EXPORT supl_celldb_build(FILE *in, char *file, unsigned long *skipped) {
+  struct celldb_row_s *row = 0, *tmp;
+  struct celldb_header_s hdr;
+  size_t alloc = 0, n = 0, i, j;
+  unsigned long bad = 0;
+  char line[512], *part;
+  uint64_t *buf;
+  int fd = -1;
+  long ret = E_SUPL_INTERNAL;
+
+  while (fgets(line, sizeof(line), in)) {
+    if (n == alloc) {
+      alloc = alloc ? 2 * alloc : 1 << 16;
+      tmp = realloc(row, alloc * sizeof(struct celldb_row_s));
+      if (!tmp) goto out;
+      row = tmp;
+    }
+
+    if (parse_row(line, &row[n])) n++;
+    else bad++;
+  }
+
+  qsort(row, n, sizeof(struct celldb_row_s), row_cmp);
+
+  for (i = j = 0; i < n; i++) {
+    if (j > 0 && row[j - 1].key == row[i].key) {
+      if (row[i].pos.range < row[j - 1].pos.range) row[j - 1] = row[i];
+      continue;
+    }
+    row[j++] = row[i];
+  }
+  n = j;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = CELLDB_MAGIC;
+  hdr.version = CELLDB_VERSION;
+  hdr.cells = n;
+  hdr.block = CELLDB_BLOCK;
+  hdr.pos_size = sizeof(struct celldb_pos_s);
+  hdr.fences = (n + CELLDB_BLOCK - 1) / CELLDB_BLOCK;
+  hdr.key_off = ALIGN8(sizeof(hdr));
+  hdr.pos_off = ALIGN8(hdr.key_off + n * sizeof(uint64_t));
+  hdr.fence_off = ALIGN8(hdr.pos_off + n * sizeof(struct celldb_pos_s));
+
+  part = malloc(strlen(file) + 5);
+  buf = malloc((n ? n : 1) * sizeof(struct celldb_pos_s));
+  if (!part || !buf) goto out_free;
+  sprintf(part, "%s.tmp", file);
+
+  fd = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    ret = E_SUPL_WRITE;
+    goto out_free;
+  }
+
+  ret = E_SUPL_WRITE;
+
+  for (i = 0; i < n; i++) buf[i] = row[i].key;
+  if (write_at(fd, buf, n * sizeof(uint64_t), hdr.key_off) < 0) goto out_close;
+
+  for (i = 0; i < n; i++) ((struct celldb_pos_s *)buf)[i] = row[i].pos;
+  if (write_at(fd, buf, n * sizeof(struct celldb_pos_s), hdr.pos_off) < 0) goto out_close;
+
+  for (i = 0; i < hdr.fences; i++) buf[i] = row[i * CELLDB_BLOCK].key;
+  if (write_at(fd, buf, hdr.fences * sizeof(uint64_t), hdr.fence_off) < 0) goto out_close;
+
+  // header last, a file cut short is never taken for complete
+  if (write_at(fd, &hdr, sizeof(hdr), 0) < 0 || fsync(fd) < 0) goto out_close;
+
+  if (close(fd) == 0 && rename(part, file) == 0) ret = n;
+  fd = -1;
+
+ out_close:
+  if (fd >= 0) close(fd);
+  if (ret < 0) unlink(part);
+ out_free:
+  free(part);
+  free(buf);
+ out:
+  free(row);
+  if (skipped) *skipped = bad;
+
+  return ret;
+}
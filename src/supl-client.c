@@ -15,7 +15,13 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "supl.h"
 #include "protocol/bin.h"
@@ -49,14 +55,14 @@ static time_t utc_time(int week, long tow)
     return t;
 }
 
-static int supl_consume_1(supl_assist_t *ctx)
+static int supl_consume_1(FILE *out, supl_assist_t *ctx)
 {
     if (ctx->set & SUPL_RRLP_ASSIST_REFLOC)
     {
-        fprintf(stdout, "Reference Location:\n");
-        fprintf(stdout, "  Lat: %f\n", ctx->pos.lat);
-        fprintf(stdout, "  Lon: %f\n", ctx->pos.lon);
-        fprintf(stdout, "  Uncertainty: %d (%.1f m)\n",
+        fprintf(out, "Reference Location:\n");
+        fprintf(out, "  Lat: %f\n", ctx->pos.lat);
+        fprintf(out, "  Lon: %f\n", ctx->pos.lon);
+        fprintf(out, "  Uncertainty: %d (%.1f m)\n",
                 ctx->pos.uncertainty, 10.0 * (pow(1.1, ctx->pos.uncertainty) - 1));
     }
 
@@ -66,21 +72,21 @@ static int supl_consume_1(supl_assist_t *ctx)
 
         t = utc_time(ctx->time.gps_week, ctx->time.gps_tow);
 
-        fprintf(stdout, "Reference Time:\n");
-        fprintf(stdout, "  GPS Week: %ld\n", ctx->time.gps_week);
-        fprintf(stdout, "  GPS TOW:  %ld %lf\n", ctx->time.gps_tow, ctx->time.gps_tow * 0.08);
-        fprintf(stdout, "  ~ UTC:    %s", ctime(&t));
+        fprintf(out, "Reference Time:\n");
+        fprintf(out, "  GPS Week: %ld\n", ctx->time.gps_week);
+        fprintf(out, "  GPS TOW:  %ld %lf\n", ctx->time.gps_tow, ctx->time.gps_tow * 0.08);
+        fprintf(out, "  ~ UTC:    %s", ctime(&t));
     }
 
     if (ctx->set & SUPL_RRLP_ASSIST_IONO)
     {
-        fprintf(stdout, "Ionospheric Model:\n");
-        fprintf(stdout, "  # a0 a1 a2 b0 b1 b2 b3\n");
-        fprintf(stdout, "  %g, %g, %g",
+        fprintf(out, "Ionospheric Model:\n");
+        fprintf(out, "  # a0 a1 a2 b0 b1 b2 b3\n");
+        fprintf(out, "  %g, %g, %g",
                 ctx->iono.a0 * pow(2.0, -30),
                 ctx->iono.a1 * pow(2.0, -27),
                 ctx->iono.a2 * pow(2.0, -24));
-        fprintf(stdout, " %g, %g, %g, %g\n",
+        fprintf(out, " %g, %g, %g, %g\n",
                 ctx->iono.b0 * pow(2.0, 11),
                 ctx->iono.b1 * pow(2.0, 14),
                 ctx->iono.b2 * pow(2.0, 16),
@@ -89,9 +95,9 @@ static int supl_consume_1(supl_assist_t *ctx)
 
     if (ctx->set & SUPL_RRLP_ASSIST_UTC)
     {
-        fprintf(stdout, "UTC Model:\n");
-        fprintf(stdout, "  # a0, a1 delta_tls tot dn\n");
-        fprintf(stdout, "  %g %g %d %d %d %d %d %d\n",
+        fprintf(out, "UTC Model:\n");
+        fprintf(out, "  # a0, a1 delta_tls tot dn\n");
+        fprintf(out, "  %g %g %d %d %d %d %d %d\n",
                 ctx->utc.a0 * pow(2.0, -30),
                 ctx->utc.a1 * pow(2.0, -50),
                 ctx->utc.delta_tls,
@@ -103,16 +109,16 @@ static int supl_consume_1(supl_assist_t *ctx)
     {
         int i;
 
-        fprintf(stdout, "Ephemeris:");
-        fprintf(stdout, " %d satellites\n", ctx->cnt_eph);
-        fprintf(stdout, "  # prn delta_n M0 A_sqrt OMEGA_0 i0 w OMEGA_dot i_dot Cuc Cus Crc Crs Cic Cis");
-        fprintf(stdout, " toe IODC toc AF0 AF1 AF2 bits ura health tgd OADA\n");
+        fprintf(out, "Ephemeris:");
+        fprintf(out, " %d satellites\n", ctx->cnt_eph);
+        fprintf(out, "  # prn delta_n M0 A_sqrt OMEGA_0 i0 w OMEGA_dot i_dot Cuc Cus Crc Crs Cic Cis");
+        fprintf(out, " toe IODC toc AF0 AF1 AF2 bits ura health tgd OADA\n");
 
         for (i = 0; i < ctx->cnt_eph; i++)
         {
             struct supl_ephemeris_s *e = &ctx->eph[i];
 
-            fprintf(stdout, "  %d %g %g %g %g %g %g %g %g",
+            fprintf(out, "  %d %g %g %g %g %g %g %g %g",
                     e->prn,
                     e->delta_n * pow(2.0, -43),
                     e->M0 * pow(2.0, -31),
@@ -122,21 +128,21 @@ static int supl_consume_1(supl_assist_t *ctx)
                     e->w * pow(2.0, -31),
                     e->OMEGA_dot * pow(2.0, -43),
                     e->i_dot * pow(2.0, -43));
-            fprintf(stdout, " %g %g %g %g %g %g",
+            fprintf(out, " %g %g %g %g %g %g",
                     e->Cuc * pow(2.0, -29),
                     e->Cus * pow(2.0, -29),
                     e->Crc * pow(2.0, -5),
                     e->Crs * pow(2.0, -5),
                     e->Cic * pow(2.0, -29),
                     e->Cis * pow(2.0, -29));
-            fprintf(stdout, " %g %u %g %g %g %g",
+            fprintf(out, " %g %u %g %g %g %g",
                     e->toe * pow(2.0, 4),
                     e->IODC,
                     e->toc * pow(2.0, 4),
                     e->AF0 * pow(2.0, -31),
                     e->AF1 * pow(2.0, -43),
                     e->AF2 * pow(2.0, -55));
-            fprintf(stdout, " %d %d %d %d %d\n",
+            fprintf(out, " %d %d %d %d %d\n",
                     e->bits,
                     e->ura,
                     e->health,
@@ -149,21 +155,21 @@ static int supl_consume_1(supl_assist_t *ctx)
     {
         int i;
 
-        fprintf(stdout, "Almanac:");
-        fprintf(stdout, " %d satellites\n", ctx->cnt_alm);
-        fprintf(stdout, "  # prn e toa Ksii OMEGA_dot A_sqrt OMEGA_0 w M0 AF0 AF1\n");
+        fprintf(out, "Almanac:");
+        fprintf(out, " %d satellites\n", ctx->cnt_alm);
+        fprintf(out, "  # prn e toa Ksii OMEGA_dot A_sqrt OMEGA_0 w M0 AF0 AF1\n");
 
         for (i = 0; i < ctx->cnt_alm; i++)
         {
             struct supl_almanac_s *a = &ctx->alm[i];
 
-            fprintf(stdout, "  %d %g %g %g %g ",
+            fprintf(out, "  %d %g %g %g %g ",
                     a->prn,
                     a->e * pow(2.0, -21),
                     a->toa * pow(2.0, 12),
                     a->Ksii * pow(2.0, -19),
                     a->OMEGA_dot * pow(2.0, -38));
-            fprintf(stdout, "%g %g %g %g %g %g\n",
+            fprintf(out, "%g %g %g %g %g %g\n",
                     a->A_sqrt * pow(2.0, -11),
                     a->OMEGA_0 * pow(2.0, -23),
                     a->w * pow(2.0, -23),
@@ -176,100 +182,101 @@ static int supl_consume_1(supl_assist_t *ctx)
     return 1;
 }
 
-static int supl_consume_2(supl_assist_t *ctx)
+/* print the given parts, ephemeris/almanac/acquisition entries starting at the given index */
+static int supl_consume_2_parts(FILE *out, supl_assist_t *ctx, int parts, int eph0, int alm0, int acq0)
 {
-    if (ctx->set & SUPL_RRLP_ASSIST_REFTIME)
+    if (ctx->set & parts & SUPL_RRLP_ASSIST_REFTIME)
     {
-        fprintf(stdout, "T %ld %ld %ld %ld\n", ctx->time.gps_week, ctx->time.gps_tow,
+        fprintf(out, "T %ld %ld %ld %ld\n", ctx->time.gps_week, ctx->time.gps_tow,
                 ctx->time.stamp.tv_sec, ctx->time.stamp.tv_usec);
     }
 
-    if (ctx->set & SUPL_RRLP_ASSIST_UTC)
+    if (ctx->set & parts & SUPL_RRLP_ASSIST_UTC)
     {
-        fprintf(stdout, "U %d %d %d %d %d %d %d %d\n",
+        fprintf(out, "U %d %d %d %d %d %d %d %d\n",
                 ctx->utc.a0, ctx->utc.a1, ctx->utc.delta_tls,
                 ctx->utc.tot, ctx->utc.wnt, ctx->utc.wnlsf,
                 ctx->utc.dn, ctx->utc.delta_tlsf);
     }
 
-    if (ctx->set & SUPL_RRLP_ASSIST_REFLOC)
+    if (ctx->set & parts & SUPL_RRLP_ASSIST_REFLOC)
     {
-        fprintf(stdout, "L %f %f %d\n", ctx->pos.lat, ctx->pos.lon, ctx->pos.uncertainty);
-    } else if (fake_pos.valid)
+        fprintf(out, "L %f %f %d\n", ctx->pos.lat, ctx->pos.lon, ctx->pos.uncertainty);
+    } else if (parts & SUPL_RRLP_ASSIST_REFLOC && !(ctx->set & SUPL_RRLP_ASSIST_REFLOC) && fake_pos.valid)
     {
-        fprintf(stdout, "L %f %f %d\n", fake_pos.lat, fake_pos.lon, fake_pos.uncertainty);
+        fprintf(out, "L %f %f %d\n", fake_pos.lat, fake_pos.lon, fake_pos.uncertainty);
     }
 
-    if (ctx->set & SUPL_RRLP_ASSIST_IONO)
+    if (ctx->set & parts & SUPL_RRLP_ASSIST_IONO)
     {
-        fprintf(stdout, "I %d %d %d %d %d %d %d\n",
+        fprintf(out, "I %d %d %d %d %d %d %d\n",
                 ctx->iono.a0, ctx->iono.a1, ctx->iono.a2,
                 ctx->iono.b0, ctx->iono.b1, ctx->iono.b2, ctx->iono.b3);
     }
 
-    if (ctx->cnt_eph)
+    if (parts & SUPL_RRLP_ASSIST_EPHEMERIS && ctx->cnt_eph > eph0)
     {
         int i;
 
-        fprintf(stdout, "E %d\n", ctx->cnt_eph);
+        fprintf(out, "E %d\n", ctx->cnt_eph - eph0);
 
-        for (i = 0; i < ctx->cnt_eph; i++)
+        for (i = eph0; i < ctx->cnt_eph; i++)
         {
             struct supl_ephemeris_s *e = &ctx->eph[i];
 
-            fprintf(stdout, "e %d %d %d %d %d %d %d %d %d %d",
+            fprintf(out, "e %d %d %d %d %d %d %d %d %d %d",
                     e->prn, e->delta_n, e->M0, e->A_sqrt, e->OMEGA_0, e->i0, e->w, e->OMEGA_dot, e->i_dot, e->e);
-            fprintf(stdout, " %d %d %d %d %d %d",
+            fprintf(out, " %d %d %d %d %d %d",
                     e->Cuc, e->Cus, e->Crc, e->Crs, e->Cic, e->Cis);
-            fprintf(stdout, " %d %d %d %d %d %d",
+            fprintf(out, " %d %d %d %d %d %d",
                     e->toe, e->IODC, e->toc, e->AF0, e->AF1, e->AF2);
-            fprintf(stdout, " %d %d %d %d %d\n",
+            fprintf(out, " %d %d %d %d %d\n",
                     e->bits, e->ura, e->health, e->tgd, e->AODA);
         }
     }
 
-    if (ctx->cnt_alm)
+    if (parts & SUPL_RRLP_ASSIST_ALMANAC && ctx->cnt_alm > alm0)
     {
         int i;
 
-        fprintf(stdout, "A %d\n", ctx->cnt_alm);
-        for (i = 0; i < ctx->cnt_alm; i++)
+        fprintf(out, "A %d\n", ctx->cnt_alm - alm0);
+        for (i = alm0; i < ctx->cnt_alm; i++)
         {
             struct supl_almanac_s *a = &ctx->alm[i];
 
-            fprintf(stdout, "a %d %d %d %d %d ",
+            fprintf(out, "a %d %d %d %d %d ",
                     a->prn, a->e, a->toa, a->Ksii, a->OMEGA_dot);
-            fprintf(stdout, "%d %d %d %d %d %d\n",
+            fprintf(out, "%d %d %d %d %d %d\n",
                     a->A_sqrt, a->OMEGA_0, a->w, a->M0, a->AF0, a->AF1);
         }
     }
 
-    if (ctx->cnt_acq)
+    if (parts & SUPL_RRLP_ASSIST_ACQUIS && ctx->cnt_acq > acq0)
     {
         int i;
 
-        fprintf(stdout, "Q %d %d\n", ctx->cnt_acq, ctx->acq_time);
-        for (i = 0; i < ctx->cnt_acq; i++)
+        fprintf(out, "Q %d %d\n", ctx->cnt_acq - acq0, ctx->acq_time);
+        for (i = acq0; i < ctx->cnt_acq; i++)
         {
             struct supl_acquis_s *q = &ctx->acq[i];
 
-            fprintf(stdout, "q %d %d %d ",
+            fprintf(out, "q %d %d %d ",
                     q->prn, q->parts, q->doppler0);
             if (q->parts & SUPL_ACQUIS_DOPPLER)
             {
-                fprintf(stdout, "%d %d ", q->doppler1, q->d_win);
+                fprintf(out, "%d %d ", q->doppler1, q->d_win);
             } else
             {
-                fprintf(stdout, "0 0 ");
+                fprintf(out, "0 0 ");
             }
-            fprintf(stdout, "%d %d %d %d ",
+            fprintf(out, "%d %d %d %d ",
                     q->code_ph, q->code_ph_int, q->bit_num, q->code_ph_win);
             if (q->parts & SUPL_ACQUIS_ANGLE)
             {
-                fprintf(stdout, "%d %d\n", q->az, q->el);
+                fprintf(out, "%d %d\n", q->az, q->el);
             } else
             {
-                fprintf(stdout, "0 0\n");
+                fprintf(out, "0 0\n");
             }
         }
     }
@@ -277,12 +284,71 @@ static int supl_consume_2(supl_assist_t *ctx)
     return 1;
 }
 
-static int supl_consume_3(supl_assist_t *ctx)
+static int supl_consume_2(FILE *out, supl_assist_t *ctx)
+{
+    return supl_consume_2_parts(out, ctx, ~0, 0, 0, 0);
+}
+
+/* --stream: print every part as soon as its RRLP segment arrives */
+
+static struct stream_s
+{
+    int eph, alm, acq;
+    int parts;             /* printed */
+    unsigned int prn;      /* bit prn - 1 set for the ephemerides printed */
+} stream;
+
+static void supl_stream_part(supl_assist_t *ctx, int parts, void *arg)
+{
+    struct stream_s *seen = arg;
+
+    /* another server starts from the beginning */
+    if (parts == 0)
+    {
+        seen->eph = seen->alm = seen->acq = 0;
+        seen->parts = 0;
+        seen->prn = 0;
+        return;
+    }
+
+    supl_consume_2_parts(stdout, ctx, parts, seen->eph, seen->alm, seen->acq);
+    fflush(stdout);
+
+    seen->parts |= parts;
+    for (; seen->eph < ctx->cnt_eph; seen->eph++)
+    {
+        seen->prn |= 1u << ((ctx->eph[seen->eph].prn - 1) & 31);
+    }
+
+    seen->alm = ctx->cnt_alm;
+    seen->acq = ctx->cnt_acq;
+}
+
+/* after --stream, print what the session did not, such as the parts kept in --store */
+
+static void supl_stream_rest(FILE *out, supl_assist_t *ctx, struct stream_s *seen)
+{
+    supl_assist_t rest = *ctx;
+    int i;
+
+    rest.cnt_eph = 0;
+    for (i = 0; i < ctx->cnt_eph; i++)
+    {
+        if (!(seen->prn & 1u << ((ctx->eph[i].prn - 1) & 31)))
+        {
+            rest.eph[rest.cnt_eph++] = ctx->eph[i];
+        }
+    }
+
+    supl_consume_2_parts(out, &rest, ~seen->parts | SUPL_RRLP_ASSIST_EPHEMERIS, 0, 0, 0);
+}
+
+static int supl_consume_3(FILE *out, supl_assist_t *ctx)
 {
     struct BinProtocol bin;
     struct EphemSV* ephemerides = NULL;
 
-    bin.EphemMask = 0;
+    memset(&bin, 0, sizeof(bin));
 
     if (ctx->set & SUPL_RRLP_ASSIST_REFLOC)
     {
@@ -353,8 +419,7 @@ static int supl_consume_3(supl_assist_t *ctx)
     {
         int i;
         //ephemerides = malloc(32 * sizeof(struct EphemSV));
-        ephemerides = malloc(ctx->cnt_eph * sizeof(struct EphemSV));
-        memset(ephemerides, 0, 32 * sizeof(struct EphemSV));
+        ephemerides = calloc(ctx->cnt_eph, sizeof(struct EphemSV));
 
         for (i = 0; i < ctx->cnt_eph; i++) {
             struct supl_ephemeris_s *e = &ctx->eph[i];
@@ -397,18 +462,32 @@ static int supl_consume_3(supl_assist_t *ctx)
     }
 
     /* Output */
-    fwrite((const void *) &bin, sizeof(struct BinProtocol), 1, stdout);
+    fwrite((const void *) &bin, sizeof(struct BinProtocol), 1, out);
     if (ctx->cnt_eph) {
-        //fwrite((const void *) ephemerides, sizeof(struct EphemSV), 32, stdout);
-        fwrite((const void *) ephemerides, sizeof(struct EphemSV), (size_t) ctx->cnt_eph, stdout);
+        //fwrite((const void *) ephemerides, sizeof(struct EphemSV), 32, out);
+        fwrite((const void *) ephemerides, sizeof(struct EphemSV), (size_t) ctx->cnt_eph, out);
+        free(ephemerides);
     }
 
     return 1;
 }
 
+static int supl_consume(FILE *out, format_t format, supl_assist_t *ctx)
+{
+    switch (format)
+    {
+        case FORMAT_HUMAN:
+            return supl_consume_1(out, ctx);
+        case FORMAT_BIN:
+            return supl_consume_3(out, ctx);
+        default:
+            return supl_consume_2(out, ctx);
+    }
+}
+
 static char *usage_str =
         "Usage:\n"
-                "%s options [supl-server]\n"
+                "%s options [supl-server...]\n"
                 "Options:\n"
                 "  --almanac|-a					request also almanac data\n"
                 "  --cell gsm:mcc,mns:lac,ci|wcdma:mcc,msn,uc	set current gsm/wcdma cell id\n"
@@ -416,6 +495,16 @@ static char *usage_str =
                 "  [--format|-f] [human|bin]				machine parseable output\n"
                 "  --debug|-d <n>				1 == RRLP, 2 == SUPL, 4 == DEBUG\n"
                 "  --debug-file file				write debug to file\n"
+                "  --race n					query n servers at once, first answer wins\n"
+                "  --hedge ms					query the next server if no answer in ms\n"
+                "  --server-state file				keep server latency/failure history in file\n"
+                "  --stream					print assistance data as it arrives, default format, no --race\n"
+                "  --store file					share fetched assistance with other clients in file\n"
+                "  --celldb index				fill in the known cell position from supl-celldb index\n"
+                "  --publish name				publish the assistance to local readers in shared memory\n"
+                "  --daemon socket				keep running and answer --query on the Unix socket\n"
+                "  --query socket				ask a --daemon instead of the servers\n"
+                "  --nmr freq,id,level[:freq,id,level...]	neighbor cells measured, ARFCN,BSIC,RXLEV or UARFCN,PSC,Ec/N0\n"
                 "  --help|-h					show this help\n"
                 "Example:\n"
                 "%1$s --cell=gsm:244,5:0x59e2,0x31b0:60.169995,24.939995,127 --cell=gsm:244,5:0x59e2,0x31b0\n";
@@ -435,6 +524,16 @@ static struct option long_opts[] = {
         {"debug-file", 1, 0, 0},
         {"help",       0, 0, 'h'},
         {"almanac",    0, 0, 'a'},
+        {"race",       1, 0, 0},
+        {"hedge",      1, 0, 0},
+        {"server-state", 1, 0, 0},
+        {"stream",     0, 0, 0},
+        {"store",      1, 0, 0},
+        {"celldb",     1, 0, 0},
+        {"publish",    1, 0, 0},
+        {"daemon",     1, 0, 0},
+        {"query",      1, 0, 0},
+        {"nmr",        1, 0, 0},
         {0,            0, 0}
 };
 
@@ -458,6 +557,395 @@ static int parse_fake_pos(char *str, struct fake_pos_s *fake_pos)
     return 1;
 }
 
+/* --cell argument, 0 if it was understood */
+static int parse_cell(supl_ctx_t *ctx, char *str)
+{
+    int mcc, mns, lac, ci, uc, uncertainty;
+    double lat, lon;
+
+    if (sscanf(str, "gsm:%d,%d:%x,%x:%lf,%lf,%d",
+               &mcc, &mns, &lac, &ci, &lat, &lon, &uncertainty) == 7)
+    {
+        supl_set_gsm_cell_known(ctx, mcc, mns, lac, ci, lat, lon, uncertainty);
+        return 0;
+    }
+
+    if (sscanf(str, "gsm:%d,%d:%x,%x",
+               &mcc, &mns, &lac, &ci) == 4)
+    {
+        supl_set_gsm_cell(ctx, mcc, mns, lac, ci);
+        return 0;
+    }
+
+    if (sscanf(str, "wcdma:%d,%d,%x",
+               &mcc, &mns, &uc) == 3)
+    {
+        supl_set_wcdma_cell(ctx, mcc, mns, uc);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int parse_nmr(supl_ctx_t *ctx, char *str)
+{
+    supl_nmr_t nmr[SUPL_NMR_MAX];
+    int n = 0, len;
+
+    while (n < SUPL_NMR_MAX &&
+           sscanf(str, "%d,%d,%d%n", &nmr[n].freq, &nmr[n].id, &nmr[n].level, &len) == 3)
+    {
+        n++;
+        str += len;
+        if (*str != ':') break;
+        str++;
+    }
+
+    if (n == 0 || *str) return 1;
+
+    supl_set_nmr(ctx, nmr, n);
+
+    return 0;
+}
+
+/*
+** --daemon socket: keep the TLS context, the assistance cache and the
+** server history and answer queries on a Unix socket. A query is one
+** line of words, the --cell arguments and optionally "human" or "bin"
+** for the format and "almanac". The answer is the error code on a line
+** of its own and, if it is 0, the assistance in that format.
+*/
+
+#define MAX_QUERY_CELLS 4
+#define QUERY_TIMEOUT 5 /* seconds to send the query */
+#define SESSION_TIMEOUT 10000 /* ms a server may take to answer a query */
+#define DRAIN_TIMEOUT 5 /* seconds to wait for the queries running at exit */
+
+static struct daemon_s
+{
+    supl_cache_t cache;
+    supl_pool_t pool;
+    supl_tls_t tls;
+    supl_celldb_t celldb;
+    int have_celldb;
+    unsigned long queries;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int serving;        /* queries running */
+    int cancel[2];      /* written on exit, ends their sessions */
+    volatile sig_atomic_t quit;
+} daemon_ctx;
+
+static void daemon_signal(int sig)
+{
+    daemon_ctx.quit = 1;
+}
+
+static int query_read(int fd, char *line, size_t size)
+{
+    size_t n = 0;
+    ssize_t r;
+
+    while (n < size - 1)
+    {
+        r = read(fd, line + n, size - 1 - n);
+        if (r <= 0)
+        {
+            return -1;
+        }
+        n += r;
+        if (memchr(line, '\n', n))
+        {
+            break;
+        }
+    }
+    line[n] = 0;
+
+    return 0;
+}
+
+static void *daemon_serve(void *arg)
+{
+    int fd = (intptr_t) arg;
+    format_t format = FORMAT_DEFAULT;
+    int request = 0, err = E_SUPL_READ;
+    char line[512], *word, *save;
+    supl_assist_t assist;
+    supl_ctx_t ctx;
+    FILE *out;
+
+    __atomic_add_fetch(&daemon_ctx.queries, 1, __ATOMIC_RELAXED);
+
+    supl_ctx_new(&ctx);
+    supl_set_tls(&ctx, &daemon_ctx.tls);
+    supl_set_cancel_fd(&ctx, daemon_ctx.cancel[0]);
+    supl_set_timeout(&ctx, SESSION_TIMEOUT);
+
+    if (query_read(fd, line, sizeof(line)) == 0)
+    {
+        err = 0;
+        for (word = strtok_r(line, " \t\r\n", &save); word; word = strtok_r(0, " \t\r\n", &save))
+        {
+            if (strcmp(word, "human") == 0)
+            {
+                format = FORMAT_HUMAN;
+            } else if (strcmp(word, "bin") == 0)
+            {
+                format = FORMAT_BIN;
+            } else if (strcmp(word, "almanac") == 0)
+            {
+                request |= SUPL_REQUEST_ALMANAC;
+            } else if (parse_cell(&ctx, word))
+            {
+                err = E_SUPL_DECODE;
+            }
+        }
+    }
+
+    if (err == 0)
+    {
+        supl_request(&ctx, request);
+        if (daemon_ctx.have_celldb)
+        {
+            (void)supl_set_gsm_cell_lookup(&ctx, &daemon_ctx.celldb);
+        }
+
+        /* with "almanac" a miss of it is a cache miss too */
+        err = supl_get_assist_cached(&daemon_ctx.cache, &ctx, 0, &assist);
+    }
+
+    out = fdopen(fd, "w");
+    if (out)
+    {
+        fprintf(out, "%d\n", err);
+        if (err == 0)
+        {
+            supl_consume(out, format, &assist);
+        }
+        fclose(out);
+    } else
+    {
+        close(fd);
+    }
+
+    supl_ctx_free(&ctx);
+
+    pthread_mutex_lock(&daemon_ctx.lock);
+    if (--daemon_ctx.serving == 0)
+    {
+        pthread_cond_signal(&daemon_ctx.idle);
+    }
+    pthread_mutex_unlock(&daemon_ctx.lock);
+
+    return 0;
+}
+
+static int run_daemon(char *path, char **servers, int n_servers, char *state_file, char *celldb_file)
+{
+    struct sockaddr_un addr;
+    supl_cache_stats_t cs;
+    struct sigaction sa;
+    struct timespec deadline;
+    struct timeval tv;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int fd, conn;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error: socket path %s too long\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if (supl_tls_new(&daemon_ctx.tls) < 0 || supl_cache_new(&daemon_ctx.cache, 0) < 0)
+    {
+        return 1;
+    }
+
+    supl_pool_new(&daemon_ctx.pool, servers, n_servers);
+    if (state_file)
+    {
+        (void)supl_pool_load(&daemon_ctx.pool, state_file);
+    }
+
+    if (celldb_file)
+    {
+        if (supl_celldb_open(&daemon_ctx.celldb, celldb_file) == 0)
+        {
+            daemon_ctx.have_celldb = 1;
+        } else
+        {
+            fprintf(stderr, "Error: open cell index %s\n", celldb_file);
+        }
+    }
+
+    daemon_ctx.cache.pool = &daemon_ctx.pool;
+    daemon_ctx.cache.tls = &daemon_ctx.tls;
+
+    pthread_mutex_init(&daemon_ctx.lock, 0);
+    pthread_cond_init(&daemon_ctx.idle, 0);
+    if (pipe(daemon_ctx.cancel) < 0)
+    {
+        fprintf(stderr, "Error: pipe (%s)\n", strerror(errno));
+        return 1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)
+    {
+        fprintf(stderr, "Error: listen on %s (%s)\n", path, strerror(errno));
+        return 1;
+    }
+
+    /* no SA_RESTART, accept() returns on a signal */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_signal;
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* keep the cells in use warm */
+    supl_cache_refresh_start(&daemon_ctx.cache, 1.0, 4);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    tv.tv_sec = QUERY_TIMEOUT;
+    tv.tv_usec = 0;
+
+    while (!daemon_ctx.quit)
+    {
+        conn = accept(fd, 0, 0);
+        if (conn < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            fprintf(stderr, "Error: accept (%s)\n", strerror(errno));
+            break;
+        }
+
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        /* counted here, a query not yet started is waited for too */
+        pthread_mutex_lock(&daemon_ctx.lock);
+        daemon_ctx.serving++;
+        pthread_mutex_unlock(&daemon_ctx.lock);
+
+        if (pthread_create(&thread, &attr, daemon_serve, (void *) (intptr_t) conn) != 0)
+        {
+            close(conn);
+            pthread_mutex_lock(&daemon_ctx.lock);
+            daemon_ctx.serving--;
+            pthread_mutex_unlock(&daemon_ctx.lock);
+        }
+    }
+
+    close(fd);
+    unlink(path);
+
+    /* cancel the queries running and let them answer before the cache, pool and TLS go */
+    (void)write(daemon_ctx.cancel[1], "x", 1);
+
+    deadline.tv_sec = time(0) + DRAIN_TIMEOUT;
+    deadline.tv_nsec = 0;
+    pthread_mutex_lock(&daemon_ctx.lock);
+    while (daemon_ctx.serving > 0)
+    {
+        if (pthread_cond_timedwait(&daemon_ctx.idle, &daemon_ctx.lock, &deadline) == ETIMEDOUT)
+        {
+            fprintf(stderr, "Error: %d queries still running\n", daemon_ctx.serving);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&daemon_ctx.lock);
+
+    supl_cache_refresh_stop(&daemon_ctx.cache);
+    if (state_file)
+    {
+        (void)supl_pool_save(&daemon_ctx.pool, state_file);
+    }
+
+    supl_cache_get_stats(&daemon_ctx.cache, &cs);
+    fprintf(stderr, "queries %lu, cache hits %lu misses %lu refreshes %lu, TLS handshakes %lu resumed %lu\n",
+            daemon_ctx.queries, cs.hits, cs.misses, cs.refreshes,
+            daemon_ctx.tls.full + daemon_ctx.tls.resumed, daemon_ctx.tls.resumed);
+
+    return 0;
+}
+
+/* --query socket: ask a --daemon, print the answer as if fetched here */
+static int run_query(char *path, char **cells, int n_cells, format_t format, int request)
+{
+    struct sockaddr_un addr;
+    char line[512], buf[4096];
+    size_t n = 0;
+    ssize_t r;
+    int fd, i, err;
+    FILE *in;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    /* one line of words, each snprintf() may be cut short by the end of it */
+    for (i = 0; i < n_cells && n < sizeof(line); i++)
+    {
+        if (strpbrk(cells[i], " \t\r\n"))
+        {
+            fprintf(stderr, "Error: --cell %s has white space\n", cells[i]);
+            return 1;
+        }
+        n += snprintf(line + n, sizeof(line) - n, "%s ", cells[i]);
+    }
+    if (n < sizeof(line))
+    {
+        n += snprintf(line + n, sizeof(line) - n, "%s%s\n",
+                      format == FORMAT_HUMAN ? "human " : format == FORMAT_BIN ? "bin " : "",
+                      request & SUPL_REQUEST_ALMANAC ? "almanac" : "");
+    }
+    if (n >= sizeof(line))
+    {
+        fprintf(stderr, "Error: query for %s does not fit in %d bytes\n", path, (int) sizeof(line) - 1);
+        return 1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        write(fd, line, n) != (ssize_t) n)
+    {
+        fprintf(stderr, "Error: query %s (%s)\n", path, strerror(errno));
+        return 1;
+    }
+
+    in = fdopen(fd, "r");
+    if (!in || !fgets(line, sizeof(line), in))
+    {
+        fprintf(stderr, "Error: no answer from %s\n", path);
+        return 1;
+    }
+
+    err = atoi(line);
+    if (err < 0)
+    {
+        fprintf(stderr, "SUPL protocol error %d\n", err);
+        return 1;
+    }
+
+    while ((r = fread(buf, 1, sizeof(buf), in)) > 0)
+    {
+        fwrite(buf, 1, r, stdout);
+    }
+    fclose(in);
+
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int err;
@@ -466,11 +954,26 @@ int main(int argc, char *argv[])
     FILE *debug_f = 0;
     int request = 0;
     supl_assist_t assist;
-    char *server;
+    char *default_server = "supl.nokia.com";
+    char **servers = &default_server;
+    int n_servers = 1;
+    char *state_file = 0;
+    supl_pool_t pool;
     supl_ctx_t ctx;
+    int race_n = 1, hedge_ms = 0;
+    int stream_mode = 0;
+    char *store_file = 0;
+    char *celldb_file = 0;
+    char *publish_name = 0;
+    char *daemon_path = 0;
+    char *query_path = 0;
+    char *cells[MAX_QUERY_CELLS];
+    int n_cells = 0;
+    supl_store_t store;
+    supl_cache_key_t store_key;
+    int from_store = 0;
 
     supl_ctx_new(&ctx);
-    server = "supl.nokia.com";
 
     while (1)
     {
@@ -486,33 +989,15 @@ int main(int argc, char *argv[])
                 {
 
                     case 0: /* gsm/wcdma cell */
-                    {
-                        int mcc, mns, lac, ci, uc, uncertainty;
-                        double lat, lon;
-
-                        if (sscanf(optarg, "gsm:%d,%d:%x,%x:%lf,%lf,%d",
-                                   &mcc, &mns, &lac, &ci, &lat, &lon, &uncertainty) == 7)
+                        if (parse_cell(&ctx, optarg))
                         {
-                            supl_set_gsm_cell_known(&ctx, mcc, mns, lac, ci, lat, lon, uncertainty);
+                            fprintf(stderr, "Ugh, cell\n");
                             break;
                         }
-
-                        if (sscanf(optarg, "gsm:%d,%d:%x,%x",
-                                   &mcc, &mns, &lac, &ci) == 4)
+                        if (n_cells < MAX_QUERY_CELLS)
                         {
-                            supl_set_gsm_cell(&ctx, mcc, mns, lac, ci);
-                            break;
+                            cells[n_cells++] = optarg;
                         }
-
-                        if (sscanf(optarg, "wcdma:%d,%d,%x",
-                                   &mcc, &mns, &uc) == 3)
-                        {
-                            supl_set_wcdma_cell(&ctx, mcc, mns, uc);
-                            break;
-                        }
-                    }
-
-                        fprintf(stderr, "Ugh, cell\n");
                         break;
 
                     case 4: /* set-pos */
@@ -534,6 +1019,49 @@ int main(int argc, char *argv[])
                         }
                         break;
 
+                    case 9: /* race */
+                        race_n = atoi(optarg);
+                        break;
+
+                    case 10: /* hedge */
+                        hedge_ms = atoi(optarg);
+                        break;
+
+                    case 11: /* server-state */
+                        state_file = optarg;
+                        break;
+
+                    case 12: /* stream */
+                        stream_mode = 1;
+                        break;
+
+                    case 13: /* store */
+                        store_file = optarg;
+                        break;
+
+                    case 14: /* celldb */
+                        celldb_file = optarg;
+                        break;
+
+                    case 15: /* publish */
+                        publish_name = optarg;
+                        break;
+
+                    case 16: /* daemon */
+                        daemon_path = optarg;
+                        break;
+
+                    case 17: /* query */
+                        query_path = optarg;
+                        break;
+
+                    case 18: /* nmr */
+                        if (parse_nmr(&ctx, optarg))
+                        {
+                            fprintf(stderr, "Ugh, nmr\n");
+                        }
+                        break;
+
                 }
 
                 break;
@@ -595,9 +1123,10 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (optind + 1 == argc)
+    if (optind < argc)
     {
-        server = argv[optind];
+        servers = &argv[optind];
+        n_servers = argc - optind;
     }
 
     if (!fake_pos.valid && getenv("SUPL_FAKE_POS"))
@@ -607,34 +1136,210 @@ int main(int argc, char *argv[])
 
 #ifdef SUPL_DEBUG
     if (debug_flags) {
-      supl_set_debug(debug_f ? debug_f : stderr, debug_flags);
+      supl_ctx_set_debug(&ctx, debug_f ? debug_f : stderr, debug_flags);
     }
 #endif
 
+    if (stream_mode && (format != FORMAT_DEFAULT || race_n > 1 || hedge_ms > 0))
+    {
+        fprintf(stderr, "Error: --stream prints the default format from one server at a time, not with --format, --race or --hedge\n");
+        exit(1);
+    }
+
+    if (query_path)
+    {
+        return run_query(query_path, cells, n_cells, format, request);
+    }
+
+    if (daemon_path)
+    {
+        return run_daemon(daemon_path, servers, n_servers, state_file, celldb_file);
+    }
+
+    /* a server hanging up midway fails over to the next one, not kills us */
+    signal(SIGPIPE, SIG_IGN);
+
     supl_request(&ctx, request);
 
-    err = supl_get_assist(&ctx, server, &assist);
+    if (celldb_file)
+    {
+        supl_celldb_t db;
+
+        if (supl_celldb_open(&db, celldb_file) == 0)
+        {
+            (void)supl_set_gsm_cell_lookup(&ctx, &db);
+            supl_celldb_close(&db);
+        } else
+        {
+            fprintf(stderr, "Error: open cell index %s\n", celldb_file);
+        }
+    }
+
+    /* assistance for the cell from any server will do */
+    if (store_file && supl_store_open(&store, store_file, 0) == 0)
+    {
+        supl_cached_t cached;
+        struct timeval now;
+        int required = SUPL_RRLP_ASSIST_REFTIME | SUPL_RRLP_ASSIST_EPHEMERIS;
+
+        if (request & SUPL_REQUEST_ALMANAC)
+        {
+            required |= SUPL_RRLP_ASSIST_ALMANAC;
+        }
+
+        supl_cache_key(&store_key, &ctx, 0);
+        gettimeofday(&now, 0);
+        if (supl_store_get(&store, &store_key, &cached))
+        {
+            supl_assist_fresh(&cached, 0, &now, &assist);
+            from_store = supl_assist_enough(&assist, required, 4);
+
+            /* fetch only what is missing or has expired */
+            if (!from_store)
+            {
+                supl_assist_plan(&ctx, &cached, 0);
+            }
+        }
+    } else if (store_file)
+    {
+        fprintf(stderr, "Error: open store %s\n", store_file);
+        store_file = 0;
+    }
+
+    if (from_store)
+    {
+        err = 0;
+        goto output;
+    }
+
+    supl_pool_new(&pool, servers, n_servers);
+    if (state_file)
+    {
+        (void)supl_pool_load(&pool, state_file);
+    }
+
+    if (stream_mode)
+    {
+        supl_set_assist_cb(&ctx, supl_stream_part, &stream);
+    }
+
+    if (n_servers > 1 && (race_n > 1 || hedge_ms > 0))
+    {
+        supl_race_t race;
+        int order[n_servers];
+        char *ranked[n_servers];
+        int i;
+
+        /* race in the order of past performance */
+        supl_pool_rank(&pool, order);
+        for (i = 0; i < n_servers; i++)
+        {
+            ranked[i] = servers[order[i]];
+        }
+
+        supl_race_new(&race, ranked, n_servers);
+        supl_race_set(&race, race_n, hedge_ms);
+
+        err = supl_get_assist_race(&ctx, &race, &assist);
+
+        for (i = 0; i < race.n; i++)
+        {
+            supl_race_stat_t stat;
+
+            supl_race_get_stat(&race, i, &stat);
+            if (stat.completed)
+            {
+                supl_pool_report(&pool, order[i], 0, stat.last_ms);
+            } else if (stat.failures)
+            {
+                supl_pool_report(&pool, order[i], E_SUPL_CONNECT, 0);
+            }
+
+#ifdef SUPL_DEBUG
+            if (debug_flags & SUPL_DEBUG_DEBUG)
+            {
+                fprintf(debug_f ? debug_f : stderr, "%s: %lu starts, %lu wins, %lu failures, %lu cancels, %.1f ms\n",
+                        stat.server, stat.starts, stat.wins, stat.failures, stat.cancels,
+                        stat.completed ? stat.total_ms / stat.completed : 0.0);
+            }
+#endif
+        }
+
+        supl_race_free(&race);
+    } else
+    {
+        err = supl_get_assist_pool(&ctx, &pool, &assist);
+    }
+
+    if (state_file)
+    {
+        (void)supl_pool_save(&pool, state_file);
+    }
+    supl_pool_free(&pool);
+
     if (err < 0)
     {
         fprintf(stderr, "SUPL protocol error %d\n", err);
         exit(1);
     }
 
+    if (store_file)
+    {
+        supl_cached_t cached;
+        struct timeval now;
+
+        /* the reply may be partial, print what the store has now */
+        if (supl_store_put(&store, &store_key, &assist) == 0 &&
+            supl_store_get(&store, &store_key, &cached))
+        {
+            gettimeofday(&now, 0);
+            supl_assist_fresh(&cached, 0, &now, &assist);
+        }
+    }
+
+ output:
+    if (store_file)
+    {
+        supl_store_close(&store);
+    }
+
+    if (publish_name)
+    {
+        supl_shm_t shm;
+
+        if (supl_shm_create(&shm, publish_name) == 0)
+        {
+            (void)supl_shm_publish(&shm, &assist);
+            supl_shm_close(&shm);
+        } else
+        {
+            fprintf(stderr, "Error: publish %s (%s)\n", publish_name, strerror(errno));
+        }
+    }
+
+#ifdef SUPL_DEBUG
+    if (debug_flags & SUPL_DEBUG_DEBUG)
+    {
+        supl_stats_t stats;
+
+        supl_get_stats(&ctx, &stats);
+        fprintf(debug_f ? debug_f : stderr, "Sent %lu bytes in %lu messages, received %lu bytes in %lu messages\n",
+                stats.sent, stats.out_msg, stats.recv, stats.in_msg);
+    }
+#endif
+
     if (debug_f)
     {
         fclose(debug_f);
     }
 
-    switch (format)
+    if (stream_mode && !from_store)
     {
-        case FORMAT_DEFAULT:
-            supl_consume_2(&assist);
-            break;
-        case FORMAT_HUMAN:
-            supl_consume_1(&assist);
-            break;
-        case FORMAT_BIN:
-            supl_consume_3(&assist);
+        /* the fake position, and the parts the store had fresh */
+        supl_stream_rest(stdout, &assist, &stream);
+    } else
+    {
+        supl_consume(stdout, format, &assist);
     }
 
     supl_ctx_free(&ctx);
@@ -0,0 +1,281 @@
+/*
+** SUPL library - SUPL server pool with latency and failure scoring
+**
+** Copyright (c) 2007 Tatu Mannisto <tatu a-t tajuma d-o-t com>
+** All rights reserved.
+** Redistribution and modifications are permitted subject to BSD license.
+**
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "supl.h"
+
+/* latency assumed for a server we have not heard from yet */
+#define POOL_PRIOR_MS 1000.0
+
+#define POOL_STATE_VERSION 1
+
+static double server_score(supl_server_t *s) {
+  double ms = s->samples ? s->ewma_ms : POOL_PRIOR_MS;
+
+  /* a server failing half of the time costs three times its latency */
+  return ms * (1.0 + 4.0 * s->fail_ewma);
+}
+
+int EXPORT supl_pool_new(supl_pool_t *pool, char **servers, int n) {
+  int i;
+
+  memset(pool, 0, sizeof(supl_pool_t));
+
+  pool->server = calloc(n, sizeof(supl_server_t));
+  if (!pool->server) return E_SUPL_INTERNAL;
+
+  for (i = 0; i < n; i++) {
+    pool->server[i].name = strdup(servers[i]);
+  }
+
+  pool->n = n;
+  pool->alpha = 0.3;
+  pool->backoff_base = 5;
+  pool->backoff_max = 600;
+  pool->seed = time(0) ^ getpid();
+  pthread_mutex_init(&pool->lock, 0);
+
+  return 0;
+}
+
+void EXPORT supl_pool_free(supl_pool_t *pool) {
+  int i;
+
+  for (i = 0; i < pool->n; i++) {
+    free(pool->server[i].name);
+  }
+  free(pool->server);
+  pthread_mutex_destroy(&pool->lock);
+
+  memset(pool, 0, sizeof(supl_pool_t));
+}
+
+/*
+** Fill order[] with server indexes, best first. Servers backing off come
+** last, ordered by the time they may be retried.
+*/
+
+int EXPORT supl_pool_rank(supl_pool_t *pool, int *order) {
+  time_t now = time(0);
+  int i, j, n;
+
+  pthread_mutex_lock(&pool->lock);
+
+  for (n = 0; n < pool->n; n++) {
+    supl_server_t *s = &pool->server[n];
+
+    /* insertion sort, pools are small */
+    for (i = n; i > 0; i--) {
+      supl_server_t *o = &pool->server[order[i - 1]];
+      int s_ok = s->retry_at <= now, o_ok = o->retry_at <= now;
+
+      if (s_ok && !o_ok) continue;
+      if (s_ok == o_ok) {
+	if (s_ok ? server_score(s) < server_score(o) : s->retry_at < o->retry_at) continue;
+      }
+      break;
+    }
+    for (j = n; j > i; j--) order[j] = order[j - 1];
+    order[i] = n;
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+
+  return pool->n;
+}
+
+int EXPORT supl_pool_select(supl_pool_t *pool) {
+  int *order, best;
+
+  if (pool->n <= 0) return -1;
+
+  order = malloc(pool->n * sizeof(int));
+  if (!order) return 0;
+
+  supl_pool_rank(pool, order);
+  best = order[0];
+  free(order);
+
+  return best;
+}
+
+void EXPORT supl_pool_report(supl_pool_t *pool, int i, int err, double ms) {
+  supl_server_t *s;
+
+  if (i < 0 || i >= pool->n) return;
+
+  s = &pool->server[i];
+
+  pthread_mutex_lock(&pool->lock);
+
+  s->last_used = time(0);
+
+  if (err == 0) {
+    s->ewma_ms = s->samples ? s->ewma_ms + pool->alpha * (ms - s->ewma_ms) : ms;
+    s->samples++;
+    s->fail_ewma -= pool->alpha * s->fail_ewma;
+    s->successes++;
+    s->fail_streak = 0;
+    s->retry_at = 0;
+  } else {
+    long delay;
+    int shift = s->fail_streak < 16 ? s->fail_streak : 16;
+
+    s->fail_ewma += pool->alpha * (1.0 - s->fail_ewma);
+    s->failures++;
+    s->fail_streak++;
+
+    /* exponential backoff with equal jitter */
+    delay = (long)pool->backoff_base << shift;
+    if (delay > pool->backoff_max) delay = pool->backoff_max;
+    delay = delay / 2 + rand_r(&pool->seed) % (delay / 2 + 1);
+    s->retry_at = s->last_used + delay;
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+** State file has one line per server:
+**   name ewma_ms samples fail_ewma successes failures fail_streak retry_at last_used
+** Servers not in the pool are ignored on load.
+*/
+
+int EXPORT supl_pool_load(supl_pool_t *pool, char *file) {
+  FILE *fp;
+  char line[512], name[256];
+  int version;
+
+  fp = fopen(file, "r");
+  if (!fp) return E_SUPL_READ;
+
+  if (!fgets(line, sizeof(line), fp) || sscanf(line, "supl-pool %d", &version) != 1 ||
+      version != POOL_STATE_VERSION) {
+    fclose(fp);
+    return E_SUPL_DECODE;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+
+  while (fgets(line, sizeof(line), fp)) {
+    supl_server_t v;
+    long retry_at, last_used;
+    int i;
+
+    if (sscanf(line, "%255s %lf %lu %lf %lu %lu %d %ld %ld", name,
+	       &v.ewma_ms, &v.samples, &v.fail_ewma, &v.successes, &v.failures,
+	       &v.fail_streak, &retry_at, &last_used) != 9) continue;
+
+    for (i = 0; i < pool->n; i++) {
+      supl_server_t *s = &pool->server[i];
+
+      if (strcmp(s->name, name) != 0) continue;
+
+      v.name = s->name;
+      v.retry_at = retry_at;
+      v.last_used = last_used;
+      *s = v;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+
+  fclose(fp);
+
+  return 0;
+}
+
+int EXPORT supl_pool_save(supl_pool_t *pool, char *file) {
+  FILE *fp;
+  char *tmp;
+  int i, err = 0;
+
+  tmp = malloc(strlen(file) + 16);
+  if (!tmp) return E_SUPL_INTERNAL;
+  sprintf(tmp, "%s.%d", file, getpid());
+
+  fp = fopen(tmp, "w");
+  if (!fp) {
+    free(tmp);
+    return E_SUPL_WRITE;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+
+  fprintf(fp, "supl-pool %d\n", POOL_STATE_VERSION);
+  for (i = 0; i < pool->n; i++) {
+    supl_server_t *s = &pool->server[i];
+
+    fprintf(fp, "%s %.3f %lu %.6f %lu %lu %d %ld %ld\n", s->name,
+	    s->ewma_ms, s->samples, s->fail_ewma, s->successes, s->failures,
+	    s->fail_streak, (long)s->retry_at, (long)s->last_used);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+
+  if (fclose(fp) != 0) err = E_SUPL_WRITE;
+
+  /* replace atomically so concurrent clients never see half a file */
+  if (err == 0 && rename(tmp, file) != 0) err = E_SUPL_WRITE;
+  if (err) unlink(tmp);
+
+  free(tmp);
+
+  return err;
+}
+
+/*
+** Try the servers best first until one of them answers, every attempt
+** feeds the latency and failure scores.
+*/
+
+int EXPORT supl_get_assist_pool(supl_ctx_t *ctx, supl_pool_t *pool, supl_assist_t *assist) {
+  int *order;
+  int i, err = E_SUPL_CONNECT;
+
+  if (pool->n <= 0) return E_SUPL_CONNECT;
+
+  order = malloc(pool->n * sizeof(int));
+  if (!order) return E_SUPL_INTERNAL;
+
+  supl_pool_rank(pool, order);
+
+  for (i = 0; i < pool->n; i++) {
+    struct timeval start, end;
+
+    gettimeofday(&start, 0);
+    err = supl_get_assist(ctx, pool->server[order[i]].name, assist);
+    gettimeofday(&end, 0);
+
+    /* the caller gave up, says nothing of the server */
+    if (err == E_SUPL_CANCELLED) break;
+
+    supl_pool_report(pool, order[i], err,
+		     (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_usec - start.tv_usec) / 1000.0);
+
+    if (err == 0) {
+      pthread_mutex_lock(&pool->lock);
+      pool->last = order[i];
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+  }
+
+  free(order);
+
+  return err;
+}
@@ -0,0 +1,338 @@
+/*
+** SUPL library - predict the next cells of moving SETs from their handovers
+**
+** Copyright (c) 2007 Tatu Mannisto <tatu a-t tajuma d-o-t com>
+** All rights reserved.
+** Redistribution and modifications are permitted subject to BSD license.
+**
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "supl.h"
+
+/*
+** A neighbor measurement names a cell only by its frequency and BSIC or
+** scrambling code, which are unique among the neighbors of one cell but
+** not globally. So the mapping is learnt: when a SET reports a new serving
+** cell, the strongest neighbor of its previous report is linked to it.
+** Plain cell to cell transitions are counted as well, for SETs which send
+** no measurements. A report is then answered with the cells its strongest
+** neighbors lead to, and the most common next cells after those.
+**
+** Cells and SETs live in fixed tables of PREDICT_PROBE slot windows, a
+** newcomer takes the least recently seen slot of its window, so memory
+** stays bounded however many cells and SETs pass by.
+*/
+
+#define PREDICT_PROBE 4
+#define PREDICT_LINKS 16
+#define PREDICT_GAP 900 /* seconds, a longer silence is not a handover */
+#define PREDICT_ID_MAX 16
+
+struct cell_s {
+  int type; /* 1 GSM, 2 WCDMA, 0 none */
+  int mcc, mnc, lac, ci;
+};
+
+struct link_s {
+  int freq, id;        /* neighbor measurement, -1 for a plain transition */
+  struct cell_s to;
+  unsigned int count;
+};
+
+struct supl_predict_cell_s {
+  struct cell_s cell;
+  time_t seen;
+  int n;
+  struct link_s link[PREDICT_LINKS];
+};
+
+struct supl_predict_set_s {
+  unsigned char id[PREDICT_ID_MAX];
+  size_t len;
+  time_t seen;
+  struct cell_s cell;
+  int has_nmr;
+  supl_nmr_t strongest; /* of the last report */
+  int predicted;
+  struct cell_s next[SUPL_PREDICT_MAX];
+};
+
+static unsigned int hash_bytes(const void *buf, size_t len) {
+  const unsigned char *p = buf;
+  unsigned int h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < len; i++) h = (h ^ p[i]) * 16777619u;
+
+  return h;
+}
+
+static int cell_of(supl_param_t *p, struct cell_s *cell) {
+  supl_ctx_t ctx;
+
+  memset(cell, 0, sizeof(struct cell_s));
+  memset(&ctx, 0, sizeof(ctx));
+
+  /* which cell supl_set_*_cell() set, the flags are private to supl.c */
+  supl_set_gsm_cell(&ctx, p->gsm.mcc, p->gsm.mnc, p->gsm.lac, p->gsm.ci);
+  if (p->set & ctx.p.set) {
+    cell->type = 1;
+    cell->mcc = p->gsm.mcc;
+    cell->mnc = p->gsm.mnc;
+    cell->lac = p->gsm.lac;
+    cell->ci = p->gsm.ci;
+    return 1;
+  }
+
+  memset(&ctx, 0, sizeof(ctx));
+  supl_set_wcdma_cell(&ctx, p->wcdma.mcc, p->wcdma.mnc, p->wcdma.uc);
+  if (p->set & ctx.p.set) {
+    cell->type = 2;
+    cell->mcc = p->wcdma.mcc;
+    cell->mnc = p->wcdma.mnc;
+    cell->ci = p->wcdma.uc;
+    return 1;
+  }
+
+  return 0;
+}
+
+static void cell_param(struct cell_s *cell, int request, supl_param_t *p) {
+  supl_ctx_t ctx;
+
+  memset(&ctx, 0, sizeof(ctx));
+  if (cell->type == 1) supl_set_gsm_cell(&ctx, cell->mcc, cell->mnc, cell->lac, cell->ci);
+  else supl_set_wcdma_cell(&ctx, cell->mcc, cell->mnc, cell->ci);
+  supl_request(&ctx, request);
+
+  *p = ctx.p;
+}
+
+static int cell_eq(struct cell_s *a, struct cell_s *b) {
+  return memcmp(a, b, sizeof(struct cell_s)) == 0;
+}
+
+int EXPORT supl_predict_new(supl_predict_t *pr, int cells, int sets) {
+  memset(pr, 0, sizeof(supl_predict_t));
+
+  if (cells < PREDICT_PROBE) cells = 4096;
+  if (sets < PREDICT_PROBE) sets = 4096;
+
+  pr->cell = calloc(cells, sizeof(struct supl_predict_cell_s));
+  pr->set = calloc(sets, sizeof(struct supl_predict_set_s));
+  if (!pr->cell || !pr->set) {
+    free(pr->cell);
+    free(pr->set);
+    return E_SUPL_INTERNAL;
+  }
+
+  pr->cells = cells;
+  pr->sets = sets;
+  pthread_mutex_init(&pr->lock, 0);
+
+  return 0;
+}
+
+void EXPORT supl_predict_free(supl_predict_t *pr) {
+  free(pr->cell);
+  free(pr->set);
+  pthread_mutex_destroy(&pr->lock);
+  memset(pr, 0, sizeof(supl_predict_t));
+}
+
+// slot of cell, a free or the stalest one of its window if create is set
+static struct supl_predict_cell_s *cell_slot(supl_predict_t *pr, struct cell_s *cell, int create) {
+  unsigned int h = hash_bytes(cell, sizeof(struct cell_s));
+  struct supl_predict_cell_s *c, *old = 0;
+  int i;
+
+  for (i = 0; i < PREDICT_PROBE; i++) {
+    c = &pr->cell[(h + i) % pr->cells];
+    if (cell_eq(&c->cell, cell)) return c;
+    if (!old || c->seen < old->seen) old = c;
+  }
+
+  if (!create) return 0;
+
+  memset(old, 0, sizeof(struct supl_predict_cell_s));
+  old->cell = *cell;
+
+  return old;
+}
+
+static struct supl_predict_set_s *set_slot(supl_predict_t *pr, const void *id, size_t len) {
+  unsigned int h = hash_bytes(id, len);
+  struct supl_predict_set_s *s, *old = 0;
+  int i;
+
+  for (i = 0; i < PREDICT_PROBE; i++) {
+    s = &pr->set[(h + i) % pr->sets];
+    if (s->len == len && memcmp(s->id, id, len) == 0) return s;
+    if (!old || s->seen < old->seen) old = s;
+  }
+
+  memset(old, 0, sizeof(struct supl_predict_set_s));
+  memcpy(old->id, id, len);
+  old->len = len;
+
+  return old;
+}
+
+/*
+** Count the link. A measurement leads to one cell only, another cell
+** wins it when its count has worn down the old one's. When the table
+** is full the weakest link makes room.
+*/
+
+static void link_learn(struct supl_predict_cell_s *c, int freq, int id, struct cell_s *to) {
+  struct link_s *l, *weakest = 0;
+  int i;
+
+  for (i = 0; i < c->n; i++) {
+    l = &c->link[i];
+    if (l->freq != freq || l->id != id) continue;
+    if (freq < 0 && !cell_eq(&l->to, to)) continue;
+
+    if (cell_eq(&l->to, to)) {
+      l->count++;
+    } else if (--l->count == 0) {
+      l->to = *to;
+      l->count = 1;
+    }
+    return;
+  }
+
+  if (c->n < PREDICT_LINKS) {
+    l = &c->link[c->n++];
+  } else {
+    for (i = 0; i < c->n; i++) {
+      if (!weakest || c->link[i].count < weakest->count) weakest = &c->link[i];
+    }
+    l = weakest;
+  }
+
+  l->freq = freq;
+  l->id = id;
+  l->to = *to;
+  l->count = 1;
+}
+
+static int next_add(struct supl_predict_set_s *s, struct cell_s *cell, struct cell_s *here, int max) {
+  int i;
+
+  if (s->predicted >= max || cell_eq(cell, here)) return 0;
+
+  for (i = 0; i < s->predicted; i++) {
+    if (cell_eq(&s->next[i], cell)) return 0;
+  }
+
+  s->next[s->predicted++] = *cell;
+
+  return 1;
+}
+
+static int nmr_cmp(const void *a, const void *b) {
+  return ((const supl_nmr_t *)b)->level - ((const supl_nmr_t *)a)->level;
+}
+
+/*
+** A SET identified by id (its IMSI, say) reported the cell and the
+** neighbor measurements in p. Learns from its previous report and fills
+** next with up to max cells it will likely move to, cell and request set
+** as for supl_get_assist(). Returns how many.
+*/
+
+int EXPORT supl_predict_report(supl_predict_t *pr, const void *id, size_t len, supl_param_t *p,
+			       supl_param_t *next, int max) {
+  struct supl_predict_cell_s *c;
+  struct supl_predict_set_s *s;
+  struct cell_s cell;
+  supl_nmr_t nmr[SUPL_NMR_MAX];
+  time_t now = time(0);
+  int i, k, n;
+
+  if (!cell_of(p, &cell) || len == 0) return 0;
+  if (len > PREDICT_ID_MAX) len = PREDICT_ID_MAX;
+  if (max > SUPL_PREDICT_MAX) max = SUPL_PREDICT_MAX;
+
+  pthread_mutex_lock(&pr->lock);
+
+  pr->reports++;
+  s = set_slot(pr, id, len);
+
+  /* a handover since the last report */
+  if (s->cell.type && !cell_eq(&s->cell, &cell) && now - s->seen < PREDICT_GAP) {
+    pr->handovers++;
+    for (i = 0; i < s->predicted; i++) {
+      if (cell_eq(&s->next[i], &cell)) break;
+    }
+    if (i < s->predicted) pr->predicted++;
+
+    c = cell_slot(pr, &s->cell, 1);
+    c->seen = now;
+    link_learn(c, -1, -1, &cell);
+    if (s->has_nmr) link_learn(c, s->strongest.freq, s->strongest.id, &cell);
+  }
+
+  n = p->nmr.cnt < SUPL_NMR_MAX ? p->nmr.cnt : SUPL_NMR_MAX;
+  memcpy(nmr, p->nmr.m, n * sizeof(supl_nmr_t));
+  qsort(nmr, n, sizeof(supl_nmr_t), nmr_cmp);
+
+  s->cell = cell;
+  s->seen = now;
+  s->has_nmr = n > 0;
+  if (n > 0) s->strongest = nmr[0];
+  s->predicted = 0;
+
+  c = cell_slot(pr, &cell, 0);
+  if (c) {
+    c->seen = now;
+
+    /* where the strongest neighbors lead */
+    for (i = 0; i < n; i++) {
+      for (k = 0; k < c->n; k++) {
+	if (c->link[k].freq == nmr[i].freq && c->link[k].id == nmr[i].id) {
+	  next_add(s, &c->link[k].to, &cell, max);
+	  break;
+	}
+      }
+    }
+
+    /* then the usual next cells, most common first */
+    while (s->predicted < max) {
+      struct link_s *best = 0;
+
+      for (k = 0; k < c->n; k++) {
+	struct link_s *l = &c->link[k];
+
+	if (l->freq >= 0 || (best && l->count <= best->count)) continue;
+	for (i = 0; i < s->predicted && !cell_eq(&s->next[i], &l->to); i++);
+	if (i < s->predicted) continue;
+	best = l;
+      }
+      if (!best || !next_add(s, &best->to, &cell, max)) break;
+    }
+  }
+
+  for (i = 0; i < s->predicted; i++) {
+    cell_param(&s->next[i], p->request, &next[i]);
+  }
+  n = s->predicted;
+
+  pthread_mutex_unlock(&pr->lock);
+
+  return n;
+}
+
+void EXPORT supl_predict_get_stats(supl_predict_t *pr, supl_predict_stats_t *stats) {
+  pthread_mutex_lock(&pr->lock);
+  stats->reports = pr->reports;
+  stats->handovers = pr->handovers;
+  stats->predicted = pr->predicted;
+  pthread_mutex_unlock(&pr->lock);
+}
@@ -7,15 +7,28 @@
 **
 */
 
+#define _GNU_SOURCE /* accept4(), pthread_attr_setaffinity_np() */
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
-#include <sys/socket.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
 
 #include "supl.h"
 #include "asn-supl/ULP-PDU.h"
@@ -26,219 +39,1217 @@
 #define CERTF "srv-cert.pem"
 #define KEYF  "srv-priv.pem"
 
-static void ssl_error(SSL *ssl, int err) {
-  int ssl_err = SSL_get_error(ssl, err);
+#define SESSION_TIMEOUT 30 /* seconds without progress */
+#define MAX_EVENTS 256
+#define RELAY_BUFFER 32768 /* bytes queued to one end before reading the other stops */
+#define LOG_RING (1 << 20) /* bytes of PDUs a worker may have waiting to be shown, power of 2 */
+
+/*
+** Every mobile gets a session of two ends, the mobile and the upstream
+** server, each a small state machine driven by one epoll loop. The
+** upstream connection is started as soon as the mobile connects, so the
+** two handshakes overlap. Sockets are non-blocking, an SSL call which
+** can not finish tells which way it waits and is called again when the
+** socket is ready.
+**
+** The two directions are independent: whole PDUs read from one end are
+** queued to the other as soon as they are complete, whoever speaks
+** first. An end is only read while its peer has less than RELAY_BUFFER
+** bytes waiting, so a slow reader holds back just its own direction.
+**
+** There is a worker thread per core, each with its own SO_REUSEPORT
+** listener, epoll loop, SSL contexts and sessions, so the kernel spreads
+** the mobiles and the workers never wait for each other. They only
+** count, the main thread adds the counters up for the statistics.
+**
+** With --debug the PDUs are shown by a writer thread of their own. A
+** worker copies each one into its ring and goes on relaying, the writer
+** decodes and prints what the rings hold. If the writer falls behind
+** and a ring fills up, PDUs are left out of the display, not delayed.
+**
+** A PDU is framed by its 16-bit length and classified by peeking at the
+** UlpMessage choice. It is fully decoded only to check it, unless
+** --pass-through, and to show it, when its session is selected and its
+** type wanted.
+*/
+
+enum {
+  ST_CONNECT,   /* TCP connect() to the server in progress */
+  ST_HANDSHAKE, /* SSL_accept() or SSL_connect() */
+  ST_RELAY
+};
+
+struct sess_s;
+
+struct end_s {
+  struct sess_s *s;
+  int fd;
+  SSL *ssl;
+  int state;
+  int events;   /* registered with epoll */
+  int ssl_want; /* EPOLLOUT if the last SSL call wants to write */
+
+  supl_ulp_t in; /* in.size is the number of bytes read so far */
+  unsigned char *out;
+  size_t out_len, out_off, out_alloc;
+};
+
+struct worker_s;
+
+struct sess_s {
+  struct worker_s *w;
+  unsigned long id;
+  struct end_s mobile, server;
+  struct addrinfo *ai; /* server address being tried */
+  int relayed;         /* PDUs */
+  int done;            /* SUPLEND relayed or a side hung up, close when flushed */
+  int show;            /* its PDUs are displayed */
+  int closed;          /* freed after the events at hand */
+  time_t active;
+  struct sess_s *prev, *next; /* by last activity, oldest first */
+};
+
+/* all unsigned long, they are summed as an array */
+struct stats_s {
+  unsigned long sessions, open, failures, connect_failures, handshake_failures;
+  unsigned long resumed, full; /* server handshakes */
+  unsigned long pdus[2], bytes[2], throttled[2]; /* [0] mobile => server, [1] server => mobile */
+  unsigned long log_drops; /* PDUs not shown, the ring was full */
+  unsigned long messages[UlpMessage_PR_msDUMMY3 + 1]; /* by UlpMessage_PR_*, 0 for what could not be told */
+};
+
+/*
+** Single producer single consumer ring of PDUs: the worker writes at
+** head, the writer reads at tail, each only ever moving its own. The
+** counters run freely and are masked into buf. A record which would not
+** fit before the end of buf starts at the beginning, after padding.
+*/
+
+struct log_rec_s {
+  unsigned int len; /* of the record, header included, aligned */
+  unsigned int size; /* of the PDU, 0 if padding */
+  int dir;
+  unsigned long sess;
+};
+
+#define LOG_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+struct log_ring_s {
+  unsigned char *buf;
+  unsigned long head __attribute__((aligned(64)));
+  unsigned long tail __attribute__((aligned(64)));
+};
+
+/* only the worker writes its counters, plain stores the main thread may read any time */
+#define STAT_ADD(w, field, n) __atomic_store_n(&(w)->st.field, (w)->st.field + (n), __ATOMIC_RELAXED)
+
+struct worker_s {
+  int id;
+  int cpu; /* pinned to, -1 if not */
+  pthread_t thread;
+  SSL_CTX *ssl_ctx;      /* for the mobiles */
+  SSL_CTX *client_ctx;   /* for the server */
+  SSL_SESSION *session;  /* with the server, resumed by the next connection */
+  int epfd;
+  int listen_fd;
+  int accept_paused; /* out of file descriptors */
+
+  struct sess_s *idle_head, *idle_tail;
+  struct sess_s *dead; /* closed, its other end may still have an event pending */
+
+  struct log_ring_s log;
+
+  struct stats_s st __attribute__((aligned(64)));
+};
+
+static struct proxy_s {
+  int debug;
+  char host[256]; /* of the server, for SNI */
+  struct addrinfo *upstream;
+  unsigned char ticket_keys[80]; /* the same in every worker, mobiles resume on any */
+
+  int workers;
+  struct worker_s *worker;
+
+  int pass_through; /* relay PDUs without decoding them */
+  int sample;       /* show one session in sample */
+  int set_id;       /* show the sessions of this SET */
+  unsigned char id[8];
+  int messages;     /* types shown, 1 << UlpMessage_PR_*, 0 for all */
+
+  pthread_t writer;
+  int writer_stop;
+} px;
+
+static volatile sig_atomic_t quit;
+
+static void on_signal(int sig) {
+  __atomic_store_n(&quit, 1, __ATOMIC_RELAXED);
+}
+
+/*
+** Sessions
+*/
+
+static void idle_unlink(struct sess_s *s) {
+  struct worker_s *w = s->w;
+
+  if (s->prev) s->prev->next = s->next;
+  else if (w->idle_head == s) w->idle_head = s->next;
+  if (s->next) s->next->prev = s->prev;
+  else if (w->idle_tail == s) w->idle_tail = s->prev;
+
+  s->prev = s->next = 0;
+}
+
+static void sess_touch(struct sess_s *s) {
+  struct worker_s *w = s->w;
+
+  idle_unlink(s);
+
+  s->active = time(0);
+  s->prev = w->idle_tail;
+  if (w->idle_tail) w->idle_tail->next = s;
+  else w->idle_head = s;
+  w->idle_tail = s;
+}
+
+static struct end_s *peer(struct end_s *e) {
+  return e == &e->s->mobile ? &e->s->server : &e->s->mobile;
+}
+
+static size_t queued(struct end_s *e) {
+  return e->out_len - e->out_off;
+}
+
+/* may more be read from e, towards its peer */
+static int readable(struct end_s *e) {
+  return !e->s->done && e->state == ST_RELAY && peer(e)->state == ST_RELAY && queued(peer(e)) < RELAY_BUFFER;
+}
+
+static void end_events(struct end_s *e) {
+  struct epoll_event ev;
+  int want = 0;
+
+  if (e->fd < 0) return;
 
-  fprintf(stderr, "Error: SSL_accept() error code %d\n", ssl_err);
-  if (ssl_err == SSL_ERROR_SYSCALL) {
-    if (err == -1) fprintf(stderr, "  I/O error (%s)\n", strerror(errno));
-    if (err == 0) fprintf(stderr, "  SSL peer closed connection\n");
+  switch (e->state) {
+  case ST_CONNECT:
+    want = EPOLLOUT;
+    break;
+  case ST_HANDSHAKE:
+    want = e->ssl_want ? e->ssl_want : EPOLLIN;
+    break;
+  case ST_RELAY:
+    if (readable(e)) want = EPOLLIN;
+    if (queued(e) || e->ssl_want == EPOLLOUT) want |= EPOLLOUT;
+    break;
   }
+
+  if (want == e->events) return;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = want;
+  ev.data.ptr = e;
+  epoll_ctl(e->s->w->epfd, EPOLL_CTL_MOD, e->fd, &ev);
+  e->events = want;
 }
 
-static int ssl_accept(int port, supl_ctx_t *client_ctx) {
-  int err;
-  int listen_sd;
-  int sd;
-  struct sockaddr_in sa_serv;
-  struct sockaddr_in sa_cli;
-  socklen_t client_len;
-  SSL_CTX* ctx;
-  SSL*     ssl;
-  X509*    client_cert;
-  char*    str;
-  SSL_METHOD *meth;
-  
-  /* SSL preliminaries. We keep the certificate and key with the context. */
-
-  SSL_load_error_strings();
-  SSLeay_add_ssl_algorithms();
-  // meth = TLSv1_server_method();
-  meth = SSLv23_server_method();
-  ctx = SSL_CTX_new (meth);
-  if (!ctx) {
+static int end_watch(struct end_s *e) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = e->events;
+  ev.data.ptr = e;
+
+  return epoll_ctl(e->s->w->epfd, EPOLL_CTL_ADD, e->fd, &ev);
+}
+
+static void end_close(struct end_s *e, int clean) {
+  if (e->ssl) {
+    if (clean) SSL_shutdown(e->ssl);
+    /* SSL_get_error() of the next session would see what this left */
+    ERR_clear_error();
+    SSL_free(e->ssl);
+    e->ssl = 0;
+  }
+  if (e->fd >= 0) {
+    epoll_ctl(e->s->w->epfd, EPOLL_CTL_DEL, e->fd, 0);
+    close(e->fd);
+    e->fd = -1;
+  }
+
+  supl_ulp_free(&e->in);
+  supl_ulp_release(&e->in);
+  free(e->out);
+  e->out = 0;
+}
+
+static void listen_resume(struct worker_s *w) {
+  struct epoll_event ev;
+
+  if (!w->accept_paused) return;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = 0;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listen_fd, &ev) == 0) w->accept_paused = 0;
+}
+
+// remember the session with the server for the next connection to resume
+static void upstream_keep(struct worker_s *w, SSL *ssl) {
+  SSL_SESSION *session;
+
+  if (!ssl || SSL_session_reused(ssl)) return;
+
+  session = SSL_get1_session(ssl);
+  if (!session) return;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (!SSL_SESSION_is_resumable(session)) {
+    SSL_SESSION_free(session);
+    return;
+  }
+#endif
+
+  if (w->session) SSL_SESSION_free(w->session);
+  w->session = session;
+}
+
+static void sess_close(struct sess_s *s) {
+  struct worker_s *w = s->w;
+
+  idle_unlink(s);
+
+  if (!s->done) STAT_ADD(w, failures, 1);
+
+  if (s->server.state == ST_RELAY) upstream_keep(w, s->server.ssl);
+  end_close(&s->mobile, s->done);
+  end_close(&s->server, s->done);
+
+  if (px.debug & SUPL_DEBUG_DEBUG) fprintf(stderr, "[%d.%lu] closed\n", w->id, s->id);
+
+  STAT_ADD(w, open, -1);
+  s->closed = 1;
+  s->next = w->dead;
+  w->dead = s;
+  listen_resume(w);
+}
+
+static void free_dead(struct worker_s *w) {
+  struct sess_s *s;
+
+  while ((s = w->dead)) {
+    w->dead = s->next;
+    free(s);
+  }
+}
+
+static int ssl_wait(struct end_s *e, int ret) {
+  switch (SSL_get_error(e->ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+    e->ssl_want = EPOLLIN;
     return 0;
+  case SSL_ERROR_WANT_WRITE:
+    e->ssl_want = EPOLLOUT;
+    return 0;
+  default:
+    ERR_clear_error();
+    return E_SUPL_READ;
   }
-  
-  if (SSL_CTX_use_certificate_file(ctx, CERTF, SSL_FILETYPE_PEM) <= 0) {
-    fprintf(stderr, "Error: Valid server certificate not found in " CERTF "\n");
+}
+
+static int end_flush(struct end_s *e) {
+  int n;
+
+  while (e->out_off < e->out_len) {
+    n = SSL_write(e->ssl, e->out + e->out_off, e->out_len - e->out_off);
+    if (n <= 0) return ssl_wait(e, n) < 0 ? E_SUPL_WRITE : 0;
+
+    e->ssl_want = 0;
+    e->out_off += n;
+    sess_touch(e->s);
+  }
+
+  e->out_off = e->out_len = 0;
+
+  return 0;
+}
+
+/* 1 when a whole ULP PDU is in e->in, 0 if more is needed */
+static int end_read(struct end_s *e) {
+  size_t need;
+  int n;
+
+  while (1) {
+    need = 2;
+
+    /* the 16-bit length leads every PDU */
+    if (e->in.size >= 2) {
+      need = e->in.buffer[0] << 8 | e->in.buffer[1];
+      if (need <= 2) return E_SUPL_DECODE;
+      if (e->in.size >= need) return 1;
+    }
+
+    if (supl_ulp_reserve(&e->in, need) < 0) return E_SUPL_READ;
+
+    n = SSL_read(e->ssl, e->in.buffer + e->in.size, need - e->in.size);
+    if (n <= 0) {
+      if (ssl_wait(e, n) == 0) return 0;
+
+      /* hanging up between PDUs ends the session */
+      if (e->in.size == 0 && e->s->relayed) {
+	e->s->done = 1;
+	return 0;
+      }
+      return E_SUPL_READ;
+    }
+
+    e->ssl_want = 0;
+    e->in.size += n;
+    sess_touch(e->s);
+  }
+}
+
+static int out_append(struct end_s *e, unsigned char *buf, size_t size) {
+  /* what is written is dropped from the front first */
+  if (e->out_off > 0 && e->out_len + size > e->out_alloc) {
+    memmove(e->out, e->out + e->out_off, e->out_len - e->out_off);
+    e->out_len -= e->out_off;
+    e->out_off = 0;
+  }
+
+  if (e->out_len + size > e->out_alloc) {
+    size_t alloc = e->out_alloc ? e->out_alloc : 1024;
+    unsigned char *p;
+
+    while (alloc < e->out_len + size) alloc *= 2;
+    p = realloc(e->out, alloc);
+    if (!p) return E_SUPL_INTERNAL;
+    e->out = p;
+    e->out_alloc = alloc;
+  }
+
+  memcpy(e->out + e->out_len, buf, size);
+  e->out_len += size;
+
+  return 0;
+}
+
+/*
+** Display
+*/
+
+// copy the PDU into the ring of its worker, never waiting for room
+static void log_pdu(struct sess_s *s, int dir, unsigned char *buf, size_t size) {
+  struct log_ring_s *r = &s->w->log;
+  struct log_rec_s rec;
+  size_t len = LOG_ALIGN(sizeof(rec) + size);
+  size_t off = r->head & (LOG_RING - 1);
+  size_t pad = LOG_RING - off < len ? LOG_RING - off : 0;
+  unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+  if (!r->buf) return;
+
+  if (r->head + pad + len - tail > LOG_RING) {
+    STAT_ADD(s->w, log_drops, 1);
+    return;
+  }
+
+  if (pad >= sizeof(rec)) {
+    memset(&rec, 0, sizeof(rec));
+    rec.len = pad;
+    memcpy(r->buf + off, &rec, sizeof(rec));
+  }
+
+  rec.len = len;
+  rec.size = size;
+  rec.dir = dir;
+  rec.sess = s->id;
+  off = (r->head + pad) & (LOG_RING - 1);
+  memcpy(r->buf + off, &rec, sizeof(rec));
+  memcpy(r->buf + off + sizeof(rec), buf, size);
+
+  __atomic_store_n(&r->head, r->head + pad + len, __ATOMIC_RELEASE);
+}
+
+static void show_pdu(FILE *f, int worker, struct log_rec_s *rec, unsigned char *buf) {
+  supl_ulp_t pdu;
+  PDU_t *rrlp;
+
+  memset(&pdu, 0, sizeof(pdu));
+  pdu.buffer = buf;
+  pdu.size = rec->size;
+
+  fprintf(f, "[%d.%lu] %s\n", worker, rec->sess, rec->dir ? "server => mobile" : "mobile => server");
+  if (supl_ulp_decode(&pdu) < 0) {
+    fprintf(f, "undecodable, %u bytes\n\n", rec->size);
+    return;
+  }
+
+  if (px.debug & SUPL_DEBUG_SUPL) {
+    xer_fprint(f, &asn_DEF_ULP_PDU, pdu.pdu);
+    fprintf(f, "\n");
+  }
+
+  if ((px.debug & SUPL_DEBUG_RRLP) && pdu.pdu->message.present == UlpMessage_PR_msSUPLPOS &&
+      supl_decode_rrlp(&pdu, &rrlp) == 0) {
+    fprintf(f, "[%d.%lu] === Embedded RRLP message ===\n", worker, rec->sess);
+    xer_fprint(f, &asn_DEF_PDU, rrlp);
+    fprintf(f, "\n");
+    asn_DEF_PDU.free_struct(&asn_DEF_PDU, rrlp, 0);
+  }
+
+  supl_ulp_free(&pdu);
+}
+
+/* show what the ring holds, how many PDUs */
+static int log_drain(struct worker_s *w) {
+  struct log_ring_s *r = &w->log;
+  unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  struct log_rec_s rec;
+  size_t off;
+  int n = 0;
+
+  while (r->tail != head) {
+    off = r->tail & (LOG_RING - 1);
+
+    /* too little left before the end for even a header, skipped by log_pdu() */
+    if (LOG_RING - off < sizeof(rec)) {
+      __atomic_store_n(&r->tail, r->tail + LOG_RING - off, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    memcpy(&rec, r->buf + off, sizeof(rec));
+    if (rec.size > 0) {
+      show_pdu(stdout, w->id, &rec, r->buf + off + sizeof(rec));
+      n++;
+    }
+
+    __atomic_store_n(&r->tail, r->tail + rec.len, __ATOMIC_RELEASE);
+  }
+
+  return n;
+}
+
+static void *writer_main(void *arg) {
+  static char out[1 << 16];
+  int i, n, stop;
+
+  /* written in batches, not a line at a time */
+  setvbuf(stdout, out, _IOFBF, sizeof(out));
+
+  do {
+    stop = __atomic_load_n(&px.writer_stop, __ATOMIC_ACQUIRE);
+
+    for (i = n = 0; i < px.workers; i++) n += log_drain(&px.worker[i]);
+    fflush(stdout);
+
+    if (n == 0 && !stop) usleep(10000);
+  } while (n > 0 || !stop);
+
+  return 0;
+}
+
+/*
+** Relaying
+*/
+
+/* queue the whole PDUs readable from from to its peer, 1 if there were any */
+static int relay_dir(struct end_s *from) {
+  struct end_s *to = peer(from);
+  int dir = from == &from->s->server;
+  supl_ulp_peek_t peek;
+  int ret, moved = 0;
+
+  while (readable(from)) {
+    ret = end_read(from);
+    if (ret < 0) return ret;
+    if (ret == 0) break;
+
+    if (supl_ulp_peek(from->in.buffer, from->in.size, &peek) < 0) peek.message = UlpMessage_PR_NOTHING;
+    if (!px.pass_through && supl_ulp_decode(&from->in) < 0) return E_SUPL_DECODE;
+    STAT_ADD(from->s->w, messages[peek.message], 1);
+
+    if (px.debug & (SUPL_DEBUG_SUPL | SUPL_DEBUG_RRLP)) {
+      if (px.set_id && peek.set_id >= SETId_PR_msisdn && peek.set_id <= SETId_PR_imsi &&
+	  memcmp(peek.id, px.id, sizeof(px.id)) == 0) {
+	from->s->show = 1;
+      }
+      if (from->s->show && (!px.messages || (px.messages & 1 << peek.message))) {
+	log_pdu(from->s, dir, from->in.buffer, from->in.size);
+      }
+    }
+
+    if (out_append(to, from->in.buffer, from->in.size) < 0) return E_SUPL_INTERNAL;
+    STAT_ADD(from->s->w, pdus[dir], 1);
+    STAT_ADD(from->s->w, bytes[dir], from->in.size);
+    from->s->relayed++;
+    moved = 1;
+
+    /* either side may end the session */
+    if (peek.message == UlpMessage_PR_msSUPLEND) from->s->done = 1;
+
+    supl_ulp_free(&from->in);
+    from->in.size = 0;
+  }
+
+  if (!from->s->done && queued(to) >= RELAY_BUFFER) STAT_ADD(from->s->w, throttled[dir], 1);
+
+  return moved;
+}
+
+/*
+** Relay both ways until neither end can make progress. Flushing one end
+** may make room to read more from the other, and the SSL layer may hold
+** bytes epoll does not know of, so every pass tries both.
+*/
+
+static int sess_relay(struct sess_s *s) {
+  int ret, moved;
+
+  if (s->mobile.state != ST_RELAY || s->server.state != ST_RELAY) return 0;
+
+  do {
+    moved = 0;
+
+    ret = relay_dir(&s->mobile);
+    if (ret < 0) return ret;
+    moved |= ret;
+
+    ret = relay_dir(&s->server);
+    if (ret < 0) return ret;
+    moved |= ret;
+
+    if (end_flush(&s->server) < 0 || end_flush(&s->mobile) < 0) return E_SUPL_WRITE;
+  } while (moved && !s->done);
+
+  return 0;
+}
+
+/*
+** The server end
+*/
+
+static int server_start(struct sess_s *s) {
+  struct end_s *e = &s->server;
+
+  for (; s->ai; s->ai = s->ai->ai_next) {
+    e->fd = socket(s->ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (e->fd < 0) continue;
+
+    if (connect(e->fd, s->ai->ai_addr, s->ai->ai_addrlen) == 0 || errno == EINPROGRESS) {
+      e->state = ST_CONNECT;
+      e->events = EPOLLOUT;
+      if (end_watch(e) == 0) return 0;
+    }
+
+    close(e->fd);
+    e->fd = -1;
+  }
+
+  STAT_ADD(s->w, connect_failures, 1);
+  return E_SUPL_CONNECT;
+}
+
+static int server_connected(struct sess_s *s) {
+  struct end_s *e = &s->server;
+  socklen_t len = sizeof(int);
+  int err = 0;
+
+  if (getsockopt(e->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+    /* try the next address */
+    epoll_ctl(s->w->epfd, EPOLL_CTL_DEL, e->fd, 0);
+    close(e->fd);
+    e->fd = -1;
+    s->ai = s->ai->ai_next;
+    return server_start(s);
+  }
+
+  e->ssl = SSL_new(s->w->client_ctx);
+  if (!e->ssl) return E_SUPL_CONNECT;
+  SSL_set_fd(e->ssl, e->fd);
+  SSL_set_tlsext_host_name(e->ssl, px.host);
+  if (s->w->session) SSL_set_session(e->ssl, s->w->session);
+
+  e->state = ST_HANDSHAKE;
+  e->ssl_want = EPOLLOUT;
+  sess_touch(s);
+
+  return 0;
+}
+
+static void end_event(struct end_s *e, int events) {
+  struct sess_s *s = e->s;
+  int ret;
+
+  if (s->closed) return;
+
+  if (e->state == ST_CONNECT) {
+    if (server_connected(s) < 0) goto close;
+    if (e->state == ST_CONNECT) {
+      end_events(e);
+      return;
+    }
+  } else if (events & (EPOLLHUP | EPOLLERR)) {
+    goto close;
+  }
+
+  if (e->state == ST_HANDSHAKE) {
+    ret = e == &s->mobile ? SSL_accept(e->ssl) : SSL_connect(e->ssl);
+    if (ret != 1) {
+      if (ssl_wait(e, ret) < 0) {
+	STAT_ADD(s->w, handshake_failures, 1);
+	goto close;
+      }
+      end_events(e);
+      return;
+    }
+
+    e->ssl_want = 0;
+    e->state = ST_RELAY;
+    sess_touch(s);
+    if (e == &s->server) {
+      if (SSL_session_reused(e->ssl)) STAT_ADD(s->w, resumed, 1);
+      else STAT_ADD(s->w, full, 1);
+    }
+    if (px.debug & SUPL_DEBUG_DEBUG) {
+      fprintf(stderr, "[%d.%lu] %s handshake done, %s%s\n", s->w->id, s->id, e == &s->mobile ? "mobile" : "server",
+	      SSL_get_cipher(e->ssl), SSL_session_reused(e->ssl) ? ", resumed" : "");
+    }
+  }
+
+  if (e->state == ST_RELAY && end_flush(e) < 0) goto close;
+  if (sess_relay(s) < 0) goto close;
+
+  if (s->done && !queued(&s->mobile) && !queued(&s->server)) goto close;
+
+  end_events(&s->mobile);
+  end_events(&s->server);
+  return;
+
+ close:
+  sess_close(s);
+}
+
+/*
+** The mobile end
+*/
+
+static void on_accept(struct worker_s *w) {
+  struct sess_s *s;
+  int fd;
+
+  while (1) {
+    fd = accept4(w->listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EMFILE || errno == ENFILE) {
+	/* resumed when a session closes */
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->listen_fd, 0);
+	w->accept_paused = 1;
+      }
+      return;
+    }
+
+    s = calloc(1, sizeof(struct sess_s));
+    if (s) s->mobile.ssl = SSL_new(w->ssl_ctx);
+    if (!s || !s->mobile.ssl) {
+      free(s);
+      close(fd);
+      continue;
+    }
+
+    STAT_ADD(w, sessions, 1);
+    s->w = w;
+    s->id = w->st.sessions;
+    s->show = px.sample ? s->id % px.sample == 0 : !px.set_id;
+    s->mobile.s = s->server.s = s;
+    s->mobile.fd = fd;
+    s->server.fd = -1;
+    s->mobile.state = ST_HANDSHAKE;
+    s->mobile.events = EPOLLIN;
+    supl_ulp_init(&s->mobile.in);
+    supl_ulp_init(&s->server.in);
+    SSL_set_fd(s->mobile.ssl, fd);
+    s->ai = px.upstream;
+    STAT_ADD(w, open, 1);
+    sess_touch(s);
+
+    if (end_watch(&s->mobile) < 0) {
+      sess_close(s);
+      continue;
+    }
+
+    if (px.debug & SUPL_DEBUG_DEBUG) {
+      struct sockaddr_storage ss;
+      socklen_t len = sizeof(ss);
+      char buf[INET6_ADDRSTRLEN] = "?";
+
+      if (getpeername(fd, (struct sockaddr *)&ss, &len) == 0) {
+	if (ss.ss_family == AF_INET6) inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&ss)->sin6_addr, buf, sizeof(buf));
+	else inet_ntop(AF_INET, &((struct sockaddr_in *)&ss)->sin_addr, buf, sizeof(buf));
+      }
+      fprintf(stderr, "[%d.%lu] connection from %s\n", w->id, s->id, buf);
+    }
+
+    /* meanwhile the mobile does its handshake */
+    if (server_start(s) < 0) sess_close(s);
+  }
+}
+
+static void expire_idle(struct worker_s *w) {
+  time_t now = time(0);
+
+  while (w->idle_head && now - w->idle_head->active > SESSION_TIMEOUT) {
+    sess_close(w->idle_head);
+  }
+}
+
+static void *worker_main(void *arg) {
+  struct worker_s *w = arg;
+  struct epoll_event events[MAX_EVENTS];
+  int i, n;
+
+  while (!__atomic_load_n(&quit, __ATOMIC_RELAXED)) {
+    n = epoll_wait(w->epfd, events, MAX_EVENTS, 1000);
+
+    if (n < 0 && errno != EINTR) break;
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == 0) on_accept(w);
+      else end_event(events[i].data.ptr, events[i].events);
+    }
+
+    expire_idle(w);
+    free_dead(w);
+  }
+
+  while (w->idle_head) sess_close(w->idle_head);
+  free_dead(w);
+
+  return 0;
+}
+
+/*
+** Setup
+*/
+
+/* every worker binds its own socket to the port, the kernel balances between them */
+static int listen_on(int port) {
+  struct sockaddr_in6 sa6;
+  struct sockaddr_in sa;
+  int fd, on = 1, off = 0;
+
+  /* dual stack if we can, IPv4 only if not */
+  fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd >= 0) {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+    memset(&sa6, 0, sizeof(sa6));
+    sa6.sin6_family = AF_INET6;
+    sa6.sin6_addr = in6addr_any;
+    sa6.sin6_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&sa6, sizeof(sa6)) == 0 && listen(fd, SOMAXCONN) == 0) return fd;
+
+    close(fd);
+  }
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = INADDR_ANY;
+  sa.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0 && listen(fd, SOMAXCONN) == 0) return fd;
+
+  close(fd);
+  return -1;
+}
+
+/* "host", "host:port" or "[address]:port", looked up once */
+static int upstream_resolve(char *server) {
+  struct addrinfo hint;
+  const char *port = SUPL_PORT;
+  char *p;
+  size_t len = strlen(server);
+
+  if (server[0] == '[' && (p = strchr(server, ']'))) {
+    server++;
+    len = p - server;
+    if (p[1] == ':') port = p + 2;
+  } else if ((p = strchr(server, ':')) && !strchr(p + 1, ':')) {
+    /* more than one colon is a bare IPv6 address */
+    len = p - server;
+    port = p + 1;
+  }
+
+  if (len >= sizeof(px.host)) len = sizeof(px.host) - 1;
+  memcpy(px.host, server, len);
+  px.host[len] = 0;
+
+  memset(&hint, 0, sizeof(hint));
+  hint.ai_socktype = SOCK_STREAM;
+
+  return getaddrinfo(px.host, port, &hint, &px.upstream) == 0 ? 0 : E_SUPL_CONNECT;
+}
+
+static SSL_CTX *ssl_setup(char *cert, char *key) {
+  SSL_CTX *ctx;
+
+  supl_init();
+
+  ctx = SSL_CTX_new(SSLv23_server_method());
+  if (!ctx) return 0;
+
+  if (SSL_CTX_use_certificate_file(ctx, cert, SSL_FILETYPE_PEM) <= 0) {
+    fprintf(stderr, "Error: Valid server certificate not found in %s\n", cert);
     return 0;
   }
-  if (SSL_CTX_use_PrivateKey_file(ctx, KEYF, SSL_FILETYPE_PEM) <= 0) {
-    fprintf(stderr, "Error: Valid server private key not found in " CERTF "\n");
+  if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) <= 0) {
+    fprintf(stderr, "Error: Valid server private key not found in %s\n", key);
     return 0;
   }
-
   if (!SSL_CTX_check_private_key(ctx)) {
     fprintf(stderr, "Error: Private key does not match the certificate public key\n");
     return 0;
   }
 
-  /* ----------------------------------------------- */
-  /* Prepare TCP socket for receiving connections */
-
-  listen_sd = socket(AF_INET, SOCK_STREAM, 0);
-  if (listen_sd == -1) return 0;
-  
-  memset(&sa_serv, '\0', sizeof(sa_serv));
-  sa_serv.sin_family      = AF_INET;
-  sa_serv.sin_addr.s_addr = INADDR_ANY;
-  sa_serv.sin_port        = htons(port);          /* Server Port number */
-  
-  err = bind(listen_sd, (struct sockaddr*) &sa_serv, sizeof (sa_serv));
-  if (err == -1) {
-    fprintf(stderr, "Error: Could not bind to port %d (%s)\n", port, strerror(errno));
-    return 0;
+  /* idle sessions should not pin their SSL buffers, there may be thousands */
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+		   SSL_MODE_RELEASE_BUFFERS);
+
+  /* a ticket from one worker is good with all, the session cache is per worker */
+  SSL_CTX_set_tlsext_ticket_keys(ctx, px.ticket_keys, sizeof(px.ticket_keys));
+
+  return ctx;
+}
+
+static int worker_setup(struct worker_s *w, int port, char *cert, char *key) {
+  struct epoll_event ev;
+
+  w->listen_fd = w->epfd = -1;
+
+  if (px.debug & (SUPL_DEBUG_SUPL | SUPL_DEBUG_RRLP)) {
+    w->log.buf = malloc(LOG_RING);
+    if (!w->log.buf) return E_SUPL_INTERNAL;
   }
-	     
-  err = listen(listen_sd, 5);
-  if (err == -1) {
-    fprintf(stderr, "Error: listen() (%s)\n", strerror(errno));
-    return 0;
+
+  w->ssl_ctx = ssl_setup(cert, key);
+  if (!w->ssl_ctx) return E_SUPL_INTERNAL;
+
+  w->client_ctx = SSL_CTX_new(SSLv23_client_method());
+  if (!w->client_ctx) return E_SUPL_INTERNAL;
+  SSL_CTX_set_mode(w->client_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+		   SSL_MODE_RELEASE_BUFFERS);
+
+  w->listen_fd = listen_on(port);
+  if (w->listen_fd < 0) {
+    fprintf(stderr, "Error: Could not listen on port %d (%s)\n", port, strerror(errno));
+    return E_SUPL_CONNECT;
   }
 
-  client_len = sizeof(sa_cli);
-  sd = accept(listen_sd, (struct sockaddr*)&sa_cli, &client_len);
-  if (sd == -1) {
-    fprintf(stderr, "Error: accept() (%s)\n", strerror(errno));
-    return 0;
+  w->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (w->epfd < 0) return E_SUPL_INTERNAL;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = 0;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listen_fd, &ev) < 0) return E_SUPL_INTERNAL;
+
+  return 0;
+}
+
+static void worker_free(struct worker_s *w) {
+  free(w->log.buf);
+  if (w->session) SSL_SESSION_free(w->session);
+  if (w->client_ctx) SSL_CTX_free(w->client_ctx);
+  if (w->ssl_ctx) SSL_CTX_free(w->ssl_ctx);
+  if (w->listen_fd >= 0) close(w->listen_fd);
+  if (w->epfd >= 0) close(w->epfd);
+}
+
+// one worker per core we may run on, in order
+static int worker_cpus(int *cpu, int max) {
+  cpu_set_t set;
+  int i, n = 0;
+
+  if (sched_getaffinity(0, sizeof(set), &set) < 0) return 0;
+
+  for (i = 0; i < CPU_SETSIZE && n < max; i++) {
+    if (CPU_ISSET(i, &set)) cpu[n++] = i;
   }
-  close(listen_sd);
 
-  {
-    char buffer[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &sa_cli.sin_addr.s_addr, buffer, sizeof(buffer));
-    fprintf(stderr, "Connection from %s:%d\n", buffer, ntohs(sa_cli.sin_port));
+  return n;
+}
+
+static int worker_start(struct worker_s *w) {
+  pthread_attr_t attr;
+  cpu_set_t set;
+  int err;
+
+  pthread_attr_init(&attr);
+  if (w->cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
   }
-  
-  /* ----------------------------------------------- */
-  /* TCP connection is ready. Do server side SSL. */
 
-  ssl = SSL_new(ctx);
-  SSL_set_fd(ssl, sd);
-  err = SSL_accept(ssl);
-  if (err != 1) {
-    ssl_error(ssl, err);
-    return 0;
+  err = pthread_create(&w->thread, &attr, worker_main, w);
+  pthread_attr_destroy(&attr);
+
+  return err ? E_SUPL_INTERNAL : 0;
+}
+
+/* the counters of all workers added up, they keep running meanwhile */
+static void stats_sum(struct stats_s *sum) {
+  unsigned long *to = (unsigned long *)sum;
+  size_t i, n = sizeof(struct stats_s) / sizeof(unsigned long);
+  int k;
+
+  memset(sum, 0, sizeof(struct stats_s));
+
+  for (k = 0; k < px.workers; k++) {
+    unsigned long *from = (unsigned long *)&px.worker[k].st;
+
+    for (i = 0; i < n; i++) to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
   }
+}
 
-  printf ("SSL connection using %s\n", SSL_get_cipher (ssl));
-  
-  /* Get client's certificate */
-
-  client_cert = SSL_get_peer_certificate (ssl);
-  if (client_cert != NULL) {
-    printf ("Client certificate:\n");
-    
-    str = X509_NAME_oneline (X509_get_subject_name (client_cert), 0, 0);
-    if (!str) return 0;
-    printf ("\t subject: %s\n", str);
-    OPENSSL_free (str);
-    
-    str = X509_NAME_oneline (X509_get_issuer_name  (client_cert), 0, 0);
-    if (!str) return 0;
-    printf ("\t issuer: %s\n", str);
-    OPENSSL_free (str);
-    
-    /* We could do all sorts of certificate verification stuff here before
-       deallocating the certificate. */
-    
-    X509_free (client_cert);
-  } else {
-    printf ("Client does not have certificate.\n");
-  }
-
-  client_ctx->ssl = ssl;
-  client_ctx->ssl_ctx = ctx;
-
-  return 1;
-}
-
-int main(int argc, char *argv[])
-{
-  supl_ctx_t server_ctx;
-  supl_ctx_t client_ctx;
-
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s supl-server\n", argv[0]);
-    exit(1);
+static void stats_print(struct stats_s *st) {
+  fprintf(stderr, "sessions %lu open %lu failed %lu (connect %lu handshake %lu), server handshakes %lu resumed %lu\n",
+	  st->sessions, st->open, st->failures, st->connect_failures, st->handshake_failures,
+	  st->full + st->resumed, st->resumed);
+  fprintf(stderr, "mobile => server %lu PDUs %lu bytes, server => mobile %lu PDUs %lu bytes\n",
+	  st->pdus[0], st->bytes[0], st->pdus[1], st->bytes[1]);
+  fprintf(stderr, "reading paused for a full buffer, mobile %lu server %lu\n", st->throttled[0], st->throttled[1]);
+  fprintf(stderr, "messages init %lu start %lu response %lu posinit %lu pos %lu end %lu unknown %lu\n",
+	  st->messages[UlpMessage_PR_msSUPLINIT], st->messages[UlpMessage_PR_msSUPLSTART],
+	  st->messages[UlpMessage_PR_msSUPLRESPONSE], st->messages[UlpMessage_PR_msSUPLPOSINIT],
+	  st->messages[UlpMessage_PR_msSUPLPOS], st->messages[UlpMessage_PR_msSUPLEND],
+	  st->messages[UlpMessage_PR_NOTHING] + st->messages[UlpMessage_PR_msDUMMY2] +
+	  st->messages[UlpMessage_PR_msDUMMY3]);
+  if (px.debug & (SUPL_DEBUG_SUPL | SUPL_DEBUG_RRLP)) fprintf(stderr, "PDUs not shown, display too slow %lu\n", st->log_drops);
+}
+
+static void raise_fd_limit(void) {
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    (void)setrlimit(RLIMIT_NOFILE, &rl);
   }
+}
 
-  supl_set_debug(stderr, SUPL_DEBUG_DEBUG | SUPL_DEBUG_SUPL);
+static void usage(char *progname) {
+  fprintf(stderr,
+	  "Usage:\n"
+	  "%s [options] supl-server\n"
+	  "Options:\n"
+	  "  --port n		listen on port n, default " SUPL_PORT "\n"
+	  "  --cert file		server certificate, default " CERTF "\n"
+	  "  --key file		server private key, default " KEYF "\n"
+	  "  --workers n		threads, default one per core\n"
+	  "  --stats n		print statistics every n seconds\n"
+	  "  --pass-through	relay messages without decoding them\n"
+	  "  --sample n		show one session in n\n"
+	  "  --imsi digits		show the sessions of this SET, IMSI or MSISDN\n"
+	  "  --message type,..	show only these, init start response posinit pos end\n"
+	  "  --debug n		show traffic, 1 == RRLP, 2 == SUPL, 4 == DEBUG\n"
+	  "  --help		show this help\n",
+	  progname);
+}
 
-  supl_ctx_new(&server_ctx);
-  supl_ctx_new(&client_ctx);
+/* digits as BCD, two a byte, the first in the low nibble, padded with 0xf */
+static int parse_set_id(char *digits, unsigned char *id) {
+  int i, n = strlen(digits);
 
-  /* get a client */
+  if (n < 1 || n > 16) return -1;
 
-  if (!ssl_accept(7275, &client_ctx)) {
-    return 42;
+  memset(id, 0xff, 8);
+  for (i = 0; i < n; i++) {
+    if (digits[i] < '0' || digits[i] > '9') return -1;
+    if (i & 1) id[i / 2] = (id[i / 2] & 0x0f) | (digits[i] - '0') << 4;
+    else id[i / 2] = (id[i / 2] & 0xf0) | (digits[i] - '0');
   }
 
-  /* connect to the server */
+  return 0;
+}
 
-  if (supl_server_connect(&server_ctx, argv[1]) < 0) {
-    fprintf(stderr, "Error: Could not connect to server\n");
-    return E_SUPL_CONNECT;
+static int parse_messages(char *list) {
+  static const struct {
+    char *name;
+    int message;
+  } names[] = {
+    { "init", UlpMessage_PR_msSUPLINIT },
+    { "start", UlpMessage_PR_msSUPLSTART },
+    { "response", UlpMessage_PR_msSUPLRESPONSE },
+    { "posinit", UlpMessage_PR_msSUPLPOSINIT },
+    { "pos", UlpMessage_PR_msSUPLPOS },
+    { "end", UlpMessage_PR_msSUPLEND },
+  };
+  char *copy = strdup(list), *name, *save = 0;
+  size_t i;
+  int mask = 0;
+
+  if (!copy) return -1;
+
+  for (name = strtok_r(copy, ",", &save); name; name = strtok_r(0, ",", &save)) {
+    for (i = 0; i < sizeof(names) / sizeof(names[0]) && strcmp(names[i].name, name); i++);
+    if (i == sizeof(names) / sizeof(names[0])) {
+      free(copy);
+      return -1;
+    }
+    mask |= 1 << names[i].message;
   }
 
-  /* DATA EXCHANGE - Receive message and send reply. */
+  free(copy);
+  return mask;
+}
 
-  while (1) {
-    supl_ulp_t pdu;
-    PDU_t *rrlp;
+static struct option long_opts[] = {
+  { "port", 1, 0, 0 },
+  { "cert", 1, 0, 0 },
+  { "key", 1, 0, 0 },
+  { "workers", 1, 0, 0 },
+  { "stats", 1, 0, 0 },
+  { "pass-through", 0, 0, 0 },
+  { "sample", 1, 0, 0 },
+  { "imsi", 1, 0, 0 },
+  { "message", 1, 0, 0 },
+  { "debug", 1, 0, 'd' },
+  { "help", 0, 0, 'h' },
+  { 0, 0, 0, 0 }
+};
 
-    /* read from mobile */
+int main(int argc, char *argv[]) {
+  struct stats_s st;
+  char *cert = CERTF, *key = KEYF;
+  int port = atoi(SUPL_PORT);
+  int stats_every = 0;
+  int *cpu, ncpu;
+  time_t last;
+  int i, c, opt_index;
 
-    if (supl_ulp_recv(&client_ctx, &pdu) < 0) {
-      return -42;
+  while ((c = getopt_long(argc, argv, "d:h", long_opts, &opt_index)) != -1) {
+    switch (c) {
+    case 0:
+      switch (opt_index) {
+      case 0: port = atoi(optarg); break;
+      case 1: cert = optarg; break;
+      case 2: key = optarg; break;
+      case 3: px.workers = atoi(optarg); break;
+      case 4: stats_every = atoi(optarg); break;
+      case 5: px.pass_through = 1; break;
+      case 6: px.sample = atoi(optarg); break;
+      case 7:
+	if (parse_set_id(optarg, px.id) < 0) {
+	  fprintf(stderr, "Error: %s is not an IMSI\n", optarg);
+	  exit(1);
+	}
+	px.set_id = 1;
+	break;
+      case 8:
+	if ((px.messages = parse_messages(optarg)) < 0) {
+	  fprintf(stderr, "Error: unknown message in %s\n", optarg);
+	  exit(1);
+	}
+	break;
+      }
+      break;
+    case 'd':
+      px.debug = atoi(optarg);
+      break;
+    case 'h':
+    default:
+      usage(argv[0]);
+      exit(1);
     }
-    
-    fprintf(stdout, "mobile => server\n");
-    xer_fprint(stdout, &asn_DEF_ULP_PDU, pdu.pdu);
-    fprintf(stdout, "\n");
-    
-    /* write to server */
-    
-    (void)supl_ulp_send(&server_ctx, &pdu);
+  }
 
-    if (pdu.pdu->message.present == UlpMessage_PR_msSUPLEND) 
-      break;
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    exit(1);
+  }
 
-    supl_ulp_free(&pdu);
+  if (px.debug) supl_set_debug(stderr, px.debug);
 
-    /* get answer from server */
+  if (upstream_resolve(argv[optind]) < 0) {
+    fprintf(stderr, "Error: Could not resolve %s\n", argv[optind]);
+    exit(1);
+  }
 
-    if (supl_ulp_recv(&server_ctx, &pdu) < 0) {
-      return -44;
-    }
+  cpu = calloc(CPU_SETSIZE, sizeof(int));
+  if (!cpu) exit(1);
+  ncpu = worker_cpus(cpu, CPU_SETSIZE);
+  if (px.workers < 1) px.workers = ncpu > 0 ? ncpu : 1;
 
-    fprintf(stdout, "server => mobile\n");
-    xer_fprint(stdout, &asn_DEF_ULP_PDU, pdu.pdu);
-    fprintf(stdout, "\n");
+  supl_init();
+  if (RAND_bytes(px.ticket_keys, sizeof(px.ticket_keys)) != 1) exit(1);
 
-    if (pdu.pdu->message.present == UlpMessage_PR_msSUPLPOS) {
-      if (supl_decode_rrlp(&pdu, &rrlp) < 0) {
-	supl_ulp_free(&pdu);
-	return E_SUPL_DECODE_RRLP;
-      }
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  raise_fd_limit();
+
+  /* the counters have cache lines of their own */
+  if (posix_memalign((void **)&px.worker, 64, px.workers * sizeof(struct worker_s)) != 0) exit(1);
+  memset(px.worker, 0, px.workers * sizeof(struct worker_s));
+
+  for (i = 0; i < px.workers; i++) {
+    struct worker_s *w = &px.worker[i];
+
+    w->id = i;
+    w->cpu = ncpu > 0 ? cpu[i % ncpu] : -1;
+    if (worker_setup(w, port, cert, key) < 0) exit(1);
+  }
+  free(cpu);
+
+  if ((px.debug & (SUPL_DEBUG_SUPL | SUPL_DEBUG_RRLP)) && pthread_create(&px.writer, 0, writer_main, 0) != 0) {
+    fprintf(stderr, "Error: Could not start the display\n");
+    exit(1);
+  }
 
-      fprintf(stdout, "=== Embedded RRLP message ===\n");
-      xer_fprint(stdout, &asn_DEF_PDU, rrlp);
-      fprintf(stdout, "\n");
+  for (i = 0; i < px.workers; i++) {
+    if (worker_start(&px.worker[i]) < 0) {
+      fprintf(stderr, "Error: Could not start worker %d\n", i);
+      exit(1);
     }
+  }
 
-    /* and hand over to client */
-    (void)supl_ulp_send(&client_ctx, &pdu);
+  last = time(0);
+  while (!quit) {
+    sleep(1);
 
-    supl_ulp_free(&pdu);
+    if (stats_every > 0 && time(0) - last >= stats_every) {
+      last = time(0);
+      stats_sum(&st);
+      stats_print(&st);
+    }
   }
 
-  supl_close(&server_ctx);
-  supl_close(&client_ctx);
+  for (i = 0; i < px.workers; i++) {
+    pthread_join(px.worker[i].thread, 0);
+  }
+
+  /* what is still in the rings is shown first */
+  if (px.debug & (SUPL_DEBUG_SUPL | SUPL_DEBUG_RRLP)) {
+    __atomic_store_n(&px.writer_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(px.writer, 0);
+  }
 
-  supl_ctx_free(&server_ctx);
-  supl_ctx_free(&client_ctx);
+  stats_sum(&st);
+  stats_print(&st);
+
+  for (i = 0; i < px.workers; i++) {
+    worker_free(&px.worker[i]);
+  }
+  free(px.worker);
+  freeaddrinfo(px.upstream);
 
   return 0;
 }
@@ -0,0 +1,333 @@
+/*
+** SUPL library - racing several SUPL servers
+**
+** Copyright (c) 2007 Tatu Mannisto <tatu a-t tajuma d-o-t com>
+** All rights reserved.
+** Redistribution and modifications are permitted subject to BSD license.
+**
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "supl.h"
+
+struct race_run_s;
+
+struct racer_s {
+  struct race_run_s *run;
+  int server;
+  char *name;   /* of the server, the race may be gone before we are */
+  int started;
+  int finished;
+  pthread_t thread;
+  supl_ctx_t ctx;
+  supl_assist_t assist;
+  struct timeval start;
+  int err;
+};
+
+/*
+** A run is shared by the caller and its racers and freed by whoever
+** leaves it last, the caller returns with the winner without waiting
+** for the cancelled losers to hang up.
+*/
+
+struct race_run_s {
+  supl_race_t *race;   /* 0 once the caller has returned */
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int cancel[2];
+  int refs;
+  int running;
+  int failed;
+  int winner;
+  supl_stats_t stats;  /* of the racers finished so far */
+  struct racer_s *racer;
+  int n;
+};
+
+static void run_free(struct race_run_s *run) {
+  int i;
+
+  for (i = 0; i < run->n; i++) {
+    free(run->racer[i].name);
+  }
+  close(run->cancel[0]);
+  close(run->cancel[1]);
+  pthread_cond_destroy(&run->done);
+  pthread_mutex_destroy(&run->lock);
+  free(run->racer);
+  free(run);
+}
+
+static void run_leave(struct race_run_s *run) {
+  int last;
+
+  pthread_mutex_lock(&run->lock);
+  last = --run->refs == 0;
+  pthread_mutex_unlock(&run->lock);
+
+  if (last) run_free(run);
+}
+
+static double elapsed_ms(struct timeval *start) {
+  struct timeval now;
+
+  gettimeofday(&now, 0);
+
+  return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+static void *racer_main(void *arg) {
+  struct racer_s *r = arg;
+  struct race_run_s *run = r->run;
+  supl_race_stat_t *stat;
+  double ms;
+  int err;
+
+  err = supl_get_assist(&r->ctx, r->name, &r->assist);
+  ms = elapsed_ms(&r->start);
+  supl_ctx_free(&r->ctx);
+
+  pthread_mutex_lock(&run->lock);
+
+  r->err = err;
+  r->finished = 1;
+  run->running--;
+
+  /* too late, the caller has counted us as cancelled */
+  if (!run->race) {
+    pthread_mutex_unlock(&run->lock);
+    run_leave(run);
+    return 0;
+  }
+
+  run->stats.sent += r->ctx.stats.sent;
+  run->stats.recv += r->ctx.stats.recv;
+  run->stats.out_msg += r->ctx.stats.out_msg;
+  run->stats.in_msg += r->ctx.stats.in_msg;
+
+  stat = &run->race->stat[r->server];
+  pthread_mutex_lock(&run->race->lock);
+  if (err == 0) {
+    stat->completed++;
+    stat->last_ms = ms;
+    stat->total_ms += ms;
+    if (run->winner < 0) {
+      run->winner = r - run->racer;
+      stat->wins++;
+    }
+  } else if (err == E_SUPL_CANCELLED) {
+    stat->cancels++;
+  } else {
+    stat->failures++;
+    run->failed++;
+  }
+  pthread_mutex_unlock(&run->race->lock);
+
+  pthread_cond_signal(&run->done);
+  pthread_mutex_unlock(&run->lock);
+
+  run_leave(run);
+
+  return 0;
+}
+
+// called with run->lock held
+static int racer_start(struct race_run_s *run, supl_ctx_t *ctx, int i) {
+  struct racer_s *r = &run->racer[i];
+
+  r->run = run;
+  r->server = i;
+  r->name = strdup(run->race->stat[i].server);
+  if (!r->name) {
+    run->failed++;
+    return E_SUPL_INTERNAL;
+  }
+
+  supl_ctx_new(&r->ctx);
+  r->ctx.p = ctx->p;
+  r->ctx.debug = ctx->debug;
+  r->ctx.timeout = ctx->timeout;
+  supl_set_cancel_fd(&r->ctx, run->cancel[0]);
+
+  gettimeofday(&r->start, 0);
+
+  if (pthread_create(&r->thread, 0, racer_main, r) != 0) {
+    supl_ctx_free(&r->ctx);
+    run->failed++;
+    return E_SUPL_INTERNAL;
+  }
+
+  r->started = 1;
+  run->running++;
+  run->refs++;
+
+  pthread_mutex_lock(&run->race->lock);
+  run->race->stat[i].starts++;
+  pthread_mutex_unlock(&run->race->lock);
+
+  return 0;
+}
+
+int EXPORT supl_race_new(supl_race_t *race, char **servers, int n) {
+  int i;
+
+  memset(race, 0, sizeof(supl_race_t));
+
+  race->stat = calloc(n, sizeof(supl_race_stat_t));
+  if (!race->stat) return E_SUPL_INTERNAL;
+
+  for (i = 0; i < n; i++) {
+    race->stat[i].server = strdup(servers[i]);
+  }
+
+  race->n = n;
+  race->concurrency = 1;
+  race->hedge_ms = 0;
+  pthread_mutex_init(&race->lock, 0);
+
+  return 0;
+}
+
+void EXPORT supl_race_free(supl_race_t *race) {
+  int i;
+
+  for (i = 0; i < race->n; i++) {
+    free(race->stat[i].server);
+  }
+  free(race->stat);
+  pthread_mutex_destroy(&race->lock);
+
+  memset(race, 0, sizeof(supl_race_t));
+}
+
+void EXPORT supl_race_set(supl_race_t *race, int concurrency, int hedge_ms) {
+  race->concurrency = concurrency > 0 ? concurrency : 1;
+  race->hedge_ms = hedge_ms > 0 ? hedge_ms : 0;
+}
+
+int EXPORT supl_race_get_stat(supl_race_t *race, int i, supl_race_stat_t *stat) {
+  if (i < 0 || i >= race->n) return E_SUPL_INTERNAL;
+
+  pthread_mutex_lock(&race->lock);
+  *stat = race->stat[i];
+  pthread_mutex_unlock(&race->lock);
+
+  return 0;
+}
+
+/*
+** Start race->concurrency sessions right away, then one more server every
+** race->hedge_ms milliseconds (if set) or whenever a running session fails.
+** The first complete assistance set wins. The rest are cancelled, they
+** send SUPLEND and shut TLS down if that does not block, after we have
+** returned; their traffic is not added to the stats of ctx.
+*/
+
+int EXPORT supl_get_assist_race(supl_ctx_t *ctx, supl_race_t *race, supl_assist_t *assist) {
+  struct race_run_s *run;
+  struct timeval last;
+  int next, i, err;
+
+  if (race->n <= 0) return E_SUPL_CONNECT;
+
+  run = calloc(1, sizeof(struct race_run_s));
+  if (!run) return E_SUPL_INTERNAL;
+  run->race = race;
+  run->winner = -1;
+  run->refs = 1;
+  run->n = race->n;
+  run->racer = calloc(race->n, sizeof(struct racer_s));
+  if (!run->racer) {
+    free(run);
+    return E_SUPL_INTERNAL;
+  }
+
+  if (pipe(run->cancel) < 0) {
+    free(run->racer);
+    free(run);
+    return E_SUPL_INTERNAL;
+  }
+
+  pthread_mutex_init(&run->lock, 0);
+  pthread_cond_init(&run->done, 0);
+
+  pthread_mutex_lock(&run->lock);
+
+  for (next = 0; next < race->n && next < race->concurrency; next++) {
+    racer_start(run, ctx, next);
+  }
+  gettimeofday(&last, 0);
+
+  while (run->winner < 0 && (run->running > 0 || next < race->n)) {
+    if (next < race->n && run->running == 0) {
+      /* everybody failed so far, fail over right away */
+      racer_start(run, ctx, next++);
+      gettimeofday(&last, 0);
+      continue;
+    }
+
+    if (next < race->n && race->hedge_ms > 0) {
+      struct timespec deadline;
+      long usec;
+
+      usec = last.tv_usec + (race->hedge_ms % 1000) * 1000;
+      deadline.tv_sec = last.tv_sec + race->hedge_ms / 1000 + usec / 1000000;
+      deadline.tv_nsec = (usec % 1000000) * 1000;
+
+      if (pthread_cond_timedwait(&run->done, &run->lock, &deadline) == ETIMEDOUT && run->winner < 0) {
+	racer_start(run, ctx, next++);
+	gettimeofday(&last, 0);
+      }
+      continue;
+    }
+
+    pthread_cond_wait(&run->done, &run->lock);
+  }
+
+  /* cancel the losers and leave them to it */
+
+  if (run->running > 0) {
+    (void)write(run->cancel[1], "x", 1);
+  }
+
+  err = E_SUPL_CONNECT;
+  pthread_mutex_lock(&race->lock);
+  for (i = 0; i < race->n; i++) {
+    struct racer_s *r = &run->racer[i];
+
+    if (!r->started) continue;
+
+    /* nobody waits for racers, the last one out frees the run */
+    pthread_detach(r->thread);
+
+    if (!r->finished) race->stat[i].cancels++;
+    else if (r->err < 0 && r->err != E_SUPL_CANCELLED) err = r->err;
+  }
+  pthread_mutex_unlock(&race->lock);
+
+  __atomic_fetch_add(&ctx->stats.sent, run->stats.sent, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ctx->stats.recv, run->stats.recv, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ctx->stats.out_msg, run->stats.out_msg, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ctx->stats.in_msg, run->stats.in_msg, __ATOMIC_RELAXED);
+
+  race->winner = run->winner;
+  if (run->winner >= 0) {
+    memcpy(assist, &run->racer[run->winner].assist, sizeof(supl_assist_t));
+    err = 0;
+  }
+
+  run->race = 0;
+  pthread_mutex_unlock(&run->lock);
+  run_leave(run);
+
+  return err;
+}
@@ -0,0 +1,1370 @@
+/*
+** SUPL Server - a local SLP serving assistance data from a cache
+**
+** Copyright (c) 2007 Tatu Mannisto <tatu a-t tajuma d-o-t com>
+** All rights reserved.
+** Redistribution and modifications are permitted subject to BSD license.
+**
+*/
+
+#define _GNU_SOURCE /* accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/err.h>
+
+#include "supl.h"
+#include "XNavigationModel.h"
+#include "SatelliteInfoElement.h"
+
+/* Make these what you want for cert & key files */
+#define CERTF "srv-cert.pem"
+#define KEYF  "srv-priv.pem"
+
+#define SESSION_TIMEOUT 30 /* seconds without progress */
+#define FETCH_TIMEOUT 10   /* seconds a SET waits for a cache miss, queue included */
+#define MAX_EVENTS 256
+
+#define GPS_EPOCH 315964800 /* Jan 6 1980 as Unix time */
+#define GPS_LEAP_SECONDS 18 /* when the UTC model does not tell */
+
+#define DEFAULT_PARTS (SUPL_RRLP_ASSIST_REFTIME | SUPL_RRLP_ASSIST_REFLOC | SUPL_RRLP_ASSIST_IONO | \
+		       SUPL_RRLP_ASSIST_UTC | SUPL_RRLP_ASSIST_EPHEMERIS)
+
+/*
+** Every connection is a small state machine driven by one epoll loop.
+** Sockets are non-blocking, so an SSL call which can not finish tells
+** which way it waits and is simply called again when the socket is ready.
+** Cache misses are handed to fetcher threads, as a session with the
+** upstream SLP would block the loop.
+*/
+
+enum {
+  ST_HANDSHAKE, /* SSL_accept() */
+  ST_START,     /* waiting for SUPLSTART */
+  ST_POSINIT,   /* waiting for SUPLPOSINIT */
+  ST_FETCH,     /* a fetcher thread is getting the data */
+  ST_POS,       /* waiting for the RRLP ack of a segment */
+  ST_LAST,      /* last segment sent, waiting for its ack */
+  ST_DONE       /* close when the output is flushed */
+};
+
+struct conn_s {
+  int fd;
+  SSL *ssl;
+  int state;
+  int events;   /* registered with epoll */
+  int ssl_want; /* EPOLLOUT if the last SSL call wants to write */
+  int closing;  /* closed while a fetch was running */
+  time_t active;
+  struct conn_s *prev, *next; /* by last activity, oldest first */
+  struct conn_s *queue;       /* fetch queue */
+
+  supl_ulp_t in; /* in.size is the number of bytes read so far */
+  unsigned char *out;
+  size_t out_len, out_off, out_alloc;
+
+  void *session_id; /* SessionID of our messages, uPER encoded */
+  size_t session_id_size;
+  unsigned char set_id[16]; /* IMSI or MSISDN of the SET, for the predictor */
+  size_t set_id_len;
+
+  supl_param_t p; /* cell of the SET and ephemerides it has */
+  int parts;      /* SUPL_RRLP_ASSIST_* asked for */
+  int fetch_err;
+  int from_file;  /* assist holds the --file data */
+  supl_assist_t assist;
+  supl_segment_t seg[SUPL_SEGMENTS_MAX];
+  supl_payload_t *pay; /* shared encoding of seg[], 0 to encode here */
+  int segs, sent;
+  int ref; /* RRLP reference number */
+};
+
+static struct server_s {
+  SSL_CTX *ssl_ctx;
+  int epfd;
+  int listen_fd;
+  int accept_paused; /* out of file descriptors */
+  int wake[2];       /* fetchers hand finished connections back here */
+  int cancel[2];     /* written on exit, ends the upstream sessions */
+  int debug;
+
+  supl_cache_t cache;
+  char *upstream;
+  int have_celldb;
+  supl_celldb_t celldb; /* positions of the cells, for the grid squares */
+  int have_file;
+  supl_snaps_t file;     /* --file data, reread on SIGHUP */
+  int file_slot;         /* reader slot of the event loop */
+  int prefetch;          /* cells to fetch ahead per SET, 0 == off */
+  supl_predict_t predict;
+
+  struct conn_s *idle_head, *idle_tail;
+  supl_ulp_t frame;
+  supl_rrlp_t rrlp;
+  supl_payloads_t pays;
+  size_t segment_size;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct conn_s *queue_head, *queue_tail;
+  int stop;
+  int fetchers;
+  pthread_t *fetcher;
+
+  unsigned long conns, sessions, served, segments, fetches, fetch_failures, failures;
+  unsigned int seed;
+} srv;
+
+static volatile sig_atomic_t quit, reload;
+
+static void on_signal(int sig) {
+  quit = 1;
+}
+
+static void on_hup(int sig) {
+  reload = 1;
+}
+
+/*
+** Assistance data in the format supl-client prints by default
+*/
+
+static int read_longs(char *s, long *v, int max) {
+  char *end;
+  int n;
+
+  for (n = 0; n < max; n++) {
+    v[n] = strtol(s, &end, 10);
+    if (end == s) break;
+    s = end;
+  }
+
+  return n;
+}
+
+static int assist_read(char *file, supl_assist_t *a) {
+  FILE *fp;
+  char line[512];
+  long v[32];
+
+  fp = fopen(file, "r");
+  if (!fp) return E_SUPL_READ;
+
+  memset(a, 0, sizeof(supl_assist_t));
+
+  while (fgets(line, sizeof(line), fp)) {
+    switch (line[0]) {
+    case 'T':
+      if (read_longs(line + 1, v, 4) < 2) break;
+      a->set |= SUPL_RRLP_ASSIST_REFTIME;
+      a->time.gps_week = v[0];
+      a->time.gps_tow = v[1];
+      break;
+
+    case 'U':
+      if (read_longs(line + 1, v, 8) < 8) break;
+      a->set |= SUPL_RRLP_ASSIST_UTC;
+      a->utc.a0 = v[0];
+      a->utc.a1 = v[1];
+      a->utc.delta_tls = v[2];
+      a->utc.tot = v[3];
+      a->utc.wnt = v[4];
+      a->utc.wnlsf = v[5];
+      a->utc.dn = v[6];
+      a->utc.delta_tlsf = v[7];
+      break;
+
+    case 'L':
+      if (sscanf(line + 1, "%lf %lf %d", &a->pos.lat, &a->pos.lon, &a->pos.uncertainty) != 3) break;
+      a->set |= SUPL_RRLP_ASSIST_REFLOC;
+      break;
+
+    case 'I':
+      if (read_longs(line + 1, v, 7) < 7) break;
+      a->set |= SUPL_RRLP_ASSIST_IONO;
+      a->iono.a0 = v[0];
+      a->iono.a1 = v[1];
+      a->iono.a2 = v[2];
+      a->iono.b0 = v[3];
+      a->iono.b1 = v[4];
+      a->iono.b2 = v[5];
+      a->iono.b3 = v[6];
+      break;
+
+    case 'e': {
+      struct supl_ephemeris_s *e;
+
+      if (read_longs(line + 1, v, 27) < 27 || a->cnt_eph >= MAX_EPHEMERIS) break;
+      a->set |= SUPL_RRLP_ASSIST_EPHEMERIS;
+      e = &a->eph[a->cnt_eph++];
+      e->prn = v[0];
+      e->delta_n = v[1];
+      e->M0 = v[2];
+      e->A_sqrt = v[3];
+      e->OMEGA_0 = v[4];
+      e->i0 = v[5];
+      e->w = v[6];
+      e->OMEGA_dot = v[7];
+      e->i_dot = v[8];
+      e->e = v[9];
+      e->Cuc = v[10];
+      e->Cus = v[11];
+      e->Crc = v[12];
+      e->Crs = v[13];
+      e->Cic = v[14];
+      e->Cis = v[15];
+      e->toe = v[16];
+      e->IODC = v[17];
+      e->toc = v[18];
+      e->AF0 = v[19];
+      e->AF1 = v[20];
+      e->AF2 = v[21];
+      e->nav_model = 1;
+      e->bits = v[22];
+      e->ura = v[23];
+      e->health = v[24];
+      e->tgd = v[25];
+      e->AODA = v[26];
+      break;
+    }
+
+    case 'a': {
+      struct supl_almanac_s *al;
+
+      if (read_longs(line + 1, v, 11) < 11 || a->cnt_alm >= MAX_EPHEMERIS) break;
+      a->set |= SUPL_RRLP_ASSIST_ALMANAC;
+      al = &a->alm[a->cnt_alm++];
+      al->prn = v[0];
+      al->e = v[1];
+      al->toa = v[2];
+      al->Ksii = v[3];
+      al->OMEGA_dot = v[4];
+      al->A_sqrt = v[5];
+      al->OMEGA_0 = v[6];
+      al->w = v[7];
+      al->M0 = v[8];
+      al->AF0 = v[9];
+      al->AF1 = v[10];
+      break;
+    }
+
+    case 'Q':
+      if (read_longs(line + 1, v, 2) < 2) break;
+      a->acq_time = v[1];
+      break;
+
+    case 'q': {
+      struct supl_acquis_s *q;
+
+      if (read_longs(line + 1, v, 11) < 11 || a->cnt_acq >= MAX_EPHEMERIS) break;
+      a->set |= SUPL_RRLP_ASSIST_ACQUIS;
+      q = &a->acq[a->cnt_acq++];
+      q->prn = v[0];
+      q->parts = v[1];
+      q->doppler0 = v[2];
+      q->doppler1 = v[3];
+      q->d_win = v[4];
+      q->code_ph = v[5];
+      q->code_ph_int = v[6];
+      q->bit_num = v[7];
+      q->code_ph_win = v[8];
+      q->az = v[9];
+      q->el = v[10];
+      break;
+    }
+    }
+  }
+
+  fclose(fp);
+
+  return a->set ? 0 : E_SUPL_DECODE;
+}
+
+/* reference time from our own clock, like a real SLP */
+static void gps_clock(supl_assist_t *a) {
+  struct timeval now;
+  long long ms;
+  int leap = GPS_LEAP_SECONDS;
+
+  if (a->set & SUPL_RRLP_ASSIST_UTC) leap = a->utc.delta_tls;
+
+  gettimeofday(&now, 0);
+  ms = (long long)(now.tv_sec - GPS_EPOCH + leap) * 1000 + now.tv_usec / 1000;
+
+  a->set |= SUPL_RRLP_ASSIST_REFTIME;
+  a->time.gps_week = ms / (604800 * 1000LL) % 1024;
+  a->time.gps_tow = ms % (604800 * 1000LL) / 80;
+  a->time.stamp = now;
+}
+
+/*
+** Connections
+*/
+
+static void idle_unlink(struct conn_s *c) {
+  if (c->prev) c->prev->next = c->next;
+  else if (srv.idle_head == c) srv.idle_head = c->next;
+  if (c->next) c->next->prev = c->prev;
+  else if (srv.idle_tail == c) srv.idle_tail = c->prev;
+
+  c->prev = c->next = 0;
+}
+
+static void conn_touch(struct conn_s *c) {
+  idle_unlink(c);
+
+  c->active = time(0);
+  c->prev = srv.idle_tail;
+  if (srv.idle_tail) srv.idle_tail->next = c;
+  else srv.idle_head = c;
+  srv.idle_tail = c;
+}
+
+static void conn_events(struct conn_s *c) {
+  struct epoll_event ev;
+  int want = EPOLLIN;
+
+  if (c->state == ST_FETCH) want = 0;
+  if (c->out_off < c->out_len || c->ssl_want == EPOLLOUT) want |= EPOLLOUT;
+
+  if (want == c->events) return;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = want;
+  ev.data.ptr = c;
+  epoll_ctl(srv.epfd, EPOLL_CTL_MOD, c->fd, &ev);
+  c->events = want;
+}
+
+static void listen_resume(void) {
+  struct epoll_event ev;
+
+  if (!srv.accept_paused) return;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = 0;
+  if (epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.listen_fd, &ev) == 0) srv.accept_paused = 0;
+}
+
+static void conn_close(struct conn_s *c) {
+  idle_unlink(c);
+
+  if (c->ssl) {
+    if (c->state == ST_DONE) SSL_shutdown(c->ssl);
+    SSL_free(c->ssl);
+    c->ssl = 0;
+  }
+  if (c->fd >= 0) {
+    epoll_ctl(srv.epfd, EPOLL_CTL_DEL, c->fd, 0);
+    close(c->fd);
+    c->fd = -1;
+  }
+
+  supl_ulp_free(&c->in);
+  supl_ulp_release(&c->in);
+  free(c->out);
+  c->out = 0;
+  free(c->session_id);
+  c->session_id = 0;
+  supl_payload_put(&srv.pays, c->pay);
+  c->pay = 0;
+
+  srv.conns--;
+  listen_resume();
+
+  /* a fetcher still owns it, freed when handed back */
+  if (c->state == ST_FETCH) {
+    c->closing = 1;
+    return;
+  }
+
+  free(c);
+}
+
+static int ssl_wait(struct conn_s *c, int ret) {
+  switch (SSL_get_error(c->ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+    c->ssl_want = EPOLLIN;
+    return 0;
+  case SSL_ERROR_WANT_WRITE:
+    c->ssl_want = EPOLLOUT;
+    return 0;
+  default:
+    ERR_clear_error();
+    return E_SUPL_READ;
+  }
+}
+
+static int conn_flush(struct conn_s *c) {
+  int n;
+
+  while (c->out_off < c->out_len) {
+    n = SSL_write(c->ssl, c->out + c->out_off, c->out_len - c->out_off);
+    if (n <= 0) return ssl_wait(c, n) < 0 ? E_SUPL_WRITE : 0;
+
+    c->ssl_want = 0;
+    c->out_off += n;
+    conn_touch(c);
+  }
+
+  c->out_off = c->out_len = 0;
+
+  return 0;
+}
+
+/* 1 when a whole ULP PDU is in c->in, 0 if more is needed */
+static int conn_read(struct conn_s *c) {
+  size_t need;
+  int n;
+
+  while (1) {
+    need = 2;
+
+    /* the 16-bit length leads every PDU */
+    if (c->in.size >= 2) {
+      need = c->in.buffer[0] << 8 | c->in.buffer[1];
+      if (need <= 2) return E_SUPL_DECODE;
+      if (c->in.size >= need) return 1;
+    }
+
+    if (supl_ulp_reserve(&c->in, need) < 0) return E_SUPL_READ;
+
+    n = SSL_read(c->ssl, c->in.buffer + c->in.size, need - c->in.size);
+    if (n <= 0) return ssl_wait(c, n);
+
+    c->ssl_want = 0;
+    c->in.size += n;
+    conn_touch(c);
+  }
+}
+
+static int out_append(struct conn_s *c, unsigned char *buf, size_t size) {
+  if (c->out_len + size > c->out_alloc) {
+    size_t alloc = c->out_alloc ? c->out_alloc : 1024;
+    unsigned char *p;
+
+    while (alloc < c->out_len + size) alloc *= 2;
+    p = realloc(c->out, alloc);
+    if (!p) return E_SUPL_INTERNAL;
+    c->out = p;
+    c->out_alloc = alloc;
+  }
+
+  memcpy(c->out + c->out_len, buf, size);
+  c->out_len += size;
+
+  return 0;
+}
+
+/*
+** Messages to the SET
+*/
+
+static ULP_PDU_t *ulp_new(struct conn_s *c) {
+  ULP_PDU_t *ulp = calloc(1, sizeof(ULP_PDU_t));
+  SessionID_t *sid = &ulp->sessionID;
+
+  ulp->version.maj = 1;
+  ulp->version.min = 0;
+  ulp->version.servind = 0;
+
+  if (c->session_id) {
+    (void)uper_decode_complete(0, &asn_DEF_SessionID, (void **)&sid, c->session_id, c->session_id_size);
+  }
+
+  return ulp;
+}
+
+static int ulp_queue(struct conn_s *c, ULP_PDU_t *ulp) {
+  int err;
+
+  srv.frame.pdu = ulp;
+
+  if (srv.debug & SUPL_DEBUG_SUPL) {
+    fprintf(stderr, "Send\n");
+    xer_fprint(stderr, &asn_DEF_ULP_PDU, ulp);
+  }
+
+  err = supl_ulp_encode(&srv.frame);
+  if (err == 0) err = out_append(c, srv.frame.buffer, srv.frame.size);
+
+  supl_ulp_free(&srv.frame);
+
+  return err;
+}
+
+/* our half of the session id goes into every message after SUPLSTART */
+static int session_id_make(struct conn_s *c, ULP_PDU_t *ulp) {
+  SlpSessionID_t *slp;
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+  unsigned int id = rand_r(&srv.seed);
+  void *buf;
+  int ret;
+
+  slp = calloc(1, sizeof(SlpSessionID_t));
+  (void)OCTET_STRING_fromBuf(&slp->sessionID, (char *)&id, 4);
+
+  slp->slpId.present = SLPAddress_PR_iPAddress;
+  slp->slpId.choice.iPAddress.present = IPAddress_PR_ipv4Address;
+  if (getsockname(c->fd, (struct sockaddr *)&ss, &len) == 0 && ss.ss_family == AF_INET6 &&
+      !IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6 *)&ss)->sin6_addr)) {
+    slp->slpId.choice.iPAddress.present = IPAddress_PR_ipv6Address;
+    (void)OCTET_STRING_fromBuf(&slp->slpId.choice.iPAddress.choice.ipv6Address,
+			       (char *)&((struct sockaddr_in6 *)&ss)->sin6_addr, 16);
+  } else if (ss.ss_family == AF_INET6) {
+    (void)OCTET_STRING_fromBuf(&slp->slpId.choice.iPAddress.choice.ipv4Address,
+			       (char *)&((struct sockaddr_in6 *)&ss)->sin6_addr + 12, 4);
+  } else if (ss.ss_family == AF_INET) {
+    (void)OCTET_STRING_fromBuf(&slp->slpId.choice.iPAddress.choice.ipv4Address,
+			       (char *)&((struct sockaddr_in *)&ss)->sin_addr, 4);
+  } else {
+    (void)OCTET_STRING_fromBuf(&slp->slpId.choice.iPAddress.choice.ipv4Address, "\x7f\0\0\1", 4);
+  }
+
+  if (ulp->sessionID.slpSessionID) asn_DEF_SlpSessionID.free_struct(&asn_DEF_SlpSessionID, ulp->sessionID.slpSessionID, 0);
+  ulp->sessionID.slpSessionID = slp;
+
+  ret = uper_encode_to_new_buffer(&asn_DEF_SessionID, 0, &ulp->sessionID, &buf);
+  if (ret == -1) return E_SUPL_ENCODE;
+
+  c->session_id = buf;
+  c->session_id_size = ret;
+
+  return 0;
+}
+
+// who the SET is, from the SetSessionID of SUPLSTART
+static void set_id_from(struct conn_s *c, ULP_PDU_t *ulp) {
+  SetSessionID_t *set = ulp->sessionID.setSessionID;
+  OCTET_STRING_t *id;
+
+  c->set_id_len = 0;
+  if (!set) return;
+
+  switch (set->setId.present) {
+  case SETId_PR_imsi: id = &set->setId.choice.imsi; break;
+  case SETId_PR_msisdn: id = &set->setId.choice.msisdn; break;
+  case SETId_PR_mdn: id = &set->setId.choice.mdn; break;
+  default: return;
+  }
+
+  c->set_id_len = id->size < sizeof(c->set_id) ? id->size : sizeof(c->set_id);
+  memcpy(c->set_id, id->buf, c->set_id_len);
+}
+
+static int send_response(struct conn_s *c) {
+  ULP_PDU_t *ulp = ulp_new(c);
+
+  ulp->message.present = UlpMessage_PR_msSUPLRESPONSE;
+  (void)asn_long2INTEGER(&ulp->message.choice.msSUPLRESPONSE.posMethod, PosMethod_agpsSETbased);
+
+  return ulp_queue(c, ulp);
+}
+
+/* status < 0 is a normal end */
+static int send_end(struct conn_s *c, long status) {
+  ULP_PDU_t *ulp = ulp_new(c);
+
+  ulp->message.present = UlpMessage_PR_msSUPLEND;
+  if (status >= 0) {
+    ulp->message.choice.msSUPLEND.statusCode = calloc(1, sizeof(StatusCode_t));
+    (void)asn_long2INTEGER(ulp->message.choice.msSUPLEND.statusCode, status);
+  }
+
+  c->state = ST_DONE;
+
+  return ulp_queue(c, ulp);
+}
+
+static int send_segment(struct conn_s *c) {
+  ULP_PDU_t *ulp;
+  int more = c->sent + 1 < c->segs;
+  int err;
+
+  if (c->pay) err = supl_payload_segment(&srv.pays, c->pay, c->sent, &c->assist, c->ref, &srv.rrlp);
+  else err = supl_rrlp_encode_assist(&srv.rrlp, &c->assist, &c->seg[c->sent], c->ref, more);
+  if (err < 0) {
+    srv.failures++;
+    return send_end(c, StatusCode_systemFailure);
+  }
+
+  ulp = ulp_new(c);
+  ulp->message.present = UlpMessage_PR_msSUPLPOS;
+  ulp->message.choice.msSUPLPOS.posPayLoad.present = PosPayLoad_PR_rrlpPayload;
+  (void)OCTET_STRING_fromBuf(&ulp->message.choice.msSUPLPOS.posPayLoad.choice.rrlpPayload,
+			     (char *)srv.rrlp.buffer, srv.rrlp.size);
+
+  c->sent++;
+  c->state = more ? ST_POS : ST_LAST;
+  srv.segments++;
+
+  return ulp_queue(c, ulp);
+}
+
+/* does the SET have this ephemeris already */
+static int held(struct conn_s *c, struct supl_ephemeris_s *e) {
+  int i;
+
+  for (i = 0; i < c->p.nav.cnt; i++) {
+    if (c->p.nav.sat[i].prn == e->prn && c->p.nav.sat[i].iode == (e->IODC & 0xff)) return 1;
+  }
+
+  return 0;
+}
+
+/*
+** The --file data with the reference time of now. The event loop and the
+** fetchers read it through slots of their own, a reload does not wait
+** for them nor they for it.
+*/
+
+static int file_assist(int slot, supl_assist_t *a) {
+  const supl_snap_t *s;
+
+  s = supl_snap_get(&srv.file, slot);
+  if (s) memcpy(a, &s->assist, sizeof(supl_assist_t));
+  supl_snap_put(&srv.file, slot);
+
+  if (!s) {
+    a->set = 0;
+    return -1;
+  }
+
+  gps_clock(a);
+  return 0;
+}
+
+// from_file: c->assist holds the --file data, see file_assist()
+static int session_serve(struct conn_s *c, int from_file) {
+  supl_assist_t *a = &c->assist;
+  supl_cache_key_t area;
+  int i, n;
+
+  if (!a->set) {
+    srv.failures++;
+    return send_end(c, StatusCode_dataMissing);
+  }
+
+  for (i = n = 0; i < a->cnt_eph; i++) {
+    if (!held(c, &a->eph[i])) a->eph[n++] = a->eph[i];
+  }
+  a->cnt_eph = n;
+
+  srv.served++;
+
+  c->segs = supl_rrlp_segments(a, c->parts, c->seg, SUPL_SEGMENTS_MAX, srv.segment_size);
+  c->sent = 0;
+
+  /* the SET is up to date */
+  if (c->segs == 0) return send_end(c, -1);
+
+  /* sessions of the area share the encoding unless the SET skips some */
+  if (n == i) {
+    memset(&area, 0, sizeof(area));
+    if (!from_file) {
+      supl_ctx_t ctx;
+
+      memset(&ctx, 0, sizeof(ctx));
+      ctx.p = c->p;
+      supl_cache_key(&area, &ctx, srv.upstream);
+    }
+    c->pay = supl_payload_get(&srv.pays, &area, a, c->parts, time(0));
+  }
+
+  return send_segment(c);
+}
+
+static void params_from_posinit(struct conn_s *c, SUPLPOSINIT_t *pi) {
+  RequestedAssistData_t *req = pi->requestedAssistData;
+  supl_nmr_t nmr[SUPL_NMR_MAX];
+  supl_ctx_t ctx;
+  int i, k, n = 0;
+
+  memset(&ctx, 0, sizeof(ctx));
+
+  switch (pi->locationId.cellInfo.present) {
+  case CellInfo_PR_gsmCell: {
+    GsmCellInformation_t *g = &pi->locationId.cellInfo.choice.gsmCell;
+
+    supl_set_gsm_cell(&ctx, g->refMCC, g->refMNC, g->refLAC, g->refCI);
+
+    for (i = 0; g->nMR && i < g->nMR->list.count && n < SUPL_NMR_MAX; i++) {
+      nmr[n].freq = g->nMR->list.array[i]->aRFCN;
+      nmr[n].id = g->nMR->list.array[i]->bSIC;
+      nmr[n].level = g->nMR->list.array[i]->rxLev;
+      n++;
+    }
+    break;
+  }
+  case CellInfo_PR_wcdmaCell: {
+    WcdmaCellInformation_t *w = &pi->locationId.cellInfo.choice.wcdmaCell;
+
+    supl_set_wcdma_cell(&ctx, w->refMCC, w->refMNC, w->refUC);
+
+    for (i = 0; w->measuredResultsList && i < w->measuredResultsList->list.count; i++) {
+      MeasuredResults_t *mr = w->measuredResultsList->list.array[i];
+
+      if (!mr->frequencyInfo || mr->frequencyInfo->fmodeSpecificInfo.present != fmodeSpecificInfo_PR_fdd ||
+	  !mr->cellMeasuredResultsList) continue;
+
+      for (k = 0; k < mr->cellMeasuredResultsList->list.count && n < SUPL_NMR_MAX; k++) {
+	CellMeasuredResults_t *cell = mr->cellMeasuredResultsList->list.array[k];
+
+	if (cell->modeSpecificInfo.present != modeSpecificInfo_PR_fdd) continue;
+
+	nmr[n].freq = mr->frequencyInfo->fmodeSpecificInfo.choice.fdd.uarfcn_DL;
+	nmr[n].id = cell->modeSpecificInfo.choice.fdd.primaryCPICH_Info.primaryScramblingCode;
+	nmr[n].level = cell->modeSpecificInfo.choice.fdd.cpich_Ec_N0 ? *cell->modeSpecificInfo.choice.fdd.cpich_Ec_N0 : 0;
+	n++;
+      }
+    }
+    break;
+  }
+  default:
+    break;
+  }
+
+  supl_set_nmr(&ctx, nmr, n);
+
+  if (srv.have_celldb) (void)supl_set_gsm_cell_lookup(&ctx, &srv.celldb);
+
+  c->p = ctx.p;
+  c->parts = DEFAULT_PARTS;
+
+  if (req) {
+    c->parts = 0;
+    if (req->almanacRequested) c->parts |= SUPL_RRLP_ASSIST_ALMANAC;
+    if (req->utcModelRequested) c->parts |= SUPL_RRLP_ASSIST_UTC;
+    if (req->ionosphericModelRequested) c->parts |= SUPL_RRLP_ASSIST_IONO;
+    if (req->referenceLocationRequested) c->parts |= SUPL_RRLP_ASSIST_REFLOC;
+    if (req->referenceTimeRequested) c->parts |= SUPL_RRLP_ASSIST_REFTIME;
+    if (req->acquisitionAssistanceRequested) c->parts |= SUPL_RRLP_ASSIST_ACQUIS;
+    if (req->navigationModelRequested) c->parts |= SUPL_RRLP_ASSIST_EPHEMERIS;
+
+    if (req->navigationModelData && req->navigationModelData->satInfo) {
+      struct SatelliteInfo *si = req->navigationModelData->satInfo;
+      int i;
+
+      for (i = 0; i < si->list.count && c->p.nav.cnt < 31; i++) {
+	c->p.nav.sat[c->p.nav.cnt].prn = si->list.array[i]->satId + 1;
+	c->p.nav.sat[c->p.nav.cnt].iode = si->list.array[i]->iODE;
+	c->p.nav.cnt++;
+      }
+    }
+  }
+
+  if (c->parts & SUPL_RRLP_ASSIST_ALMANAC) c->p.request |= SUPL_REQUEST_ALMANAC;
+}
+
+static void fetch_queue(struct conn_s *c) {
+  c->state = ST_FETCH;
+  idle_unlink(c);
+
+  pthread_mutex_lock(&srv.lock);
+  c->queue = 0;
+  if (srv.queue_tail) srv.queue_tail->queue = c;
+  else srv.queue_head = c;
+  srv.queue_tail = c;
+  pthread_cond_signal(&srv.cond);
+  pthread_mutex_unlock(&srv.lock);
+}
+
+/* fetch ahead the cells the SET will likely move to next */
+static void prefetch_next(struct conn_s *c) {
+  supl_param_t next[SUPL_PREDICT_MAX];
+  supl_ctx_t ctx;
+  int i, n;
+
+  n = supl_predict_report(&srv.predict, c->set_id, c->set_id_len, &c->p, next, srv.prefetch);
+
+  for (i = 0; i < n; i++) {
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.p = next[i];
+    if (srv.have_celldb) (void)supl_set_gsm_cell_lookup(&ctx, &srv.celldb);
+    (void)supl_cache_prefetch(&srv.cache, srv.upstream, &ctx.p);
+  }
+}
+
+static int session_posinit(struct conn_s *c, SUPLPOSINIT_t *pi) {
+  supl_cache_key_t key;
+  supl_cell_pos_t pos, *at = 0;
+  supl_ctx_t ctx;
+  int hit;
+
+  params_from_posinit(c, pi);
+  c->ref = rand_r(&srv.seed) % 7 + 1;
+  srv.sessions++;
+
+  if (!srv.upstream) {
+    file_assist(srv.file_slot, &c->assist);
+    return session_serve(c, 1);
+  }
+
+  if (srv.prefetch) prefetch_next(c);
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.p = c->p;
+  supl_cache_key(&key, &ctx, srv.upstream);
+
+  /* a new cell near known ones is served from their grid square */
+  if (c->p.known.lat != 0 || c->p.known.lon != 0) {
+    pos.lat = c->p.known.lat;
+    pos.lon = c->p.known.lon;
+    pos.uncert = c->p.known.uncert;
+    at = &pos;
+  }
+
+  hit = supl_cache_lookup_at(&srv.cache, &key, at, &c->assist);
+  if (hit && (c->parts & SUPL_RRLP_ASSIST_ALMANAC) && !(c->assist.set & SUPL_RRLP_ASSIST_ALMANAC)) hit = 0;
+
+  if (hit) return session_serve(c, 0);
+
+  fetch_queue(c);
+  return 0;
+}
+
+static int handle_pdu(struct conn_s *c) {
+  ULP_PDU_t *ulp = c->in.pdu;
+  UlpMessage_PR msg = ulp->message.present;
+
+  if (srv.debug & SUPL_DEBUG_SUPL) {
+    fprintf(stderr, "Recv\n");
+    xer_fprint(stderr, &asn_DEF_ULP_PDU, ulp);
+  }
+
+  /* the SET may give up at any point */
+  if (msg == UlpMessage_PR_msSUPLEND) return E_SUPL_READ;
+
+  switch (c->state) {
+  case ST_START:
+    if (msg != UlpMessage_PR_msSUPLSTART) break;
+    if (session_id_make(c, ulp) < 0) return E_SUPL_ENCODE;
+    set_id_from(c, ulp);
+    c->state = ST_POSINIT;
+    return send_response(c);
+
+  case ST_POSINIT:
+    if (msg != UlpMessage_PR_msSUPLPOSINIT) break;
+    return session_posinit(c, &ulp->message.choice.msSUPLPOSINIT);
+
+  case ST_POS:
+    if (msg != UlpMessage_PR_msSUPLPOS) break;
+    return send_segment(c);
+
+  case ST_LAST:
+    if (msg != UlpMessage_PR_msSUPLPOS) break;
+    return send_end(c, -1);
+  }
+
+  srv.failures++;
+  return send_end(c, StatusCode_unexpectedMessage);
+}
+
+static void conn_event(struct conn_s *c, int events) {
+  int ret;
+
+  if (events & (EPOLLHUP | EPOLLERR)) goto close;
+
+  if (c->state == ST_HANDSHAKE) {
+    ret = SSL_accept(c->ssl);
+    if (ret != 1) {
+      if (ssl_wait(c, ret) < 0) goto close;
+      conn_events(c);
+      return;
+    }
+
+    c->ssl_want = 0;
+    c->state = ST_START;
+    conn_touch(c);
+  }
+
+  if (conn_flush(c) < 0) goto close;
+
+  /* one message in flight at a time */
+  while (c->out_off == c->out_len && c->state != ST_DONE && c->state != ST_FETCH) {
+    ret = conn_read(c);
+    if (ret < 0) goto close;
+    if (ret == 0) break;
+
+    if (supl_ulp_decode(&c->in) < 0) goto close;
+    ret = handle_pdu(c);
+    supl_ulp_free(&c->in);
+    c->in.size = 0;
+    if (ret < 0) goto close;
+
+    if (conn_flush(c) < 0) goto close;
+  }
+
+  if (c->state == ST_DONE && c->out_off == c->out_len) goto close;
+
+  conn_events(c);
+  return;
+
+ close:
+  conn_close(c);
+}
+
+static void on_accept(void) {
+  struct epoll_event ev;
+  struct conn_s *c;
+  int fd;
+
+  while (1) {
+    fd = accept4(srv.listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EMFILE || errno == ENFILE) {
+	/* resumed when a connection closes */
+	epoll_ctl(srv.epfd, EPOLL_CTL_DEL, srv.listen_fd, 0);
+	srv.accept_paused = 1;
+      }
+      return;
+    }
+
+    c = calloc(1, sizeof(struct conn_s));
+    if (c) c->ssl = SSL_new(srv.ssl_ctx);
+    if (!c || !c->ssl) {
+      free(c);
+      close(fd);
+      continue;
+    }
+
+    c->fd = fd;
+    c->state = ST_HANDSHAKE;
+    supl_ulp_init(&c->in);
+    SSL_set_fd(c->ssl, fd);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = c->events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(srv.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      SSL_free(c->ssl);
+      free(c);
+      close(fd);
+      continue;
+    }
+
+    srv.conns++;
+    conn_touch(c);
+  }
+}
+
+/*
+** Fetchers
+*/
+
+static void *fetch_main(void *arg) {
+  int slot = srv.have_file ? supl_snaps_reader(&srv.file) : -1;
+
+  pthread_mutex_lock(&srv.lock);
+
+  while (!srv.stop) {
+    struct conn_s *c = srv.queue_head;
+    supl_ctx_t ctx;
+    long left;
+
+    if (!c) {
+      pthread_cond_wait(&srv.cond, &srv.lock);
+      continue;
+    }
+
+    srv.queue_head = c->queue;
+    if (!srv.queue_head) srv.queue_tail = 0;
+    pthread_mutex_unlock(&srv.lock);
+
+    /* what is left of the deadline, which started with the SUPLPOSINIT */
+    left = (c->active + FETCH_TIMEOUT - time(0)) * 1000;
+
+    /* concurrent misses for the same cell share one upstream session */
+    if (left > 0) {
+      supl_ctx_new(&ctx);
+      ctx.p = c->p;
+      ctx.p.nav.cnt = 0;
+      supl_set_cancel_fd(&ctx, srv.cancel[0]);
+      supl_set_timeout(&ctx, left);
+      c->fetch_err = supl_get_assist_cached(&srv.cache, &ctx, srv.upstream, &c->assist);
+      supl_ctx_free(&ctx);
+    } else {
+      c->fetch_err = E_SUPL_TIMEOUT;
+    }
+
+    /* fall back to the --file data, copied here rather than in the event loop */
+    c->from_file = c->fetch_err < 0 && slot >= 0 && file_assist(slot, &c->assist) == 0;
+
+    if (write(srv.wake[1], &c, sizeof(c)) != sizeof(c)) {
+      /* can not happen with a blocking pipe */
+    }
+
+    pthread_mutex_lock(&srv.lock);
+  }
+
+  pthread_mutex_unlock(&srv.lock);
+
+  if (slot >= 0) supl_snaps_reader_done(&srv.file, slot);
+
+  return 0;
+}
+
+static void on_wake(void) {
+  struct conn_s *c;
+
+  while (read(srv.wake[0], &c, sizeof(c)) == sizeof(c)) {
+    srv.fetches++;
+    if (c->fetch_err < 0) srv.fetch_failures++;
+
+    if (c->closing) {
+      free(c);
+      continue;
+    }
+
+    c->state = ST_POSINIT;
+    conn_touch(c);
+
+    if (c->fetch_err < 0 && !c->from_file) {
+      srv.failures++;
+      send_end(c, StatusCode_systemFailure);
+    } else if (session_serve(c, c->from_file) < 0) {
+      conn_close(c);
+      continue;
+    }
+
+    conn_event(c, 0);
+  }
+}
+
+static void expire_idle(void) {
+  time_t now = time(0);
+
+  while (srv.idle_head && now - srv.idle_head->active > SESSION_TIMEOUT) {
+    conn_close(srv.idle_head);
+  }
+}
+
+/* reread --file, the sessions running keep the data they have */
+static void file_reload(char *file) {
+  supl_assist_t a;
+
+  reload = 0;
+
+  if (assist_read(file, &a) < 0 || supl_snaps_publish(&srv.file, &a) < 0) {
+    fprintf(stderr, "Error: no assistance data in %s, serving the old\n", file);
+  }
+}
+
+/*
+** Setup
+*/
+
+static int listen_on(int port) {
+  struct sockaddr_in6 sa6;
+  struct sockaddr_in sa;
+  int fd, on = 1, off = 0;
+
+  /* dual stack if we can, IPv4 only if not */
+  fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd >= 0) {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+    memset(&sa6, 0, sizeof(sa6));
+    sa6.sin6_family = AF_INET6;
+    sa6.sin6_addr = in6addr_any;
+    sa6.sin6_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&sa6, sizeof(sa6)) == 0 && listen(fd, SOMAXCONN) == 0) return fd;
+
+    close(fd);
+  }
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = INADDR_ANY;
+  sa.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0 && listen(fd, SOMAXCONN) == 0) return fd;
+
+  close(fd);
+  return -1;
+}
+
+static SSL_CTX *ssl_setup(char *cert, char *key) {
+  SSL_CTX *ctx;
+
+  supl_init();
+
+  ctx = SSL_CTX_new(SSLv23_server_method());
+  if (!ctx) return 0;
+
+  if (SSL_CTX_use_certificate_file(ctx, cert, SSL_FILETYPE_PEM) <= 0) {
+    fprintf(stderr, "Error: Valid server certificate not found in %s\n", cert);
+    return 0;
+  }
+  if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) <= 0) {
+    fprintf(stderr, "Error: Valid server private key not found in %s\n", key);
+    return 0;
+  }
+  if (!SSL_CTX_check_private_key(ctx)) {
+    fprintf(stderr, "Error: Private key does not match the certificate public key\n");
+    return 0;
+  }
+
+  /* idle sessions should not pin their SSL buffers, there may be thousands */
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+		   SSL_MODE_RELEASE_BUFFERS);
+
+  return ctx;
+}
+
+static void raise_fd_limit(void) {
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    (void)setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+static void usage(char *progname) {
+  fprintf(stderr,
+	  "Usage:\n"
+	  "%s options\n"
+	  "Options:\n"
+	  "  --port n		listen on port n, default " SUPL_PORT "\n"
+	  "  --upstream server	fill the cache from this SUPL server\n"
+	  "  --file file		serve assistance from file (supl-client output)\n"
+	  "  --fetchers n		upstream sessions at once, default 4\n"
+	  "  --cache-bytes n	cache memory budget\n"
+	  "  --grid-km n		share assistance in n km squares, 0 == per cell\n"
+	  "  --celldb index	cell positions, see supl-celldb\n"
+	  "  --prefetch n		fetch ahead n likely next cells of each SET\n"
+	  "  --segment-size n	RRLP segment size target, default %d bytes\n"
+	  "  --cert file		server certificate, default " CERTF "\n"
+	  "  --key file		server private key, default " KEYF "\n"
+	  "  --debug n		1 == RRLP, 2 == SUPL, 4 == DEBUG\n"
+	  "  --help		show this help\n"
+	  "At least one of --upstream and --file must be given.\n",
+	  progname, SUPL_SEGMENT_SIZE);
+}
+
+static struct option long_opts[] = {
+  { "port", 1, 0, 0 },
+  { "upstream", 1, 0, 0 },
+  { "file", 1, 0, 0 },
+  { "fetchers", 1, 0, 0 },
+  { "cache-bytes", 1, 0, 0 },
+  { "cert", 1, 0, 0 },
+  { "key", 1, 0, 0 },
+  { "segment-size", 1, 0, 0 },
+  { "grid-km", 1, 0, 0 },
+  { "celldb", 1, 0, 0 },
+  { "prefetch", 1, 0, 0 },
+  { "debug", 1, 0, 'd' },
+  { "help", 0, 0, 'h' },
+  { 0, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[]) {
+  struct epoll_event ev, events[MAX_EVENTS];
+  supl_cache_stats_t cs;
+  supl_predict_stats_t ps;
+  char *file = 0, *cert = CERTF, *key = KEYF;
+  int port = atoi(SUPL_PORT);
+  long cache_bytes = 0;
+  int grid_km = 0;
+  char *celldb = 0;
+  supl_assist_t a;
+  int i, c, opt_index;
+
+  srv.fetchers = 4;
+
+  while ((c = getopt_long(argc, argv, "d:h", long_opts, &opt_index)) != -1) {
+    switch (c) {
+    case 0:
+      switch (opt_index) {
+      case 0: port = atoi(optarg); break;
+      case 1: srv.upstream = optarg; break;
+      case 2: file = optarg; break;
+      case 3: srv.fetchers = atoi(optarg); break;
+      case 4: cache_bytes = atol(optarg); break;
+      case 5: cert = optarg; break;
+      case 6: key = optarg; break;
+      case 7: srv.segment_size = atol(optarg); break;
+      case 8: grid_km = atoi(optarg); break;
+      case 9: celldb = optarg; break;
+      case 10: srv.prefetch = atoi(optarg); break;
+      }
+      break;
+    case 'd':
+      srv.debug = atoi(optarg);
+      break;
+    case 'h':
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (!srv.upstream && !file) {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  if (srv.debug) supl_set_debug(stderr, srv.debug);
+
+  if (file) {
+    if (assist_read(file, &a) < 0) {
+      fprintf(stderr, "Error: no assistance data in %s\n", file);
+      exit(1);
+    }
+    supl_snaps_new(&srv.file);
+    if (supl_snaps_publish(&srv.file, &a) < 0) exit(1);
+    srv.file_slot = supl_snaps_reader(&srv.file);
+    srv.have_file = 1;
+
+    /* a slot each for the event loop and the fetchers */
+    if (srv.fetchers > SUPL_SNAP_SLOTS - 1) srv.fetchers = SUPL_SNAP_SLOTS - 1;
+  }
+
+  srv.ssl_ctx = ssl_setup(cert, key);
+  if (!srv.ssl_ctx) exit(1);
+
+  if (supl_cache_new(&srv.cache, 0) < 0) exit(1);
+  srv.cache.max_bytes = cache_bytes;
+  srv.cache.grid_km = grid_km;
+
+  if (celldb) {
+    if (supl_celldb_open(&srv.celldb, celldb) < 0) {
+      fprintf(stderr, "Error: open cell index %s\n", celldb);
+      exit(1);
+    }
+    srv.have_celldb = 1;
+  }
+
+  if (srv.prefetch > SUPL_PREDICT_MAX) srv.prefetch = SUPL_PREDICT_MAX;
+  if (!srv.upstream) srv.prefetch = 0;
+  if (srv.prefetch > 0 && supl_predict_new(&srv.predict, 0, 0) < 0) exit(1);
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  if (file) signal(SIGHUP, on_hup);
+  raise_fd_limit();
+
+  srv.listen_fd = listen_on(port);
+  if (srv.listen_fd < 0) {
+    fprintf(stderr, "Error: Could not listen on port %d (%s)\n", port, strerror(errno));
+    exit(1);
+  }
+
+  srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (srv.epfd < 0 || pipe(srv.wake) < 0 || pipe(srv.cancel) < 0) exit(1);
+  fcntl(srv.wake[0], F_SETFL, O_NONBLOCK);
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = 0;
+  epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.listen_fd, &ev);
+  ev.data.ptr = &srv.wake;
+  epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.wake[0], &ev);
+
+  supl_ulp_init(&srv.frame);
+  supl_rrlp_init(&srv.rrlp);
+  if (supl_payloads_new(&srv.pays, 0) < 0) exit(1);
+  srv.pays.target = srv.segment_size;
+  srv.seed = time(0) ^ getpid();
+
+  pthread_mutex_init(&srv.lock, 0);
+  pthread_cond_init(&srv.cond, 0);
+
+  if (srv.upstream) {
+    if (srv.fetchers < 1) srv.fetchers = 1;
+    srv.fetcher = calloc(srv.fetchers, sizeof(pthread_t));
+    for (i = 0; i < srv.fetchers; i++) {
+      pthread_create(&srv.fetcher[i], 0, fetch_main, 0);
+    }
+
+    /* keep the cells in use warm */
+    srv.cache.refresh_timeout = FETCH_TIMEOUT * 1000;
+    supl_cache_refresh_start(&srv.cache, 1.0, srv.fetchers);
+  }
+
+  while (!quit) {
+    int n = epoll_wait(srv.epfd, events, MAX_EVENTS, 1000);
+    int wake = 0;
+
+    if (n < 0 && errno != EINTR) break;
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == 0) on_accept();
+      else if (events[i].data.ptr == &srv.wake) wake = 1;
+      else conn_event(events[i].data.ptr, events[i].events);
+    }
+
+    /* after the events, they may still point to connections freed here */
+    if (wake) on_wake();
+    expire_idle();
+
+    if (reload) file_reload(file);
+  }
+
+  if (srv.upstream) {
+    pthread_mutex_lock(&srv.lock);
+    srv.stop = 1;
+    pthread_cond_broadcast(&srv.cond);
+    pthread_mutex_unlock(&srv.lock);
+
+    /* do not wait for the upstream sessions running */
+    (void)write(srv.cancel[1], "x", 1);
+
+    for (i = 0; i < srv.fetchers; i++) {
+      pthread_join(srv.fetcher[i], 0);
+    }
+  }
+
+  supl_cache_get_stats(&srv.cache, &cs);
+  fprintf(stderr, "sessions %lu served %lu segments %lu failures %lu\n",
+	  srv.sessions, srv.served, srv.segments, srv.failures);
+  fprintf(stderr, "fetches %lu failed %lu, cache hits %lu (%lu from grid) misses %lu coalesced %lu refreshes %lu\n",
+	  srv.fetches, srv.fetch_failures, cs.hits, cs.shared, cs.misses, cs.coalesced, cs.refreshes);
+  fprintf(stderr, "encodings reused %lu made %lu invalidated %lu\n",
+	  srv.pays.hits, srv.pays.misses, srv.pays.invalidations);
+  if (srv.prefetch > 0) {
+    supl_predict_get_stats(&srv.predict, &ps);
+    fprintf(stderr, "handovers %lu predicted %lu, prefetches %lu used %lu dropped %lu\n",
+	    ps.handovers, ps.predicted, cs.prefetches, cs.prefetch_used, cs.prefetch_dropped);
+  }
+
+  while (srv.idle_head) conn_close(srv.idle_head);
+
+  supl_payloads_free(&srv.pays);
+  if (srv.have_file) supl_snaps_free(&srv.file);
+  if (srv.have_celldb) supl_celldb_close(&srv.celldb);
+  if (srv.prefetch > 0) supl_predict_free(&srv.predict);
+  supl_cache_free(&srv.cache);
+  supl_ulp_release(&srv.frame);
+  supl_rrlp_release(&srv.rrlp);
+  SSL_CTX_free(srv.ssl_ctx);
+  close(srv.listen_fd);
+  close(srv.epfd);
+
+  return 0;
+}
@@ -0,0 +1,122 @@
+/*
+** SUPL library - publish assistance to local readers in shared memory
+**
+** Copyright (c) 2007 Tatu Mannisto <tatu a-t tajuma d-o-t com>
+** All rights reserved.
+** Redistribution and modifications are permitted subject to BSD license.
+**
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "supl.h"
+#include "supl-shm.h"
+
+/*
+** One record, the latest assistance, after a header with a sequence
+** counter. Readers (supl-shm.h) copy it without locks and retry if the
+** counter changed under them. Publishers of all processes serialize
+** with an fcntl() lock on the object, like supl-store.c.
+*/
+
+#define SHM_SIZE (SUPL_SHM_DATA + sizeof(supl_assist_t))
+
+static int shm_lock(supl_shm_t *shm, int type) {
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+
+  while (fcntl(shm->fd, F_SETLKW, &fl) < 0) {
+    if (errno != EINTR) return E_SUPL_INTERNAL;
+  }
+
+  return 0;
+}
+
+int EXPORT supl_shm_create(supl_shm_t *shm, char *name) {
+  struct supl_shm_header_s *hdr;
+  struct stat sb;
+
+  memset(shm, 0, sizeof(supl_shm_t));
+
+  shm->fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+  if (shm->fd < 0) return E_SUPL_WRITE;
+
+  if (shm_lock(shm, F_WRLCK) < 0) goto fail;
+
+  if (fstat(shm->fd, &sb) < 0) goto fail_unlock;
+  if (sb.st_size < (off_t)SHM_SIZE && ftruncate(shm->fd, SHM_SIZE) < 0) goto fail_unlock;
+
+  shm->size = SHM_SIZE;
+  shm->map = mmap(0, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+  if (shm->map == MAP_FAILED) {
+    shm->map = 0;
+    goto fail_unlock;
+  }
+
+  /* new, or left by another version, nothing published then */
+  hdr = shm->map;
+  if (hdr->magic != SUPL_SHM_MAGIC || hdr->version != SUPL_SHM_VERSION ||
+      hdr->size != sizeof(supl_assist_t)) {
+    __atomic_store_n(&hdr->seq, 0, __ATOMIC_RELAXED);
+    hdr->size = sizeof(supl_assist_t);
+    hdr->published = 0;
+    hdr->publishes = 0;
+    hdr->version = SUPL_SHM_VERSION;
+    __atomic_store_n(&hdr->magic, SUPL_SHM_MAGIC, __ATOMIC_RELEASE);
+  }
+
+  shm_lock(shm, F_UNLCK);
+
+  return 0;
+
+ fail_unlock:
+  shm_lock(shm, F_UNLCK);
+ fail:
+  close(shm->fd);
+  shm->fd = -1;
+  return E_SUPL_WRITE;
+}
+
+/* the object stays for the readers, remove it with shm_unlink() */
+void EXPORT supl_shm_close(supl_shm_t *shm) {
+  if (shm->map) munmap(shm->map, shm->size);
+  if (shm->fd >= 0) close(shm->fd);
+
+  memset(shm, 0, sizeof(supl_shm_t));
+  shm->fd = -1;
+}
+
+/* replace the published assistance with assist */
+int EXPORT supl_shm_publish(supl_shm_t *shm, supl_assist_t *assist) {
+  struct supl_shm_header_s *hdr = shm->map;
+  uint32_t seq;
+
+  if (!shm->map) return E_SUPL_WRITE;
+
+  if (shm_lock(shm, F_WRLCK) < 0) return E_SUPL_WRITE;
+
+  /* seqlock write, the counter may still be odd after a crashed writer */
+  seq = (hdr->seq + 1) | 1;
+  __atomic_store_n(&hdr->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy((char *)shm->map + SUPL_SHM_DATA, assist, sizeof(supl_assist_t));
+  hdr->published = time(0);
+  hdr->publishes++;
+  __atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELEASE);
+
+  shm_lock(shm, F_UNLCK);
+
+  return 0;
+}
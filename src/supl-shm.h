@@ -0,0 +1,147 @@
+/*
+** SUPL library - reader of assistance published in shared memory
+**
+** Copyright (c) 2007 Tatu Mannisto <tatu a-t tajuma d-o-t com>
+** All rights reserved.
+** Redistribution and modifications are permitted subject to BSD license.
+**
+*/
+
+#ifndef SUPL_SHM_H
+#define SUPL_SHM_H
+
+/*
+** supl_shm_publish() (supl-client --publish name) keeps the latest
+** assistance in a POSIX shared memory object. Any number of local
+** processes read it with the functions below, which are inline and need
+** no linking with libsupl. Only attaching makes system calls (link with
+** -lrt on old C libraries), a read is a copy under a sequence counter
+** which is odd while the publisher is writing:
+**
+**   supl_shm_reader_t r;
+**   supl_assist_t assist;
+**
+**   if (supl_shm_attach(&r, "/supl") == 0 &&
+**       supl_shm_read(&r, &assist, sizeof(assist), 0) == 1) ...
+**
+** The record is a supl_assist_t as laid out by the publisher's build,
+** so readers include supl.h (and with it the ASN.1 and OpenSSL headers)
+** from the same libsupl version. Its size is checked on every read.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SUPL_SHM_MAGIC 0x4d485353 /* "SSHM" */
+#define SUPL_SHM_VERSION 1
+#define SUPL_SHM_DATA 64          /* record offset, a cache line after the header */
+#define SUPL_SHM_READ_TRIES 100000
+
+struct supl_shm_header_s {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;       /* odd while being written, +2 per publish */
+  uint32_t size;      /* of the record */
+  int64_t published;  /* when, unix time */
+  uint64_t publishes;
+};
+
+typedef struct supl_shm_reader_s {
+  const void *map;
+  size_t size;
+} supl_shm_reader_t;
+
+/* map the object read only, 0 or -1 with errno set */
+static inline int supl_shm_attach(supl_shm_reader_t *r, const char *name) {
+  const struct supl_shm_header_s *hdr;
+  struct stat sb;
+  void *map;
+  int fd;
+
+  r->map = 0;
+  r->size = 0;
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) return -1;
+
+  if (fstat(fd, &sb) < 0 || sb.st_size < SUPL_SHM_DATA) {
+    close(fd);
+    return -1;
+  }
+
+  map = mmap(0, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+
+  hdr = (const struct supl_shm_header_s *)map;
+  if (hdr->magic != SUPL_SHM_MAGIC || hdr->version != SUPL_SHM_VERSION) {
+    munmap(map, sb.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  r->map = map;
+  r->size = sb.st_size;
+
+  return 0;
+}
+
+static inline void supl_shm_detach(supl_shm_reader_t *r) {
+  if (r->map) munmap((void *)r->map, r->size);
+  r->map = 0;
+  r->size = 0;
+}
+
+/* changes on every publish, a cheap way to poll for new data */
+static inline uint32_t supl_shm_generation(const supl_shm_reader_t *r) {
+  const struct supl_shm_header_s *hdr = (const struct supl_shm_header_s *)r->map;
+
+  return __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE) >> 1;
+}
+
+/*
+** Consistent copy of the record into out. Returns 1, 0 if nothing has
+** been published yet or the publisher stays busy (it was killed while
+** writing), -1 if the record is not size bytes.
+*/
+
+static inline int supl_shm_read(const supl_shm_reader_t *r, void *out, size_t size, time_t *published) {
+  const struct supl_shm_header_s *hdr = (const struct supl_shm_header_s *)r->map;
+  uint32_t seq, rec;
+  int64_t at;
+  int tries;
+
+  if (!hdr) return 0;
+
+  for (tries = 0; tries < SUPL_SHM_READ_TRIES; tries++) {
+    seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) continue;
+    if (seq == 0) return 0;
+
+    rec = hdr->size;
+    at = hdr->published;
+    if (rec != size || SUPL_SHM_DATA + size > r->size) {
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == seq) return -1;
+      continue;
+    }
+
+    memcpy(out, (const char *)r->map + SUPL_SHM_DATA, size);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == seq) {
+      if (published) *published = at;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,600 @@
+/*
+** SUPL library - SLP side, assistance data out as RRLP
+**
+** Copyright (c) 2007 Tatu Mannisto <tatu a-t tajuma d-o-t com>
+** All rights reserved.
+** Redistribution and modifications are permitted subject to BSD license.
+**
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PDU.h"
+
+#include "supl.h"
+
+#define SEG_HEAD (SUPL_RRLP_ASSIST_REFTIME | SUPL_RRLP_ASSIST_REFLOC | SUPL_RRLP_ASSIST_IONO | \
+		  SUPL_RRLP_ASSIST_UTC | SUPL_RRLP_ASSIST_ACQUIS)
+
+/*
+** Largest count in [lo, hi] with which seg still encodes to at most
+** target bytes, lo if not even that fits. *cnt is the ephemeris or
+** almanac count of seg being sized.
+*/
+
+static int fit(supl_rrlp_t *tmp, supl_assist_t *assist, supl_segment_t *seg, int *cnt, int lo, int hi, size_t target) {
+  while (lo < hi) {
+    *cnt = (lo + hi + 1) / 2;
+    if (supl_rrlp_encode_assist(tmp, assist, seg, 0, 1) == 0 && tmp->size <= target) lo = *cnt;
+    else hi = *cnt - 1;
+  }
+
+  *cnt = lo;
+
+  return lo;
+}
+
+/*
+** Split the parts of assist into RRLP segments: time, location and the
+** small models go first, then as many ephemerides and after them almanac
+** entries as fit in target bytes per segment, so that the SET acks as few
+** segments as possible. A segment takes at least one satellite even if it
+** does not fit and the last one, seg[max - 1], takes all that is left.
+** target 0 is SUPL_SEGMENT_SIZE. Returns the number of segments filled in.
+*/
+
+int EXPORT supl_rrlp_segments(supl_assist_t *assist, int parts, supl_segment_t *seg, int max, size_t target) {
+  supl_rrlp_t tmp;
+  int cnt_eph, cnt_alm, eph = 0, alm = 0, n = 0;
+
+  parts &= assist->set;
+  cnt_eph = (parts & SUPL_RRLP_ASSIST_EPHEMERIS) ? assist->cnt_eph : 0;
+  cnt_alm = (parts & SUPL_RRLP_ASSIST_ALMANAC) ? assist->cnt_alm : 0;
+  if (!cnt_eph) parts &= ~SUPL_RRLP_ASSIST_EPHEMERIS;
+  if (!cnt_alm) parts &= ~SUPL_RRLP_ASSIST_ALMANAC;
+
+  if (max <= 0 || !parts) return 0;
+  if (target == 0) target = SUPL_SEGMENT_SIZE;
+
+  memset(seg, 0, max * sizeof(supl_segment_t));
+  supl_rrlp_init(&tmp);
+
+  seg[0].parts = parts & SEG_HEAD;
+
+  while (1) {
+    supl_segment_t *s = &seg[n];
+    int last = n + 1 == max;
+
+    if (eph < cnt_eph) {
+      s->parts |= SUPL_RRLP_ASSIST_EPHEMERIS;
+      s->eph0 = eph;
+      if (last) s->cnt_eph = cnt_eph - eph;
+      else fit(&tmp, assist, s, &s->cnt_eph, s->parts != SUPL_RRLP_ASSIST_EPHEMERIS ? 0 : 1, cnt_eph - eph, target);
+      if (!s->cnt_eph) s->parts &= ~SUPL_RRLP_ASSIST_EPHEMERIS;
+      eph += s->cnt_eph;
+    }
+
+    if (eph == cnt_eph && alm < cnt_alm) {
+      s->parts |= SUPL_RRLP_ASSIST_ALMANAC;
+      s->alm0 = alm;
+      if (last) s->cnt_alm = cnt_alm - alm;
+      else fit(&tmp, assist, s, &s->cnt_alm, s->parts != SUPL_RRLP_ASSIST_ALMANAC ? 0 : 1, cnt_alm - alm, target);
+      if (!s->cnt_alm) s->parts &= ~SUPL_RRLP_ASSIST_ALMANAC;
+      alm += s->cnt_alm;
+    }
+
+    n++;
+    if (eph == cnt_eph && alm == cnt_alm) break;
+  }
+
+  supl_rrlp_release(&tmp);
+
+  return n;
+}
+
+/* 3GPP TS 23.032 ellipsoid point with altitude and uncertainty ellipsoid */
+static void encode_location(OCTET_STRING_t *loc, supl_assist_t *assist) {
+  unsigned char buf[14];
+  long l;
+
+  memset(buf, 0, sizeof(buf));
+  buf[0] = 0x90;
+
+  l = (assist->pos.lat < 0 ? -assist->pos.lat : assist->pos.lat) * (1 << 23) / 90.0;
+  if (l >= 1 << 23) l = (1 << 23) - 1;
+  buf[1] = (l >> 16) & 0x7f;
+  if (assist->pos.lat < 0) buf[1] |= 0x80;
+  buf[2] = l >> 8;
+  buf[3] = l;
+
+  l = (long)(assist->pos.lon * (1 << 24) / 360.0) & 0xffffff;
+  buf[4] = l >> 16;
+  buf[5] = l >> 8;
+  buf[6] = l;
+
+  /* altitude 0, the same uncertainty on both axes */
+  buf[9] = assist->pos.uncertainty;
+  buf[10] = assist->pos.uncertainty;
+  buf[12] = 0x7f;
+  buf[13] = 68; /* confidence % */
+
+  (void)OCTET_STRING_fromBuf(loc, (char *)buf, sizeof(buf));
+}
+
+static void encode_ephemeris(NavModelElement_t *e, struct supl_ephemeris_s *eph) {
+  UncompressedEphemeris_t *ue;
+
+  e->satelliteID = eph->prn - 1;
+  e->satStatus.present = SatStatus_PR_newSatelliteAndModelUC;
+  ue = &e->satStatus.choice.newSatelliteAndModelUC;
+
+  ue->ephemCodeOnL2 = eph->bits;
+  ue->ephemURA = eph->ura;
+  ue->ephemSVhealth = eph->health;
+  ue->ephemIODC = eph->IODC;
+  ue->ephemTgd = eph->tgd;
+  ue->ephemToc = eph->toc;
+  ue->ephemAF2 = eph->AF2;
+  ue->ephemAF1 = eph->AF1;
+  ue->ephemAF0 = eph->AF0;
+  ue->ephemCrs = eph->Crs;
+  ue->ephemDeltaN = (int16_t)eph->delta_n;
+  ue->ephemM0 = eph->M0;
+  ue->ephemCuc = eph->Cuc;
+  ue->ephemE = eph->e;
+  ue->ephemCus = eph->Cus;
+  ue->ephemAPowerHalf = eph->A_sqrt;
+  ue->ephemToe = eph->toe;
+  ue->ephemAODA = eph->AODA;
+  ue->ephemCic = eph->Cic;
+  ue->ephemOmegaA0 = eph->OMEGA_0;
+  ue->ephemCis = eph->Cis;
+  ue->ephemI0 = eph->i0;
+  ue->ephemCrc = eph->Crc;
+  ue->ephemW = eph->w;
+  ue->ephemOmegaADot = eph->OMEGA_dot;
+  ue->ephemIDot = eph->i_dot;
+}
+
+static void encode_almanac(AlmanacElement_t *e, struct supl_almanac_s *alm) {
+  e->satelliteID = alm->prn - 1;
+  e->almanacE = alm->e;
+  e->alamanacToa = alm->toa;
+  e->almanacKsii = alm->Ksii;
+  e->almanacOmegaDot = alm->OMEGA_dot;
+  e->almanacAPowerHalf = alm->A_sqrt;
+  e->almanacOmega0 = alm->OMEGA_0;
+  e->almanacW = alm->w;
+  e->almanacM0 = alm->M0;
+  e->almanacAF0 = alm->AF0;
+  e->almanacAF1 = alm->AF1;
+}
+
+static void encode_acquis(AcquisElement_t *e, struct supl_acquis_s *acq) {
+  e->svid = acq->prn - 1;
+  e->doppler0 = acq->doppler0;
+
+  if (acq->parts & SUPL_ACQUIS_DOPPLER) {
+    e->addionalDoppler = calloc(1, sizeof(AddionalDopplerFields_t));
+    e->addionalDoppler->doppler1 = acq->doppler1;
+    e->addionalDoppler->dopplerUncertainty = acq->d_win;
+  }
+
+  e->codePhase = acq->code_ph;
+  e->intCodePhase = acq->code_ph_int;
+  e->gpsBitNumber = acq->bit_num;
+  e->codePhaseSearchWindow = acq->code_ph_win;
+
+  if (acq->parts & SUPL_ACQUIS_ANGLE) {
+    e->addionalAngle = calloc(1, sizeof(AddionalAngleFields_t));
+    e->addionalAngle->azimuth = acq->az;
+    e->addionalAngle->elevation = acq->el;
+  }
+}
+
+/*
+** Encode segment seg of assist as an RRLP assistanceData PDU into out,
+** the inverse of supl_collect_rrlp(). more tells the SET to expect
+** another segment after this one.
+*/
+
+int EXPORT supl_rrlp_encode_assist(supl_rrlp_t *out, supl_assist_t *assist, supl_segment_t *seg, int ref, int more) {
+  PDU_t *rrlp;
+  AssistanceData_t *ad;
+  ControlHeader_t *hdr;
+  asn_enc_rval_t ret;
+  int i;
+
+  rrlp = calloc(1, sizeof(PDU_t));
+  rrlp->referenceNumber = ref;
+  rrlp->component.present = RRLP_Component_PR_assistanceData;
+
+  ad = &rrlp->component.choice.assistanceData;
+  ad->gps_AssistData = calloc(1, sizeof(GPS_AssistData_t));
+  ad->moreAssDataToBeSent = calloc(1, sizeof(MoreAssDataToBeSent_t));
+  (void)asn_long2INTEGER((INTEGER_t *)ad->moreAssDataToBeSent,
+			 more ? MoreAssDataToBeSent_moreMessagesOnTheWay : MoreAssDataToBeSent_noMoreMessages);
+
+  hdr = &ad->gps_AssistData->controlHeader;
+
+  if (seg->parts & SUPL_RRLP_ASSIST_REFTIME) {
+    hdr->referenceTime = calloc(1, sizeof(ReferenceTime_t));
+    hdr->referenceTime->gpsTime.gpsTOW23b = assist->time.gps_tow;
+    hdr->referenceTime->gpsTime.gpsWeek = assist->time.gps_week % 1024;
+  }
+
+  if (seg->parts & SUPL_RRLP_ASSIST_REFLOC) {
+    hdr->refLocation = calloc(1, sizeof(RefLocation_t));
+    encode_location(&hdr->refLocation->threeDLocation, assist);
+  }
+
+  if (seg->parts & SUPL_RRLP_ASSIST_EPHEMERIS) {
+    hdr->navigationModel = calloc(1, sizeof(NavigationModel_t));
+
+    for (i = seg->eph0; i < seg->eph0 + seg->cnt_eph && i < assist->cnt_eph; i++) {
+      NavModelElement_t *e = calloc(1, sizeof(NavModelElement_t));
+
+      encode_ephemeris(e, &assist->eph[i]);
+      ASN_SEQUENCE_ADD(&hdr->navigationModel->navModelList.list, e);
+    }
+  }
+
+  if (seg->parts & SUPL_RRLP_ASSIST_IONO) {
+    hdr->ionosphericModel = calloc(1, sizeof(IonosphericModel_t));
+    hdr->ionosphericModel->alfa0 = assist->iono.a0;
+    hdr->ionosphericModel->alfa1 = assist->iono.a1;
+    hdr->ionosphericModel->alfa2 = assist->iono.a2;
+    hdr->ionosphericModel->beta0 = assist->iono.b0;
+    hdr->ionosphericModel->beta1 = assist->iono.b1;
+    hdr->ionosphericModel->beta2 = assist->iono.b2;
+    hdr->ionosphericModel->beta3 = assist->iono.b3;
+  }
+
+  if (seg->parts & SUPL_RRLP_ASSIST_UTC) {
+    hdr->utcModel = calloc(1, sizeof(UTCModel_t));
+    hdr->utcModel->utcA0 = assist->utc.a0;
+    hdr->utcModel->utcA1 = assist->utc.a1;
+    hdr->utcModel->utcTot = assist->utc.tot;
+    hdr->utcModel->utcWNt = assist->utc.wnt;
+    hdr->utcModel->utcDeltaTls = assist->utc.delta_tls;
+    hdr->utcModel->utcWNlsf = assist->utc.wnlsf;
+    hdr->utcModel->utcDN = (int8_t)assist->utc.dn;
+    hdr->utcModel->utcDeltaTlsf = (int8_t)assist->utc.delta_tlsf;
+  }
+
+  if (seg->parts & SUPL_RRLP_ASSIST_ALMANAC) {
+    hdr->almanac = calloc(1, sizeof(Almanac_t));
+    hdr->almanac->alamanacWNa = (assist->alm_week ? assist->alm_week : assist->time.gps_week) & 0xff;
+
+    for (i = seg->alm0; i < seg->alm0 + seg->cnt_alm && i < assist->cnt_alm; i++) {
+      AlmanacElement_t *e = calloc(1, sizeof(AlmanacElement_t));
+
+      encode_almanac(e, &assist->alm[i]);
+      ASN_SEQUENCE_ADD(&hdr->almanac->almanacList.list, e);
+    }
+  }
+
+  if (seg->parts & SUPL_RRLP_ASSIST_ACQUIS) {
+    hdr->acquisAssist = calloc(1, sizeof(AcquisAssist_t));
+    hdr->acquisAssist->timeRelation.gpsTOW = assist->acq_time;
+
+    for (i = 0; i < assist->cnt_acq; i++) {
+      AcquisElement_t *e = calloc(1, sizeof(AcquisElement_t));
+
+      encode_acquis(e, &assist->acq[i]);
+      ASN_SEQUENCE_ADD(&hdr->acquisAssist->acquisList.list, e);
+    }
+  }
+
+  /* same buffer growing as supl_ulp_encode() */
+  out->size = 0;
+  if (supl_rrlp_reserve(out, 1024) < 0) goto fail;
+
+  while (1) {
+    memset(out->buffer, 0, out->alloc);
+    ret = uper_encode_to_buffer(&asn_DEF_PDU, rrlp, out->buffer, out->alloc);
+    if (ret.encoded != -1 || out->alloc > SUPL_PDU_MAX_SIZE) break;
+    if (supl_rrlp_reserve(out, out->alloc + 1) < 0) goto fail;
+  }
+
+  if (ret.encoded == -1) goto fail;
+
+  out->size = (ret.encoded + 7) >> 3;
+  asn_DEF_PDU.free_struct(&asn_DEF_PDU, rrlp, 0);
+
+  return 0;
+
+ fail:
+  asn_DEF_PDU.free_struct(&asn_DEF_PDU, rrlp, 0);
+  return E_SUPL_ENCODE_RRLP;
+}
+
+/*
+** Pre-encoded segments. Sessions for the same area and parts get the same
+** bytes within a time bucket, so the encoding is done once and shared.
+** Entries are reference counted as a session holds one across several
+** round trips while a newer encoding may replace it in the table.
+** Not locked, use from one thread.
+*/
+
+static unsigned int fnv(unsigned int h, const void *data, size_t size) {
+  const unsigned char *p = data;
+
+  while (size--) {
+    h = (h ^ *p++) * 16777619u;
+  }
+
+  return h;
+}
+
+#define FNV(h, v) fnv(h, &(v), sizeof(v))
+
+/* changes with anything that goes into the encoding except the reference time */
+static unsigned int assist_sig(supl_assist_t *a) {
+  unsigned int h = 2166136261u;
+  int i;
+
+  h = FNV(h, a->set);
+  h = FNV(h, a->pos.lat);
+  h = FNV(h, a->pos.lon);
+  h = FNV(h, a->pos.uncertainty);
+  h = FNV(h, a->iono);
+  h = FNV(h, a->utc.a0);
+  h = FNV(h, a->utc.a1);
+  h = FNV(h, a->utc.delta_tls);
+  h = FNV(h, a->utc.wnlsf);
+
+  // IODC includes IODE, a new upload changes it
+  h = FNV(h, a->cnt_eph);
+  for (i = 0; i < a->cnt_eph; i++) {
+    h = FNV(h, a->eph[i].prn);
+    h = FNV(h, a->eph[i].IODC);
+    h = FNV(h, a->eph[i].toe);
+  }
+
+  h = FNV(h, a->alm_week);
+  h = FNV(h, a->cnt_alm);
+  for (i = 0; i < a->cnt_alm; i++) {
+    h = FNV(h, a->alm[i].prn);
+    h = FNV(h, a->alm[i].toa);
+  }
+
+  h = FNV(h, a->acq_time);
+  h = FNV(h, a->cnt_acq);
+
+  return h;
+}
+
+static void put_bits(unsigned char *buf, int bit, unsigned long v, int n) {
+  while (n--) {
+    unsigned char m = 0x80 >> (bit & 7);
+
+    if ((v >> n) & 1) buf[bit >> 3] |= m;
+    else buf[bit >> 3] &= ~m;
+    bit++;
+  }
+}
+
+static int get_bit(unsigned char *buf, int bit) {
+  return (buf[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/*
+** referenceTime is the first member of ControlHeader and the optional
+** bitmaps before it have a fixed size, so gpsTOW23b sits at the same bit
+** in every assistanceData PDU. Found by encoding two times which differ
+** in the top bit only.
+*/
+
+static int find_tow_bit(supl_payloads_t *pc) {
+  supl_assist_t a;
+  supl_segment_t seg;
+  supl_rrlp_t first;
+  int bit = -1, i;
+
+  memset(&a, 0, sizeof(a));
+  memset(&seg, 0, sizeof(seg));
+  seg.parts = SUPL_RRLP_ASSIST_REFTIME;
+  supl_rrlp_init(&first);
+
+  if (supl_rrlp_encode_assist(&first, &a, &seg, 0, 0) == 0) {
+    a.time.gps_tow = 1 << 22;
+    if (supl_rrlp_encode_assist(&pc->scratch, &a, &seg, 0, 0) == 0 && pc->scratch.size == first.size) {
+      for (i = 0; i < (int)first.size * 8; i++) {
+	if (get_bit(first.buffer, i) != get_bit(pc->scratch.buffer, i)) {
+	  bit = i;
+	  break;
+	}
+      }
+    }
+  }
+
+  supl_rrlp_release(&first);
+
+  return bit;
+}
+
+static unsigned int payload_hash(supl_payloads_t *pc, supl_cache_key_t *area, int parts) {
+  return fnv(FNV(2166136261u, parts), area, sizeof(supl_cache_key_t)) % pc->size;
+}
+
+static void payload_release(supl_payloads_t *pc, supl_payload_t *p) {
+  if (--p->refs > 0) return;
+
+  pc->entries--;
+  pc->bytes -= sizeof(supl_payload_t) + p->off[p->segs];
+  free(p->data);
+  free(p);
+}
+
+// drop the entries of past time buckets
+static void payload_sweep(supl_payloads_t *pc, time_t bucket) {
+  supl_payload_t *p, **pp;
+  int i;
+
+  for (i = 0; i < pc->size; i++) {
+    pp = &pc->bucket[i];
+    while ((p = *pp)) {
+      if (p->bucket < bucket) {
+	*pp = p->next;
+	payload_release(pc, p);
+      } else {
+	pp = &p->next;
+      }
+    }
+  }
+
+  pc->swept = bucket;
+}
+
+static supl_payload_t *payload_encode(supl_payloads_t *pc, supl_assist_t *assist, int parts) {
+  supl_segment_t seg[SUPL_SEGMENTS_MAX];
+  supl_payload_t *p;
+  unsigned char *data;
+  int i;
+
+  p = calloc(1, sizeof(supl_payload_t));
+  if (!p) return 0;
+
+  p->segs = supl_rrlp_segments(assist, parts, seg, SUPL_SEGMENTS_MAX, pc->target);
+  p->time_seg = -1;
+
+  for (i = 0; i < p->segs; i++) {
+    if (seg[i].parts & SUPL_RRLP_ASSIST_REFTIME) p->time_seg = i;
+
+    if (supl_rrlp_encode_assist(&pc->scratch, assist, &seg[i], 0, i + 1 < p->segs) < 0) goto fail;
+
+    data = realloc(p->data, p->off[i] + pc->scratch.size);
+    if (!data) goto fail;
+    p->data = data;
+    memcpy(p->data + p->off[i], pc->scratch.buffer, pc->scratch.size);
+    p->off[i + 1] = p->off[i] + pc->scratch.size;
+  }
+
+  if (p->segs == 0) goto fail;
+
+  if (p->time_seg >= 0 && pc->tow_bit < 0) {
+    pc->tow_bit = find_tow_bit(pc);
+    if (pc->tow_bit < 0) goto fail;
+  }
+
+  return p;
+
+ fail:
+  free(p->data);
+  free(p);
+  return 0;
+}
+
+int EXPORT supl_payloads_new(supl_payloads_t *pc, int size) {
+  memset(pc, 0, sizeof(supl_payloads_t));
+
+  if (size <= 0) size = 1021;
+
+  pc->bucket = calloc(size, sizeof(supl_payload_t *));
+  if (!pc->bucket) return E_SUPL_INTERNAL;
+
+  pc->size = size;
+  pc->tow_bit = -1;
+  supl_rrlp_init(&pc->scratch);
+
+  return 0;
+}
+
+/* entries still held by sessions are freed by their supl_payload_put() */
+void EXPORT supl_payloads_free(supl_payloads_t *pc) {
+  supl_payload_t *p;
+  int i;
+
+  for (i = 0; i < pc->size; i++) {
+    while ((p = pc->bucket[i])) {
+      pc->bucket[i] = p->next;
+      payload_release(pc, p);
+    }
+  }
+
+  free(pc->bucket);
+  supl_rrlp_release(&pc->scratch);
+
+  memset(pc, 0, sizeof(supl_payloads_t));
+}
+
+/*
+** The encoded segments of assist for area and parts, as supl_rrlp_segments()
+** splits them. An entry is used for SUPL_PAYLOAD_BUCKET seconds at most
+** and is replaced sooner when the data changes, a new ephemeris upload
+** for example. The caller holds a reference until supl_payload_put().
+** Returns 0 if assist can not be encoded.
+*/
+
+EXPORT supl_payload_t *supl_payload_get(supl_payloads_t *pc, supl_cache_key_t *area, supl_assist_t *assist, int parts, time_t now) {
+  time_t bucket = now / SUPL_PAYLOAD_BUCKET;
+  unsigned int sig = assist_sig(assist);
+  unsigned int h = payload_hash(pc, area, parts);
+  supl_payload_t *p, **pp;
+
+  if (bucket != pc->swept) payload_sweep(pc, bucket);
+
+  for (pp = &pc->bucket[h]; (p = *pp); pp = &p->next) {
+    if (p->parts == parts && memcmp(&p->area, area, sizeof(supl_cache_key_t)) == 0) break;
+  }
+
+  if (p && p->sig == sig) {
+    pc->hits++;
+    p->refs++;
+    return p;
+  }
+
+  if (p) {
+    pc->invalidations++;
+    *pp = p->next;
+    payload_release(pc, p);
+  }
+
+  pc->misses++;
+
+  p = payload_encode(pc, assist, parts);
+  if (!p) return 0;
+
+  p->area = *area;
+  p->parts = parts;
+  p->bucket = bucket;
+  p->sig = sig;
+  p->refs = 2; /* the table and the caller */
+  p->next = pc->bucket[h];
+  pc->bucket[h] = p;
+
+  pc->entries++;
+  pc->bytes += sizeof(supl_payload_t) + p->off[p->segs];
+
+  return p;
+}
+
+void EXPORT supl_payload_put(supl_payloads_t *pc, supl_payload_t *p) {
+  if (p) payload_release(pc, p);
+}
+
+/* segment i of p for one session into out, with its reference number and time */
+int EXPORT supl_payload_segment(supl_payloads_t *pc, supl_payload_t *p, int i, supl_assist_t *assist, int ref, supl_rrlp_t *out) {
+  size_t size;
+
+  if (i < 0 || i >= p->segs) return E_SUPL_INTERNAL;
+
+  size = p->off[i + 1] - p->off[i];
+  if (supl_rrlp_reserve(out, size) < 0) return E_SUPL_INTERNAL;
+
+  memcpy(out->buffer, p->data + p->off[i], size);
+  out->size = size;
+
+  // PDU starts with referenceNumber INTEGER (0..7)
+  put_bits(out->buffer, 0, ref, 3);
+
+  if (i == p->time_seg) {
+    put_bits(out->buffer, pc->tow_bit, assist->time.gps_tow, 23);
+    put_bits(out->buffer, pc->tow_bit + 23, assist->time.gps_week % 1024, 10);
+  }
+
+  return 0;
+}
@@ -0,0 +1,143 @@
+/*
+** SUPL library - current assistance for many reader threads, read copy update
+**
+** Copyright (c) 2007 Tatu Mannisto <tatu a-t tajuma d-o-t com>
+** All rights reserved.
+** Redistribution and modifications are permitted subject to BSD license.
+**
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "supl.h"
+
+/*
+** Published snapshots are never changed. A writer makes a new one and
+** swaps the current pointer, the old one is retired and freed once no
+** reader slot holds it (hazard pointers). A reader only writes its own
+** slot, which has a cache line to itself, so readers do not slow each
+** other down. Writers serialize on a mutex readers never see.
+*/
+
+int EXPORT supl_snaps_new(supl_snaps_t *s) {
+  memset(s, 0, sizeof(supl_snaps_t));
+  pthread_mutex_init(&s->writer, 0);
+
+  return 0;
+}
+
+void EXPORT supl_snaps_free(supl_snaps_t *s) {
+  supl_snap_t *r, *next;
+
+  for (r = s->retired; r; r = next) {
+    next = r->retired_next;
+    free(r);
+  }
+  free(s->current);
+
+  pthread_mutex_destroy(&s->writer);
+  memset(s, 0, sizeof(supl_snaps_t));
+}
+
+/* a slot for one reader thread, E_SUPL_INTERNAL if all are taken */
+int EXPORT supl_snaps_reader(supl_snaps_t *s) {
+  int i, free_slot;
+
+  for (i = 0; i < SUPL_SNAP_SLOTS; i++) {
+    free_slot = 0;
+    if (__atomic_compare_exchange_n(&s->slot[i].used, &free_slot, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return i;
+  }
+
+  return E_SUPL_INTERNAL;
+}
+
+void EXPORT supl_snaps_reader_done(supl_snaps_t *s, int slot) {
+  __atomic_store_n(&s->slot[slot].hazard, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&s->slot[slot].used, 0, __ATOMIC_RELEASE);
+}
+
+/*
+** The current snapshot, 0 if nothing has been published. It stays valid
+** until the next supl_snap_get() or supl_snap_put() on the slot, however
+** many versions are published meanwhile.
+*/
+
+const supl_snap_t EXPORT *supl_snap_get(supl_snaps_t *s, int slot) {
+  supl_snap_t *p, *again;
+
+  p = __atomic_load_n(&s->current, __ATOMIC_ACQUIRE);
+
+  for (;;) {
+    /* the writer must see the hazard before it checks what to free */
+    __atomic_store_n(&s->slot[slot].hazard, p, __ATOMIC_SEQ_CST);
+
+    again = __atomic_load_n(&s->current, __ATOMIC_SEQ_CST);
+    if (again == p) return p;
+    p = again;
+  }
+}
+
+void EXPORT supl_snap_put(supl_snaps_t *s, int slot) {
+  __atomic_store_n(&s->slot[slot].hazard, 0, __ATOMIC_RELEASE);
+}
+
+// free the retired snapshots no reader holds, called with s->writer held
+static void snaps_reclaim(supl_snaps_t *s) {
+  supl_snap_t *r, **rp;
+  int i;
+
+  rp = &s->retired;
+  while ((r = *rp)) {
+    for (i = 0; i < SUPL_SNAP_SLOTS; i++) {
+      if (__atomic_load_n(&s->slot[i].hazard, __ATOMIC_SEQ_CST) == r) break;
+    }
+
+    if (i < SUPL_SNAP_SLOTS) {
+      rp = &r->retired_next;
+      continue;
+    }
+
+    *rp = r->retired_next;
+    free(r);
+    s->retired_cnt--;
+    s->freed++;
+  }
+}
+
+/* make assist the current snapshot */
+int EXPORT supl_snaps_publish(supl_snaps_t *s, supl_assist_t *assist) {
+  supl_snap_t *p, *old;
+
+  p = malloc(sizeof(supl_snap_t));
+  if (!p) return E_SUPL_INTERNAL;
+
+  memcpy(&p->assist, assist, sizeof(supl_assist_t));
+  p->published = time(0);
+  p->retired_next = 0;
+
+  pthread_mutex_lock(&s->writer);
+
+  p->version = ++s->version;
+  old = __atomic_exchange_n(&s->current, p, __ATOMIC_SEQ_CST);
+
+  if (old) {
+    old->retired_next = s->retired;
+    s->retired = old;
+    s->retired_cnt++;
+  }
+  snaps_reclaim(s);
+
+  pthread_mutex_unlock(&s->writer);
+
+  return 0;
+}
+
+/* retry freeing old snapshots, for writers which publish rarely */
+void EXPORT supl_snaps_reclaim(supl_snaps_t *s) {
+  pthread_mutex_lock(&s->writer);
+  snaps_reclaim(s);
+  pthread_mutex_unlock(&s->writer);
+}
@@ -0,0 +1,267 @@
+/*
+** SUPL library - persistent assistance store in a memory mapped file
+**
+** Copyright (c) 2007 Tatu Mannisto <tatu a-t tajuma d-o-t com>
+** All rights reserved.
+** Redistribution and modifications are permitted subject to BSD license.
+**
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "supl.h"
+
+/*
+** File layout: a header followed by a fixed number of record slots. A key
+** lives in one of STORE_PROBE slots starting at its hash. Every slot has
+** a sequence counter which is odd while the slot is being written, so
+** readers copy a record without any locks and retry if it changed under
+** them. Writers of all processes serialize with an fcntl() lock on the
+** file.
+*/
+
+#define STORE_MAGIC 0x4c505553 /* "SUPL" */
+#define STORE_VERSION 1
+#define STORE_PROBE 16
+#define STORE_READ_TRIES 1000
+
+struct store_header_s {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t slots;
+  uint64_t writes;
+};
+
+struct store_record_s {
+  uint32_t seq;
+  uint32_t used;
+  supl_cache_key_t key;
+  supl_cached_t data;
+};
+
+#define STORE_SIZE(slots) (sizeof(struct store_header_s) + (size_t)(slots) * sizeof(struct store_record_s))
+
+static struct store_record_s *store_slot(supl_store_t *st, unsigned int i) {
+  return (struct store_record_s *)((char *)st->map + sizeof(struct store_header_s)) + i % st->slots;
+}
+
+static unsigned int store_hash(supl_cache_key_t *key) {
+  const unsigned char *p = (const unsigned char *)key;
+  unsigned int h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < sizeof(supl_cache_key_t); i++) {
+    h = (h ^ p[i]) * 16777619u;
+  }
+
+  return h;
+}
+
+static int store_lock(supl_store_t *st, int type) {
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+
+  while (fcntl(st->fd, F_SETLKW, &fl) < 0) {
+    if (errno != EINTR) return E_SUPL_INTERNAL;
+  }
+
+  return 0;
+}
+
+int EXPORT supl_store_open(supl_store_t *st, char *file, int slots) {
+  struct store_header_s *hdr;
+  struct stat sb;
+  int prot = PROT_READ | PROT_WRITE;
+
+  memset(st, 0, sizeof(supl_store_t));
+
+  if (slots <= 0) slots = 4096;
+
+  st->fd = open(file, O_RDWR | O_CREAT, 0644);
+  if (st->fd < 0) {
+    /* readers do not need to write */
+    st->fd = open(file, O_RDONLY);
+    if (st->fd < 0) return E_SUPL_READ;
+    prot = PROT_READ;
+  }
+
+  if (prot & PROT_WRITE) {
+    if (store_lock(st, F_WRLCK) < 0) goto fail;
+
+    if (fstat(st->fd, &sb) < 0) goto fail_unlock;
+    if (sb.st_size == 0) {
+      struct store_header_s h;
+
+      memset(&h, 0, sizeof(h));
+      h.magic = STORE_MAGIC;
+      h.version = STORE_VERSION;
+      h.record_size = sizeof(struct store_record_s);
+      h.slots = slots;
+
+      if (ftruncate(st->fd, STORE_SIZE(slots)) < 0 ||
+	  pwrite(st->fd, &h, sizeof(h), 0) != sizeof(h)) goto fail_unlock;
+    }
+
+    store_lock(st, F_UNLCK);
+  }
+
+  if (fstat(st->fd, &sb) < 0 || sb.st_size < (off_t)sizeof(struct store_header_s)) goto fail;
+
+  st->size = sb.st_size;
+  st->map = mmap(0, st->size, prot, MAP_SHARED, st->fd, 0);
+  if (st->map == MAP_FAILED) {
+    st->map = 0;
+    goto fail;
+  }
+
+  hdr = st->map;
+  if (hdr->magic != STORE_MAGIC || hdr->version != STORE_VERSION ||
+      hdr->record_size != sizeof(struct store_record_s) || STORE_SIZE(hdr->slots) > st->size) {
+    supl_store_close(st);
+    return E_SUPL_DECODE;
+  }
+
+  st->slots = hdr->slots;
+  st->writable = (prot & PROT_WRITE) != 0;
+
+  return 0;
+
+ fail_unlock:
+  store_lock(st, F_UNLCK);
+ fail:
+  close(st->fd);
+  st->fd = -1;
+  return E_SUPL_READ;
+}
+
+void EXPORT supl_store_close(supl_store_t *st) {
+  if (st->map) munmap(st->map, st->size);
+  if (st->fd >= 0) close(st->fd);
+
+  memset(st, 0, sizeof(supl_store_t));
+  st->fd = -1;
+}
+
+/*
+** Consistent copy of a slot, retried while a writer is busy with it. A
+** writer killed in the middle leaves the slot odd, so give up eventually.
+*/
+
+static int store_read(struct store_record_s *r, struct store_record_s *copy) {
+  uint32_t seq;
+  int tries;
+
+  for (tries = 0; tries < STORE_READ_TRIES; tries++) {
+    seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      if (tries > 64) usleep(10);
+      continue;
+    }
+
+    memcpy(copy, r, sizeof(struct store_record_s));
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) == seq) return 1;
+  }
+
+  return 0;
+}
+
+/* lock-free lookup, returns 1 and the stored record if the key is there */
+int EXPORT supl_store_get(supl_store_t *st, supl_cache_key_t *key, supl_cached_t *out) {
+  unsigned int h = store_hash(key);
+  struct store_record_s copy;
+  int i;
+
+  if (!st->map) return 0;
+
+  for (i = 0; i < STORE_PROBE && i < st->slots; i++) {
+    struct store_record_s *r = store_slot(st, h + i);
+
+    /* cheap peek first, most slots are someone else's */
+    if (!__atomic_load_n(&r->used, __ATOMIC_RELAXED)) return 0;
+    if (memcmp(&r->key, key, sizeof(supl_cache_key_t)) != 0) continue;
+
+    if (!store_read(r, &copy)) return 0;
+    if (copy.used && memcmp(&copy.key, key, sizeof(supl_cache_key_t)) == 0) {
+      *out = copy.data;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+** Merge assist into the record of key. A new key takes the first free
+** slot of its probe window or, if there is none, the least recently
+** written one.
+*/
+
+int EXPORT supl_store_put(supl_store_t *st, supl_cache_key_t *key, supl_assist_t *assist) {
+  struct store_header_s *hdr = st->map;
+  struct store_record_s *r = 0, copy;
+  time_t now = time(0), oldest = 0;
+  unsigned int h = store_hash(key);
+  uint32_t seq;
+  int i;
+
+  if (!st->map || !st->writable) return E_SUPL_WRITE;
+
+  if (store_lock(st, F_WRLCK) < 0) return E_SUPL_WRITE;
+
+  for (i = 0; i < STORE_PROBE && i < st->slots; i++) {
+    struct store_record_s *s = store_slot(st, h + i);
+    time_t t = s->data.at[0];
+    int k;
+
+    if (!s->used || memcmp(&s->key, key, sizeof(supl_cache_key_t)) == 0) {
+      r = s;
+      break;
+    }
+
+    for (k = 1; k < SUPL_ASSIST_PARTS; k++) {
+      if (s->data.at[k] > t) t = s->data.at[k];
+    }
+    if (!r || t < oldest) {
+      r = s;
+      oldest = t;
+    }
+  }
+
+  /* we are the only writer, so the slot can be read directly */
+  memcpy(&copy, r, sizeof(struct store_record_s));
+  if (!copy.used || memcmp(&copy.key, key, sizeof(supl_cache_key_t)) != 0) {
+    memset(&copy, 0, sizeof(copy));
+    copy.used = 1;
+    copy.key = *key;
+  }
+  supl_cached_merge(&copy.data, assist, now);
+
+  /* seqlock write, the slot may still be odd after a crashed writer */
+  seq = (r->seq + 1) | 1;
+  copy.seq = seq + 1;
+  __atomic_store_n(&r->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy((char *)r + sizeof(r->seq), (char *)&copy + sizeof(copy.seq), sizeof(copy) - sizeof(copy.seq));
+  __atomic_store_n(&r->seq, copy.seq, __ATOMIC_RELEASE);
+
+  hdr->writes++;
+
+  store_lock(st, F_UNLCK);
+
+  return 0;
+}
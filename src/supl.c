@@ -16,6 +16,8 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <pthread.h>
 #include <openssl/crypto.h>
 #include <openssl/x509.h>
 #include <openssl/pem.h>
@@ -24,6 +26,8 @@
 
 #include "ULP-PDU.h"
 #include "PDU.h"
+#include "XNavigationModel.h"
+#include "SatelliteInfoElement.h"
 
 #include "supl.h"
 
@@ -33,21 +37,140 @@
 
 #define OPTIONAL_MISSING ((void*)0)
 
-#ifdef SUPL_DEBUG
-static struct supl_debug_s {
-  FILE *log;
-  int verbose_rrlp, verbose_supl, debug;
-  int sent,recv, out_msg, in_msg;
-} debug;
-#endif
+/* debug settings copied into every new context, see supl_set_debug() */
+static supl_debug_t debug_default;
+
+static pthread_once_t supl_init_once = PTHREAD_ONCE_INIT;
 
-static int server_connect(char *server);
+/* a cancel or timeout is returned as it is, not as the step that was cut short */
+#define GAVE_UP(err) ((err) == E_SUPL_CANCELLED || (err) == E_SUPL_TIMEOUT)
+
+static int server_connect(char *server, int cancel_fd, const struct timeval *deadline);
+static int wait_fd(int fd, int events, int cancel_fd, const struct timeval *deadline);
 static int pdu_make_ulp_start(supl_ctx_t *ctx, supl_ulp_t *pdu);
 static int pdu_make_ulp_pos_init(supl_ctx_t *ctx, supl_ulp_t *pdu);
 static int pdu_make_ulp_rrlp_ack(supl_ctx_t *ctx, supl_ulp_t *pdu, PDU_t *rrlp);
+static int pdu_make_ulp_end(supl_ctx_t *ctx, supl_ulp_t *pdu, long status);
 static int supl_more_rrlp(PDU_t *rrlp);
 static int supl_response_harvest(supl_ctx_t *ctx, supl_ulp_t *pdu);
 
+/*
+** PDU buffer pool
+**
+** Buffers are handed out in a few size classes and kept on per-class
+** free lists when released, so idle contexts do not pin large arrays
+** and a PDU can still grow up to the 16-bit ULP length.
+*/
+
+#define BUF_CLASSES 4
+#define BUF_KEEP 16 /* max free buffers kept per size class */
+
+static const size_t buf_class_size[BUF_CLASSES] = { 1024, 4096, 16384, SUPL_PDU_MAX_SIZE + 1 };
+
+static struct supl_buf_pool_s {
+  pthread_mutex_t lock;
+  void *free[BUF_CLASSES]; /* linked through the first word of each buffer */
+  int cnt[BUF_CLASSES];
+} buf_pool = { PTHREAD_MUTEX_INITIALIZER };
+
+static int buf_class(size_t size) {
+  int c;
+
+  for (c = 0; c < BUF_CLASSES; c++) {
+    if (size <= buf_class_size[c]) return c;
+  }
+
+  return -1;
+}
+
+static void *buf_get(int c) {
+  void *buf;
+
+  pthread_mutex_lock(&buf_pool.lock);
+  buf = buf_pool.free[c];
+  if (buf) {
+    buf_pool.free[c] = *(void **)buf;
+    buf_pool.cnt[c]--;
+  }
+  pthread_mutex_unlock(&buf_pool.lock);
+
+  if (!buf) buf = malloc(buf_class_size[c]);
+
+  return buf;
+}
+
+static void buf_put(void *buf, size_t alloc) {
+  int c;
+
+  if (!buf) return;
+
+  c = buf_class(alloc);
+  pthread_mutex_lock(&buf_pool.lock);
+  if (c >= 0 && buf_pool.cnt[c] < BUF_KEEP) {
+    *(void **)buf = buf_pool.free[c];
+    buf_pool.free[c] = buf;
+    buf_pool.cnt[c]++;
+    buf = 0;
+  }
+  pthread_mutex_unlock(&buf_pool.lock);
+
+  free(buf);
+}
+
+// grow *buf to hold at least size bytes, keeping the first used bytes
+static int buf_reserve(unsigned char **buf, size_t *alloc, size_t used, size_t size) {
+  unsigned char *nbuf;
+  int c;
+
+  if (*buf && *alloc >= size) return 0;
+
+  c = buf_class(size);
+  if (c < 0) return E_SUPL_INTERNAL;
+
+  nbuf = buf_get(c);
+  if (!nbuf) return E_SUPL_INTERNAL;
+
+  if (*buf) {
+    if (used) memcpy(nbuf, *buf, used);
+    buf_put(*buf, *alloc);
+  }
+
+  *buf = nbuf;
+  *alloc = buf_class_size[c];
+
+  return 0;
+}
+
+void EXPORT supl_ulp_init(supl_ulp_t *pdu) {
+  memset(pdu, 0, sizeof(supl_ulp_t));
+}
+
+int EXPORT supl_ulp_reserve(supl_ulp_t *pdu, size_t size) {
+  return buf_reserve(&pdu->buffer, &pdu->alloc, pdu->size, size);
+}
+
+void EXPORT supl_ulp_release(supl_ulp_t *pdu) {
+  buf_put(pdu->buffer, pdu->alloc);
+  pdu->buffer = 0;
+  pdu->alloc = 0;
+  pdu->size = 0;
+}
+
+void EXPORT supl_rrlp_init(supl_rrlp_t *pdu) {
+  memset(pdu, 0, sizeof(supl_rrlp_t));
+}
+
+int EXPORT supl_rrlp_reserve(supl_rrlp_t *pdu, size_t size) {
+  return buf_reserve(&pdu->buffer, &pdu->alloc, pdu->size, size);
+}
+
+void EXPORT supl_rrlp_release(supl_rrlp_t *pdu) {
+  buf_put(pdu->buffer, pdu->alloc);
+  pdu->buffer = 0;
+  pdu->alloc = 0;
+  pdu->size = 0;
+}
+
 int EXPORT supl_ulp_decode(supl_ulp_t *pdu) {
   ULP_PDU_t *ulp;
   asn_codec_ctx_t ctx;
@@ -68,18 +191,145 @@ int EXPORT supl_ulp_decode(supl_ulp_t *pdu) {
   return E_SUPL_DECODE;
 }
 
+/*
+** The head of a ULP PDU in unaligned PER, up to the UlpMessage choice:
+** length 16 bits, version 3 x 8 bits, the two session id presence bits,
+** then the SET and SLP session ids if present. Only the session ids vary
+** in length, they are skipped by their choices and string lengths.
+*/
+
+struct peek_s {
+  const unsigned char *buf;
+  size_t bits, pos;
+};
+
+static long peek_bits(struct peek_s *pk, int n) {
+  long v = 0;
+
+  if (pk->pos + n > pk->bits) return -1;
+
+  while (n-- > 0) {
+    v = v << 1 | ((pk->buf[pk->pos >> 3] >> (7 - (pk->pos & 7))) & 1);
+    pk->pos++;
+  }
+
+  return v;
+}
+
+static int peek_skip(struct peek_s *pk, size_t n) {
+  if (pk->pos + n > pk->bits) return -1;
+  pk->pos += n;
+  return 0;
+}
+
+static int peek_ip_address(struct peek_s *pk) {
+  long ipv6 = peek_bits(pk, 1);
+
+  if (ipv6 < 0) return -1;
+  return peek_skip(pk, ipv6 ? 128 : 32);
+}
+
+static int peek_set_id(struct peek_s *pk, supl_ulp_peek_t *peek) {
+  long ext, choice, n;
+  int i;
+
+  ext = peek_bits(pk, 1);
+  choice = peek_bits(pk, 3);
+  if (ext != 0 || choice < 0) return -1;
+
+  peek->set_id = choice + 1; /* SETId_PR_* */
+  switch (peek->set_id) {
+  case SETId_PR_msisdn:
+  case SETId_PR_mdn:
+  case SETId_PR_imsi:
+    for (i = 0; i < 8; i++) {
+      if ((n = peek_bits(pk, 8)) < 0) return -1;
+      peek->id[i] = n;
+    }
+    return 0;
+  case SETId_PR_min:
+    return peek_skip(pk, 34);
+  case SETId_PR_nai:
+    if ((n = peek_bits(pk, 10)) < 0) return -1;
+    return peek_skip(pk, (n + 1) * 7);
+  case SETId_PR_iPAddress:
+    return peek_ip_address(pk);
+  }
+
+  return -1;
+}
+
+static int peek_slp_address(struct peek_s *pk) {
+  long ext, choice, n;
+
+  ext = peek_bits(pk, 1);
+  choice = peek_bits(pk, 1);
+  if (ext != 0 || choice < 0) return -1;
+
+  if (choice == 0) return peek_ip_address(pk);
+
+  /* FQDN, 6 bits a character of its alphabet */
+  if ((n = peek_bits(pk, 8)) < 0) return -1;
+  return peek_skip(pk, (n + 1) * 6);
+}
+
+/*
+** The message type and the SET id of an encoded PDU without decoding
+** it, for relaying at the cost of a few bit reads. Stops with
+** E_SUPL_DECODE at a choice extension it can not skip; message is then
+** UlpMessage_PR_NOTHING. set_id is SETId_PR_NOTHING if there is no SET
+** session id, id holds the SET id when it is an MSISDN, MDN or IMSI.
+*/
+
+int EXPORT supl_ulp_peek(const unsigned char *buf, size_t size, supl_ulp_peek_t *peek) {
+  struct peek_s pk;
+  long has_set, has_slp, ext, choice;
+
+  memset(peek, 0, sizeof(supl_ulp_peek_t));
+  pk.buf = buf;
+  pk.bits = size * 8;
+  pk.pos = 0;
+
+  if (peek_skip(&pk, 16 + 3 * 8) < 0) return E_SUPL_DECODE;
+
+  has_set = peek_bits(&pk, 1);
+  has_slp = peek_bits(&pk, 1);
+  if (has_slp < 0) return E_SUPL_DECODE;
+
+  if (has_set && (peek_skip(&pk, 16) < 0 || peek_set_id(&pk, peek) < 0)) return E_SUPL_DECODE;
+  if (has_slp && (peek_skip(&pk, 32) < 0 || peek_slp_address(&pk) < 0)) return E_SUPL_DECODE;
+
+  ext = peek_bits(&pk, 1);
+  choice = peek_bits(&pk, 3);
+  if (ext != 0 || choice < 0) return E_SUPL_DECODE;
+
+  peek->message = choice + 1; /* UlpMessage_PR_* */
+
+  return 0;
+}
+
 int EXPORT supl_ulp_encode(supl_ulp_t *pdu) {
   asn_enc_rval_t ret;
   int pdu_len;
 
-  ret = uper_encode_to_buffer(&asn_DEF_ULP_PDU, pdu->pdu, pdu->buffer, sizeof(pdu->buffer));
-  if (ret.encoded != -1) {
-    memset(pdu->buffer, 0, sizeof(pdu->buffer));
+  pdu->size = 0;
+  if (supl_ulp_reserve(pdu, buf_class_size[0]) < 0) return E_SUPL_ENCODE;
 
+  /* encoder gives up when the buffer is too small, retry with the next class */
+  while (1) {
+    ret = uper_encode_to_buffer(&asn_DEF_ULP_PDU, pdu->pdu, pdu->buffer, pdu->alloc);
+    if (ret.encoded != -1 || pdu->alloc > SUPL_PDU_MAX_SIZE) break;
+    if (supl_ulp_reserve(pdu, pdu->alloc + 1) < 0) return E_SUPL_ENCODE;
+  }
+
+  if (ret.encoded != -1) {
     pdu_len = (ret.encoded + 7) >> 3;
+    if (pdu_len > SUPL_PDU_MAX_SIZE) return E_SUPL_ENCODE;
+
+    memset(pdu->buffer, 0, pdu_len);
     ((ULP_PDU_t *)pdu->pdu)->length = pdu_len;
 
-    ret = uper_encode_to_buffer(&asn_DEF_ULP_PDU, pdu->pdu, pdu->buffer, sizeof(pdu->buffer));
+    ret = uper_encode_to_buffer(&asn_DEF_ULP_PDU, pdu->pdu, pdu->buffer, pdu->alloc);
     if (ret.encoded > 0) {
       int len = (ret.encoded + 7) >> 3;
 
@@ -95,30 +345,57 @@ int EXPORT supl_ulp_encode(supl_ulp_t *pdu) {
 
 void EXPORT supl_ulp_free(supl_ulp_t *pdu) {
   asn_DEF_ULP_PDU.free_struct(&asn_DEF_ULP_PDU, pdu->pdu, 0);
+  pdu->pdu = 0;
+}
+
+/*
+** SSL_read() or SSL_write() of len bytes. A context with a cancel fd or
+** a timeout keeps its socket non-blocking and waits in poll(), so that a
+** cancel or the deadline interrupts it in the middle of a PDU as well.
+*/
+
+static int ssl_io(supl_ctx_t *ctx, int write, void *buf, int len) {
+  const struct timeval *deadline = ctx->timeout > 0 ? &ctx->deadline : 0;
+  int n, err;
+
+  while (1) {
+    n = write ? SSL_write(ctx->ssl, buf, len) : SSL_read(ctx->ssl, buf, len);
+    if (n > 0) return n;
+
+    switch (SSL_get_error(ctx->ssl, n)) {
+    case SSL_ERROR_WANT_READ:
+      err = wait_fd(ctx->fd, POLLIN, ctx->cancel_fd, deadline);
+      break;
+    case SSL_ERROR_WANT_WRITE:
+      err = wait_fd(ctx->fd, POLLOUT, ctx->cancel_fd, deadline);
+      break;
+    default:
+      return write ? E_SUPL_WRITE : E_SUPL_READ;
+    }
+    if (err < 0) return err;
+  }
 }
 
 int EXPORT supl_ulp_send(supl_ctx_t *ctx, supl_ulp_t *pdu) {
   int err;
 
 #if SUPL_DEBUG
-  if (debug.verbose_supl) {
-    fprintf(debug.log, "Send %lu bytes\n", pdu->size);
-    xer_fprint(debug.log, &asn_DEF_ULP_PDU, pdu->pdu);
+  if (ctx->debug.verbose_supl) {
+    fprintf(ctx->debug.log, "Send %lu bytes\n", pdu->size);
+    xer_fprint(ctx->debug.log, &asn_DEF_ULP_PDU, pdu->pdu);
   }
 #endif
 
-  err = SSL_write(ctx->ssl, pdu->buffer, pdu->size);
+  err = ssl_io(ctx, 1, pdu->buffer, pdu->size);
   if (err <= 0) {
 #if SUPL_DEBUG
-    if (debug.debug) fprintf(debug.log, "Error: SSL_write error: %s\n", strerror(errno));
+    if (ctx->debug.debug) fprintf(ctx->debug.log, "Error: SSL_write error: %s\n", strerror(errno));
 #endif
-    return E_SUPL_WRITE;
+    return GAVE_UP(err) ? err : E_SUPL_WRITE;
   }
 
-#ifdef SUPL_DEBUG
-  debug.sent += pdu->size;
-  debug.out_msg++;
-#endif
+  __atomic_fetch_add(&ctx->stats.sent, pdu->size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ctx->stats.out_msg, 1, __ATOMIC_RELAXED);
 
   return 0;
 }
@@ -129,12 +406,15 @@ int EXPORT supl_ulp_recv(supl_ctx_t *ctx, supl_ulp_t *pdu) {
   asn_dec_rval_t rval;
   ULP_PDU_t *length;
 
-  err = SSL_read(ctx->ssl, pdu->buffer, sizeof(pdu->buffer));
+  pdu->size = 0;
+  if (supl_ulp_reserve(pdu, buf_class_size[0]) < 0) return E_SUPL_READ;
+
+  err = ssl_io(ctx, 0, pdu->buffer, pdu->alloc);
   if (err <= 0) {
 #ifdef SUPL_DEBUG
-    if (debug.debug) fprintf(debug.log, "Error: SSL_read error: %s\n", strerror(errno));
+    if (ctx->debug.debug) fprintf(ctx->debug.log, "Error: SSL_read error: %s\n", strerror(errno));
 #endif
-    return E_SUPL_READ;
+    return GAVE_UP(err) ? err : E_SUPL_READ;
   }
   n = err;
 
@@ -142,17 +422,26 @@ int EXPORT supl_ulp_recv(supl_ctx_t *ctx, supl_ulp_t *pdu) {
   // decode the very first bytes of the ULP_PDU message, just enough to the get message length
   rval = uper_decode_complete(0, &asn_DEF_ULP_PDU, (void **)&length, pdu->buffer, n < 6 ? n : 6);
   if (rval.code == RC_WMORE) {
+    if (length->length > pdu->alloc) {
+      pdu->size = n;
+      if (supl_ulp_reserve(pdu, length->length) < 0) {
+	asn_DEF_ULP_PDU.free_struct(&asn_DEF_ULP_PDU, length, 0);
+	return E_SUPL_READ;
+      }
+    }
+
     // read the missing data
     for (n = err; n < length->length; n += err) {
 #ifdef SUPL_DEBUG
-      if (debug.debug) fprintf(debug.log, "SSL_read got %u bytes (total %lu)\n", n, length->length);
+      if (ctx->debug.debug) fprintf(ctx->debug.log, "SSL_read got %u bytes (total %lu)\n", n, length->length);
 #endif
-      err = SSL_read(ctx->ssl, &pdu->buffer[n], sizeof(pdu->buffer)-n);
+      err = ssl_io(ctx, 0, &pdu->buffer[n], length->length - n);
       if (err <= 0) {
 #ifdef SUPL_DEBUG
-	if (debug.debug) fprintf(debug.log, "Error: SSL_read (again) error: %s\n", strerror(errno));
+	if (ctx->debug.debug) fprintf(ctx->debug.log, "Error: SSL_read (again) error: %s\n", strerror(errno));
 #endif
-	return E_SUPL_READ;
+	asn_DEF_ULP_PDU.free_struct(&asn_DEF_ULP_PDU, length, 0);
+	return GAVE_UP(err) ? err : E_SUPL_READ;
       }
     }
   }
@@ -166,21 +455,20 @@ int EXPORT supl_ulp_recv(supl_ctx_t *ctx, supl_ulp_t *pdu) {
   }
 
 #ifdef SUPL_DEBUG
-  if (debug.verbose_supl) {
-    fprintf(debug.log, "Recv %lu bytes\n", pdu->size);
-    xer_fprint(debug.log, &asn_DEF_ULP_PDU, pdu->pdu);
+  if (ctx->debug.verbose_supl) {
+    fprintf(ctx->debug.log, "Recv %lu bytes\n", pdu->size);
+    xer_fprint(ctx->debug.log, &asn_DEF_ULP_PDU, pdu->pdu);
   }
 #endif
 
-#ifdef SUPL_DEBUG
-  debug.recv += err;
-  debug.in_msg++;
-#endif
+  __atomic_fetch_add(&ctx->stats.recv, pdu->size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&ctx->stats.in_msg, 1, __ATOMIC_RELAXED);
 
   return 0;
 }
 
-int EXPORT supl_decode_rrlp(supl_ulp_t *ulp_pdu, PDU_t **ret_rrlp) {
+/* left is set to the bytes of the payload the RRLP PDU did not use */
+static int decode_rrlp(supl_ulp_t *ulp_pdu, PDU_t **ret_rrlp, size_t *left) {
   asn_dec_rval_t rval;
   OCTET_STRING_t *rrlp_pdu;
   PDU_t *rrlp;
@@ -198,12 +486,7 @@ int EXPORT supl_decode_rrlp(supl_ulp_t *ulp_pdu, PDU_t **ret_rrlp) {
   rval = uper_decode_complete(0, &asn_DEF_PDU, (void **)&rrlp, rrlp_pdu->buf, rrlp_pdu->size);
   switch (rval.code) {
   case RC_OK:
-#ifdef SUPL_DEBUG
-    if (rval.consumed != rrlp_pdu->size) {
-      if (debug.debug) fprintf(debug.log, "Warning: %lu bytes left over in RRLP decoding\n", rval.consumed);
-    }
-#endif
-
+    *left = rrlp_pdu->size - rval.consumed;
     *ret_rrlp = rrlp;
     return 0;
 
@@ -220,29 +503,186 @@ int EXPORT supl_decode_rrlp(supl_ulp_t *ulp_pdu, PDU_t **ret_rrlp) {
   
   return E_SUPL_INTERNAL;
 }
+
+int EXPORT supl_decode_rrlp(supl_ulp_t *ulp_pdu, PDU_t **ret_rrlp) {
+  size_t left;
+
+  return decode_rrlp(ulp_pdu, ret_rrlp, &left);
+}
   
+static void supl_init_openssl(void) {
+  SSLeay_add_ssl_algorithms();
+  SSL_load_error_strings();
+}
+
+/* safe to call any number of times from any thread */
+void EXPORT supl_init(void) {
+  pthread_once(&supl_init_once, supl_init_openssl);
+}
+
+/*
+** A TLS context shared by any number of supl_ctx_t, which also keeps the
+** last session of each server. Later connections to the server resume
+** it, an abbreviated handshake without the certificate exchange.
+*/
+
+int EXPORT supl_tls_new(supl_tls_t *tls) {
+  supl_init();
+
+  memset(tls, 0, sizeof(supl_tls_t));
+
+  tls->ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+  if (!tls->ssl_ctx) return E_SUPL_INTERNAL;
+
+  SSL_CTX_set_session_cache_mode(tls->ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  pthread_mutex_init(&tls->lock, 0);
+
+  return 0;
+}
+
+void EXPORT supl_tls_free(supl_tls_t *tls) {
+  int i;
+
+  for (i = 0; i < SUPL_TLS_SESSIONS; i++) {
+    if (tls->cache[i].session) SSL_SESSION_free(tls->cache[i].session);
+  }
+
+  SSL_CTX_free(tls->ssl_ctx);
+  pthread_mutex_destroy(&tls->lock);
+  memset(tls, 0, sizeof(supl_tls_t));
+}
+
+void EXPORT supl_set_tls(supl_ctx_t *ctx, supl_tls_t *tls) {
+  ctx->tls = tls;
+}
+
+// called with tls->lock held
+static int tls_slot(supl_tls_t *tls, char *server) {
+  int i;
+
+  for (i = 0; i < SUPL_TLS_SESSIONS; i++) {
+    if (tls->cache[i].session && strcmp(tls->cache[i].server, server) == 0) return i;
+  }
+
+  return -1;
+}
+
+static void tls_resume(supl_ctx_t *ctx, char *server) {
+  supl_tls_t *tls = ctx->tls;
+  int i;
+
+  strncpy(ctx->tls_server, server, sizeof(ctx->tls_server) - 1);
+  ctx->tls_server[sizeof(ctx->tls_server) - 1] = 0;
+
+  pthread_mutex_lock(&tls->lock);
+  i = tls_slot(tls, ctx->tls_server);
+  if (i >= 0) SSL_set_session(ctx->ssl, tls->cache[i].session);
+  pthread_mutex_unlock(&tls->lock);
+}
+
+// keep the session for the next connection to the server
+static void tls_keep(supl_ctx_t *ctx) {
+  supl_tls_t *tls = ctx->tls;
+  SSL_SESSION *session;
+  int i;
+
+  if (!ctx->tls_server[0]) return;
+
+  session = SSL_get1_session(ctx->ssl);
+  if (!session) return;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (!SSL_SESSION_is_resumable(session)) {
+    SSL_SESSION_free(session);
+    return;
+  }
+#endif
+
+  pthread_mutex_lock(&tls->lock);
+  i = tls_slot(tls, ctx->tls_server);
+  if (i < 0) {
+    for (i = 0; i < SUPL_TLS_SESSIONS && tls->cache[i].session; i++);
+    if (i == SUPL_TLS_SESSIONS) {
+      i = tls->next;
+      tls->next = (tls->next + 1) % SUPL_TLS_SESSIONS;
+    }
+    strcpy(tls->cache[i].server, ctx->tls_server);
+  }
+  if (tls->cache[i].session) SSL_SESSION_free(tls->cache[i].session);
+  tls->cache[i].session = session;
+  pthread_mutex_unlock(&tls->lock);
+}
+
 int EXPORT supl_server_connect(supl_ctx_t *ctx, char *server) {
+  const struct timeval *deadline = 0;
   int err;
   const SSL_METHOD *meth;
 
-  SSLeay_add_ssl_algorithms();
-  // meth = TLSv1_client_method();
-  meth = SSLv23_client_method();
-  SSL_load_error_strings();
-  ctx->ssl_ctx = SSL_CTX_new(meth);
-  if (!ctx->ssl_ctx) return E_SUPL_CONNECT;
+  supl_init();
+
+  ctx->tls_server[0] = 0;
+
+  /* every server of a pool gets the whole timeout */
+  if (ctx->timeout > 0) {
+    gettimeofday(&ctx->deadline, 0);
+    ctx->deadline.tv_sec += ctx->timeout / 1000;
+    ctx->deadline.tv_usec += ctx->timeout % 1000 * 1000;
+    if (ctx->deadline.tv_usec >= 1000000) {
+      ctx->deadline.tv_sec++;
+      ctx->deadline.tv_usec -= 1000000;
+    }
+    deadline = &ctx->deadline;
+  }
+
+  if (ctx->tls) {
+    ctx->ssl_ctx = ctx->tls->ssl_ctx;
+  } else {
+    // meth = TLSv1_client_method();
+    meth = SSLv23_client_method();
+    ctx->ssl_ctx = SSL_CTX_new(meth);
+    if (!ctx->ssl_ctx) return E_SUPL_CONNECT;
+  }
   
   ctx->ssl = SSL_new(ctx->ssl_ctx);
   if (!ctx->ssl) return E_SUPL_CONNECT;
 
+  if (ctx->tls && server) tls_resume(ctx, server);
+
   if (server) {
-    ctx->fd = server_connect(server);
-    if (ctx->fd == -1) return E_SUPL_CONNECT;
+    ctx->fd = server_connect(server, ctx->cancel_fd, deadline);
+    if (GAVE_UP(ctx->fd)) return ctx->fd;
+    if (ctx->fd < 0) return E_SUPL_CONNECT;
   }
 
   SSL_set_fd(ctx->ssl, ctx->fd);
-  err = SSL_connect(ctx->ssl);
-  if (err == -1) return E_SUPL_CONNECT;
+
+  // our own sockets are non-blocking until the handshake is done
+  while ((err = SSL_connect(ctx->ssl)) != 1) {
+    switch (SSL_get_error(ctx->ssl, err)) {
+    case SSL_ERROR_WANT_READ:
+      err = wait_fd(ctx->fd, POLLIN, ctx->cancel_fd, deadline);
+      break;
+    case SSL_ERROR_WANT_WRITE:
+      err = wait_fd(ctx->fd, POLLOUT, ctx->cancel_fd, deadline);
+      break;
+    default:
+      return E_SUPL_CONNECT;
+    }
+    if (GAVE_UP(err)) return err;
+    if (err < 0) return E_SUPL_CONNECT;
+  }
+
+  /* a cancellable or timed context stays non-blocking, see ssl_io() */
+  if (server && ctx->cancel_fd < 0 && !deadline) {
+    fcntl(ctx->fd, F_SETFL, fcntl(ctx->fd, F_GETFL) & ~O_NONBLOCK);
+  }
+
+  if (ctx->tls) {
+    pthread_mutex_lock(&ctx->tls->lock);
+    if (SSL_session_reused(ctx->ssl)) ctx->tls->resumed++;
+    else ctx->tls->full++;
+    pthread_mutex_unlock(&ctx->tls->lock);
+  }
 
 #if 0
   {
@@ -260,38 +700,199 @@ int EXPORT supl_server_connect(supl_ctx_t *ctx, char *server) {
 
 void EXPORT supl_close(supl_ctx_t *ctx) {
   SSL_shutdown(ctx->ssl);
+  if (ctx->tls) tls_keep(ctx);
   SSL_free(ctx->ssl);
-  SSL_CTX_free(ctx->ssl_ctx);
+  if (!ctx->tls) SSL_CTX_free(ctx->ssl_ctx);
   close(ctx->fd);
+
+  ctx->ssl = 0;
+  ctx->ssl_ctx = 0;
 }
 
+void EXPORT supl_set_cancel_fd(supl_ctx_t *ctx, int fd) {
+  ctx->cancel_fd = fd;
+}
 
-static int server_connect(char *server) {
+/* give up on a server which has not finished the session in ms, E_SUPL_TIMEOUT */
+void EXPORT supl_set_timeout(supl_ctx_t *ctx, int ms) {
+  ctx->timeout = ms;
+}
+
+/*
+** wait until fd is ready for events, or cancel_fd (if any) becomes
+** readable, or the deadline (if any) passes
+*/
+
+static int wait_fd(int fd, int events, int cancel_fd, const struct timeval *deadline) {
+  struct pollfd pfd[2];
+  struct timeval now;
+  int n = 1, ms = -1;
+
+  pfd[0].fd = fd;
+  pfd[0].events = events;
+  if (cancel_fd >= 0) {
+    pfd[1].fd = cancel_fd;
+    pfd[1].events = POLLIN;
+    n = 2;
+  }
+
+  while (1) {
+    if (deadline) {
+      gettimeofday(&now, 0);
+      ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_usec - now.tv_usec) / 1000;
+      if (ms <= 0) return E_SUPL_TIMEOUT;
+    }
+    if (poll(pfd, n, ms) < 0) {
+      if (errno == EINTR) continue;
+      return E_SUPL_INTERNAL;
+    }
+    if (n == 2 && pfd[1].revents) return E_SUPL_CANCELLED;
+    if (pfd[0].revents) return 0;
+  }
+}
+
+/* split "host", "host:port" or "[address]:port" to host and port */
+static const char *server_port(char *server, char *host, size_t size) {
+  const char *port = SUPL_PORT;
+  char *p;
+  size_t len = strlen(server);
+
+  if (server[0] == '[' && (p = strchr(server, ']'))) {
+    server++;
+    len = p - server;
+    if (p[1] == ':') port = p + 2;
+  } else if ((p = strchr(server, ':')) && !strchr(p + 1, ':')) {
+    /* more than one colon is a bare IPv6 address */
+    len = p - server;
+    port = p + 1;
+  }
+
+  if (len >= size) len = size - 1;
+  memcpy(host, server, len);
+  host[len] = 0;
+
+  return port;
+}
+
+static int server_connect(char *server, int cancel_fd, const struct timeval *deadline) {
   int fd = -1;
   struct addrinfo *ailist, *aip;
   struct addrinfo hint;
+  char host[256];
+  const char *port;
   int err;
 
+  port = server_port(server, host, sizeof(host));
+
   memset(&hint, 0, sizeof(struct addrinfo));
   hint.ai_socktype = SOCK_STREAM;
-  err = getaddrinfo(server, SUPL_PORT, &hint, &ailist);
+  err = getaddrinfo(host, port, &hint, &ailist);
   if (err != 0) {
     return -1;
   }
 
   for (aip = ailist; aip; aip = aip->ai_next) {
+    socklen_t len = sizeof(err);
+
     if ((fd = socket(aip->ai_family, SOCK_STREAM, 0)) < 0) {
-      err = errno;
+      continue;
     }
-    if (connect(fd, aip->ai_addr, aip->ai_addrlen) != 0) {
-      return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    if (connect(fd, aip->ai_addr, aip->ai_addrlen) == 0) {
+      break;
+    }
+
+    if (errno == EINPROGRESS) {
+      err = wait_fd(fd, POLLOUT, cancel_fd, deadline);
+      if (GAVE_UP(err)) {
+	close(fd);
+	fd = err;
+	break;
+      }
+      if (err == 0 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+	break;
+      }
     }
-    break;
+
+    close(fd);
+    fd = -1;
   }
 
+  freeaddrinfo(ailist);
+
   return fd;
 }
 
+/*
+** Neighbor measurements as GSM nMR and WCDMA measuredResultsList, 0 when
+** there are none. Values out of the ASN.1 ranges are left out.
+*/
+
+static struct NMR *nmr_make(supl_param_t *p) {
+  struct NMR *nmr = 0;
+  int i;
+
+  for (i = 0; i < p->nmr.cnt; i++) {
+    supl_nmr_t *m = &p->nmr.m[i];
+    NMRelement_t *e;
+
+    if (m->freq < 0 || m->freq > 1023 || m->id < 0 || m->id > 63 || m->level < 0 || m->level > 63) continue;
+
+    if (!nmr) nmr = calloc(1, sizeof(struct NMR));
+    e = calloc(1, sizeof(NMRelement_t));
+    e->aRFCN = m->freq;
+    e->bSIC = m->id;
+    e->rxLev = m->level;
+    ASN_SEQUENCE_ADD(&nmr->list, e);
+  }
+
+  return nmr;
+}
+
+// one MeasuredResults per frequency
+static struct MeasuredResultsList *wcdma_nmr_make(supl_param_t *p) {
+  struct MeasuredResultsList *list = 0;
+  int i, k;
+
+  for (i = 0; i < p->nmr.cnt; i++) {
+    supl_nmr_t *m = &p->nmr.m[i];
+    MeasuredResults_t *mr = 0;
+    CellMeasuredResults_t *cell;
+
+    if (m->freq < 0 || m->freq > 16383 || m->id < 0 || m->id > 511 || m->level < 0 || m->level > 63) continue;
+
+    if (!list) list = calloc(1, sizeof(struct MeasuredResultsList));
+
+    for (k = 0; k < list->list.count; k++) {
+      if (list->list.array[k]->frequencyInfo->fmodeSpecificInfo.choice.fdd.uarfcn_DL == m->freq) {
+	mr = list->list.array[k];
+	break;
+      }
+    }
+
+    if (!mr) {
+      if (list->list.count == 8) continue; /* maxFreq */
+
+      mr = calloc(1, sizeof(MeasuredResults_t));
+      mr->frequencyInfo = calloc(1, sizeof(struct FrequencyInfo));
+      mr->frequencyInfo->fmodeSpecificInfo.present = fmodeSpecificInfo_PR_fdd;
+      mr->frequencyInfo->fmodeSpecificInfo.choice.fdd.uarfcn_DL = m->freq;
+      mr->cellMeasuredResultsList = calloc(1, sizeof(struct CellMeasuredResultsList));
+      ASN_SEQUENCE_ADD(&list->list, mr);
+    }
+
+    cell = calloc(1, sizeof(CellMeasuredResults_t));
+    cell->modeSpecificInfo.present = modeSpecificInfo_PR_fdd;
+    cell->modeSpecificInfo.choice.fdd.primaryCPICH_Info.primaryScramblingCode = m->id;
+    cell->modeSpecificInfo.choice.fdd.cpich_Ec_N0 = calloc(1, sizeof(CPICH_Ec_N0_t));
+    *cell->modeSpecificInfo.choice.fdd.cpich_Ec_N0 = m->level;
+    ASN_SEQUENCE_ADD(&mr->cellMeasuredResultsList->list, cell);
+  }
+
+  return list;
+}
+
 static int pdu_make_ulp_start(supl_ctx_t *ctx, supl_ulp_t *pdu) {
   ULP_PDU_t *ulp;
   SetSessionID_t *session_id;
@@ -326,13 +927,14 @@ static int pdu_make_ulp_start(supl_ctx_t *ctx, supl_ulp_t *pdu) {
   ulp->message.choice.msSUPLSTART.locationId.cellInfo.choice.gsmCell.refMNC = ctx->p.gsm.mnc;
   ulp->message.choice.msSUPLSTART.locationId.cellInfo.choice.gsmCell.refLAC = ctx->p.gsm.lac;
   ulp->message.choice.msSUPLSTART.locationId.cellInfo.choice.gsmCell.refCI = ctx->p.gsm.ci;
-  ulp->message.choice.msSUPLSTART.locationId.cellInfo.choice.gsmCell.nMR = OPTIONAL_MISSING; 
+  ulp->message.choice.msSUPLSTART.locationId.cellInfo.choice.gsmCell.nMR = nmr_make(&ctx->p);
   ulp->message.choice.msSUPLSTART.locationId.cellInfo.choice.gsmCell.tA = OPTIONAL_MISSING; 
   } else if (ctx->p.set & PARAM_WCDMA_CELL_CURRENT) {
     ulp->message.choice.msSUPLSTART.locationId.cellInfo.present = CellInfo_PR_wcdmaCell; 
     ulp->message.choice.msSUPLSTART.locationId.cellInfo.choice.wcdmaCell.refMCC = ctx->p.wcdma.mcc;
     ulp->message.choice.msSUPLSTART.locationId.cellInfo.choice.wcdmaCell.refMNC = ctx->p.wcdma.mnc;
     ulp->message.choice.msSUPLSTART.locationId.cellInfo.choice.wcdmaCell.refUC = ctx->p.wcdma.uc;
+    ulp->message.choice.msSUPLSTART.locationId.cellInfo.choice.wcdmaCell.measuredResultsList = wcdma_nmr_make(&ctx->p);
   }
 
   (void)asn_long2INTEGER(&ulp->message.choice.msSUPLSTART.locationId.status, Status_current);
@@ -356,6 +958,7 @@ static int supl_response_harvest(supl_ctx_t *ctx, supl_ulp_t *pdu) {
   ULP_PDU_t *ulp = pdu->pdu;
   void *buf;
 
+  if (ctx->slp_session_id.buf) free(ctx->slp_session_id.buf);
   ctx->slp_session_id.buf = 0;
 
   ret = uper_encode_to_new_buffer(&asn_DEF_SlpSessionID, 0, (void *)ulp->sessionID.slpSessionID, &buf);
@@ -368,7 +971,7 @@ static int supl_response_harvest(supl_ctx_t *ctx, supl_ulp_t *pdu) {
 }
 
 static int pdu_make_ulp_pos_init(supl_ctx_t *ctx, supl_ulp_t *pdu) {
-  int err;
+  int err, assist;
   ULP_PDU_t *ulp;
   SetSessionID_t *session_id;
   RequestedAssistData_t *req_adata;
@@ -402,14 +1005,39 @@ static int pdu_make_ulp_pos_init(supl_ctx_t *ctx, supl_ulp_t *pdu) {
   (void)asn_long2INTEGER(&ulp->message.choice.msSUPLPOSINIT.sETCapabilities.prefMethod, PrefMethod_agpsSETBasedPreferred);
   ulp->message.choice.msSUPLPOSINIT.sETCapabilities.posProtocol.rrlp = 1;
 
-  req_adata->acquisitionAssistanceRequested = 1; // 1
-  req_adata->navigationModelRequested = 1; // 1
-  req_adata->referenceTimeRequested = 1;
-  req_adata->utcModelRequested = 1; //1
-  req_adata->ionosphericModelRequested = 1; // 1
-  req_adata->referenceLocationRequested = 1;
-  req_adata->almanacRequested = ctx->p.request & SUPL_REQUEST_ALMANAC;
-  req_adata->realTimeIntegrityRequested = 1; // 1
+  assist = ctx->p.assist ? ctx->p.assist : ~0;
+
+  req_adata->acquisitionAssistanceRequested = (assist & SUPL_RRLP_ASSIST_ACQUIS) != 0;
+  req_adata->navigationModelRequested = (assist & SUPL_RRLP_ASSIST_EPHEMERIS) != 0;
+  req_adata->referenceTimeRequested = (assist & SUPL_RRLP_ASSIST_REFTIME) != 0;
+  req_adata->utcModelRequested = (assist & SUPL_RRLP_ASSIST_UTC) != 0;
+  req_adata->ionosphericModelRequested = (assist & SUPL_RRLP_ASSIST_IONO) != 0;
+  req_adata->referenceLocationRequested = (assist & SUPL_RRLP_ASSIST_REFLOC) != 0;
+  req_adata->almanacRequested = (ctx->p.request & SUPL_REQUEST_ALMANAC) && (assist & SUPL_RRLP_ASSIST_ALMANAC);
+  req_adata->realTimeIntegrityRequested = req_adata->navigationModelRequested;
+
+  /* satellites we have current ephemeris for, the SLP sends only the others */
+  if (req_adata->navigationModelRequested && ctx->p.nav.cnt > 0) {
+    XNavigationModel_t *nav = calloc(1, sizeof(XNavigationModel_t));
+    int i;
+
+    nav->gpsWeek = ctx->p.nav.gps_week;
+    nav->gpsToe = ctx->p.nav.gps_toe;
+    nav->toeLimit = ctx->p.nav.toe_limit;
+    nav->nSAT = ctx->p.nav.cnt;
+    nav->satInfo = calloc(1, sizeof(struct SatelliteInfo));
+
+    for (i = 0; i < ctx->p.nav.cnt; i++) {
+      SatelliteInfoElement_t *sat = calloc(1, sizeof(SatelliteInfoElement_t));
+
+      sat->satId = ctx->p.nav.sat[i].prn - 1;
+      sat->iODE = ctx->p.nav.sat[i].iode;
+      ASN_SEQUENCE_ADD(&nav->satInfo->list, sat);
+    }
+
+    req_adata->navigationModelData = nav;
+  }
+
   ulp->message.choice.msSUPLPOSINIT.requestedAssistData = req_adata;
 
   if (ctx->p.set & PARAM_GSM_CELL_CURRENT) {
@@ -418,25 +1046,26 @@ static int pdu_make_ulp_pos_init(supl_ctx_t *ctx, supl_ulp_t *pdu) {
   ulp->message.choice.msSUPLPOSINIT.locationId.cellInfo.choice.gsmCell.refMNC = ctx->p.gsm.mnc;
   ulp->message.choice.msSUPLPOSINIT.locationId.cellInfo.choice.gsmCell.refLAC = ctx->p.gsm.lac; 
   ulp->message.choice.msSUPLPOSINIT.locationId.cellInfo.choice.gsmCell.refCI = ctx->p.gsm.ci; 
-  ulp->message.choice.msSUPLPOSINIT.locationId.cellInfo.choice.gsmCell.nMR = OPTIONAL_MISSING; 
+  ulp->message.choice.msSUPLPOSINIT.locationId.cellInfo.choice.gsmCell.nMR = nmr_make(&ctx->p);
   ulp->message.choice.msSUPLPOSINIT.locationId.cellInfo.choice.gsmCell.tA = OPTIONAL_MISSING; 
   } else if (ctx->p.set & PARAM_WCDMA_CELL_CURRENT) {
     ulp->message.choice.msSUPLPOSINIT.locationId.cellInfo.present = CellInfo_PR_wcdmaCell; 
     ulp->message.choice.msSUPLPOSINIT.locationId.cellInfo.choice.wcdmaCell.refMCC = ctx->p.wcdma.mcc;
     ulp->message.choice.msSUPLPOSINIT.locationId.cellInfo.choice.wcdmaCell.refMNC = ctx->p.wcdma.mnc;
     ulp->message.choice.msSUPLPOSINIT.locationId.cellInfo.choice.wcdmaCell.refUC = ctx->p.wcdma.uc;
+    ulp->message.choice.msSUPLPOSINIT.locationId.cellInfo.choice.wcdmaCell.measuredResultsList = wcdma_nmr_make(&ctx->p);
   }
 
   if (ctx->p.set & PARAM_GSM_CELL_KNOWN) {
     Position_t *pos = calloc(1, sizeof(Position_t));
-    struct tm *tm;
+    struct tm tm;
     time_t t;
 
     (void)asn_long2INTEGER(&ulp->message.choice.msSUPLPOSINIT.locationId.status, Status_stale);
 
     t = time(0);
-    tm = gmtime(&t);
-    asn_UT2time(&pos->timestamp, tm ,1);
+    gmtime_r(&t, &tm);
+    asn_UT2time(&pos->timestamp, &tm ,1);
     (void)asn_long2INTEGER(&pos->positionEstimate.latitudeSign, latitudeSign_north);
     pos->positionEstimate.latitude = (1 << 23) / 90.0 * ctx->p.known.lat;
     pos->positionEstimate.longitude = (1 << 24) / 360.0 * ctx->p.known.lon;
@@ -525,13 +1154,62 @@ static int pdu_make_ulp_rrlp_ack(supl_ctx_t *ctx, supl_ulp_t *pdu, PDU_t *rrlp)
   return 0;
 }
 
+static int pdu_make_ulp_end(supl_ctx_t *ctx, supl_ulp_t *pdu, long status) {
+  int err;
+  ULP_PDU_t *ulp;
+  SetSessionID_t *session_id;
+  StatusCode_t *status_code;
+
+  ulp = calloc(1, sizeof(ULP_PDU_t));
+  session_id = calloc(1, sizeof(SetSessionID_t));
+  status_code = calloc(1, sizeof(StatusCode_t));
+
+  ulp->length = 0;
+  ulp->version.maj = 1;
+  ulp->version.min = 0;
+  ulp->version.servind = 0;
+
+  session_id->sessionId = 1;
+  session_id->setId.present = SETId_PR_imsi;
+  (void)OCTET_STRING_fromBuf(&session_id->setId.choice.imsi, ctx->p.msisdn, 8);
+
+  ulp->sessionID.setSessionID = session_id;
+  if (ctx->slp_session_id.buf) {
+    (void)uper_decode_complete(0, &asn_DEF_SlpSessionID, (void **)&ulp->sessionID.slpSessionID, ctx->slp_session_id.buf, ctx->slp_session_id.size);
+  } else {
+    ulp->sessionID.slpSessionID = OPTIONAL_MISSING;
+  }
+
+  ulp->message.present = UlpMessage_PR_msSUPLEND;
+  ulp->message.choice.msSUPLEND.position = OPTIONAL_MISSING;
+  (void)asn_long2INTEGER(status_code, status);
+  ulp->message.choice.msSUPLEND.statusCode = status_code;
+  ulp->message.choice.msSUPLEND.ver = OPTIONAL_MISSING;
+
+  pdu->pdu = ulp;
+
+  err = supl_ulp_encode(pdu);
+  if (err < 0) {
+    supl_ulp_free(pdu);
+    return err;
+  }
+
+  return 0;
+}
+
 /*
 **
 **
 */
 
+/*
+** Merge assistance data from an RRLP PDU into assist, returns the
+** SUPL_RRLP_ASSIST_* flags of the parts found in this PDU
+*/
+
 int EXPORT supl_collect_rrlp(supl_assist_t *assist, PDU_t *rrlp, struct timeval *t) {
   ControlHeader_t *hdr;
+  int parts = 0;
 
   if (rrlp->component.present != RRLP_Component_PR_assistanceData) return 0;
   if (!rrlp->component.choice.assistanceData.gps_AssistData) return 0;
@@ -539,6 +1217,7 @@ int EXPORT supl_collect_rrlp(supl_assist_t *assist, PDU_t *rrlp, struct timeval
   hdr = &rrlp->component.choice.assistanceData.gps_AssistData->controlHeader;
 
   if (hdr->referenceTime) {
+    parts |= SUPL_RRLP_ASSIST_REFTIME;
     assist->set |= SUPL_RRLP_ASSIST_REFTIME;
     assist->time.gps_tow = hdr->referenceTime->gpsTime.gpsTOW23b;
     assist->time.gps_week = hdr->referenceTime->gpsTime.gpsWeek;
@@ -572,6 +1251,7 @@ int EXPORT supl_collect_rrlp(supl_assist_t *assist, PDU_t *rrlp, struct timeval
       l = loc->buf[9];
       if (loc->buf[10] > l) l = loc->buf[10];
 
+      parts |= SUPL_RRLP_ASSIST_REFLOC;
       assist->set |= SUPL_RRLP_ASSIST_REFLOC;
       assist->pos.lat = lat;
       assist->pos.lon = lon;
@@ -582,11 +1262,16 @@ int EXPORT supl_collect_rrlp(supl_assist_t *assist, PDU_t *rrlp, struct timeval
   if (hdr->acquisAssist) {
     int n;
 
+    parts |= SUPL_RRLP_ASSIST_ACQUIS;
+    assist->set |= SUPL_RRLP_ASSIST_ACQUIS;
     assist->acq_time = hdr->acquisAssist->timeRelation.gpsTOW;
 
     for (n = 0; n < hdr->acquisAssist->acquisList.list.count; n++) {
       struct AcquisElement *e = hdr->acquisAssist->acquisList.list.array[n];
-      int i = assist->cnt_acq++;
+      int i;
+
+      if (assist->cnt_acq >= MAX_EPHEMERIS) break;
+      i = assist->cnt_acq++;
 
       assist->acq[i].prn = e->svid + 1;
       assist->acq[i].parts = 0;
@@ -614,9 +1299,15 @@ int EXPORT supl_collect_rrlp(supl_assist_t *assist, PDU_t *rrlp, struct timeval
   if (hdr->almanac) {
     int n;
 
+    parts |= SUPL_RRLP_ASSIST_ALMANAC;
+    assist->set |= SUPL_RRLP_ASSIST_ALMANAC;
+
     for (n = 0; n < hdr->almanac->almanacList.list.count; n++) {
       struct AlmanacElement *e = hdr->almanac->almanacList.list.array[n];
-      int i = assist->cnt_alm++;
+      int i;
+
+      if (assist->cnt_alm >= MAX_EPHEMERIS) break;
+      i = assist->cnt_alm++;
 
       assist->alm[i].prn = e->satelliteID + 1;
       assist->alm[i].e = e->almanacE;
@@ -636,9 +1327,15 @@ int EXPORT supl_collect_rrlp(supl_assist_t *assist, PDU_t *rrlp, struct timeval
     UncompressedEphemeris_t *ue;
     int n;
 
+    parts |= SUPL_RRLP_ASSIST_EPHEMERIS;
+    assist->set |= SUPL_RRLP_ASSIST_EPHEMERIS;
+
     for (n = 0; n < hdr->navigationModel->navModelList.list.count; n++) {
       struct NavModelElement *e = hdr->navigationModel->navModelList.list.array[n];
-      int i = assist->cnt_eph++;
+      int i;
+
+      if (assist->cnt_eph >= MAX_EPHEMERIS) break;
+      i = assist->cnt_eph++;
 
       assist->eph[i].prn = e->satelliteID + 1;
 
@@ -698,6 +1395,7 @@ int EXPORT supl_collect_rrlp(supl_assist_t *assist, PDU_t *rrlp, struct timeval
   }
 
   if (hdr->ionosphericModel) {
+    parts |= SUPL_RRLP_ASSIST_IONO;
     assist->set |= SUPL_RRLP_ASSIST_IONO;
     assist->iono.a0 = hdr->ionosphericModel->alfa0;
     assist->iono.a1 = hdr->ionosphericModel->alfa1;
@@ -709,6 +1407,7 @@ int EXPORT supl_collect_rrlp(supl_assist_t *assist, PDU_t *rrlp, struct timeval
   }
 
   if (hdr->utcModel) {
+    parts |= SUPL_RRLP_ASSIST_UTC;
     assist->set |= SUPL_RRLP_ASSIST_UTC;
     assist->utc.a0 = hdr->utcModel->utcA0;
     assist->utc.a1 = hdr->utcModel->utcA1;
@@ -720,14 +1419,15 @@ int EXPORT supl_collect_rrlp(supl_assist_t *assist, PDU_t *rrlp, struct timeval
     assist->utc.delta_tlsf = hdr->utcModel->utcDeltaTlsf;
   }
 
-  return 1;
+  return parts;
 }
 
 int EXPORT supl_ctx_new(supl_ctx_t *ctx) {
+  supl_init();
+
   memset(ctx, 0, sizeof(supl_ctx_t));
-#ifdef SUPL_DEBUG
-  memset(&debug, 0, sizeof(struct supl_debug_s));
-#endif
+  ctx->debug = debug_default;
+  ctx->cancel_fd = -1;
 
   return 0;
 }
@@ -750,8 +1450,8 @@ static int supl_more_rrlp(PDU_t *rrlp) {
 	  value == MoreAssDataToBeSent_moreMessagesOnTheWay);
 }
 
-int EXPORT supl_get_assist(supl_ctx_t *ctx, char *server, supl_assist_t *assist) {
-  supl_ulp_t ulp;
+static int supl_session(supl_ctx_t *ctx, char *server, supl_assist_t *assist, supl_ulp_t *ulp) {
+  int err;
 
   //  memcpy(ctx->p.msisdn, "\xde\xad\xbe\xef\xf0\x0b\xaa\x42", 8);
   memcpy(ctx->p.msisdn, "\xFF\xFF\x91\x94\x48\x45\x83\x98", 8);
@@ -760,92 +1460,105 @@ int EXPORT supl_get_assist(supl_ctx_t *ctx, char *server, supl_assist_t *assist)
   ** connect to server
   */
 
-  if (supl_server_connect(ctx, server) < 0) return E_SUPL_CONNECT;
+  err = supl_server_connect(ctx, server);
+  if (err < 0) return GAVE_UP(err) ? err : E_SUPL_CONNECT;
 
   /*
   ** send SUPL_START
   */
 
-  if (pdu_make_ulp_start(ctx, &ulp) < 0) {
+  if (pdu_make_ulp_start(ctx, ulp) < 0) {
     return E_SUPL_ENCODE_START;
   }
 
-  (void)supl_ulp_send(ctx, &ulp);
-  supl_ulp_free(&ulp);
+  (void)supl_ulp_send(ctx, ulp);
+  supl_ulp_free(ulp);
 
   /*
   ** should receive SUPL_RESPONSE back
   */
 
-  if (supl_ulp_recv(ctx, &ulp) < 0) {
-    return E_SUPL_RECV_RESPONSE;
+  err = supl_ulp_recv(ctx, ulp);
+  if (err < 0) {
+    return GAVE_UP(err) ? err : E_SUPL_RECV_RESPONSE;
   }
 
-  if (ulp.pdu->message.present != UlpMessage_PR_msSUPLRESPONSE) {
-    supl_ulp_free(&ulp);
+  if (ulp->pdu->message.present != UlpMessage_PR_msSUPLRESPONSE) {
+    supl_ulp_free(ulp);
     return E_SUPL_SUPLRESPONSE;
   }
 
   // get and copy slpSessionID if present
-  supl_response_harvest(ctx, &ulp);
+  supl_response_harvest(ctx, ulp);
 
-  supl_ulp_free(&ulp);
+  supl_ulp_free(ulp);
   
   /*
   ** send SUPL_POS_INIT
   */
 
-  if (pdu_make_ulp_pos_init(ctx, &ulp) < 0) {
+  if (pdu_make_ulp_pos_init(ctx, ulp) < 0) {
     return E_SUPL_ENCODE_POSINIT;
   }
 
-  (void)supl_ulp_send(ctx, &ulp);
+  (void)supl_ulp_send(ctx, ulp);
 
   /*
   ** should get SUPLPOS back - bounce back and forth until all messages have arrived
   */
 
   memset(assist, 0, sizeof(supl_assist_t));
+  if (ctx->assist_cb) ctx->assist_cb(assist, 0, ctx->assist_cb_arg);
 
   while (1) {
     struct timeval t;
     PDU_t *rrlp;
+    size_t left;
+    int parts;
 
-    supl_ulp_free(&ulp);
+    supl_ulp_free(ulp);
 
     /* record packet recv time */
     gettimeofday(&t, 0);
 
-    if (supl_ulp_recv(ctx, &ulp) < 0) {
-      return E_SUPL_RECV_SUPLPOS;
+    err = supl_ulp_recv(ctx, ulp);
+    if (err < 0) {
+      return GAVE_UP(err) ? err : E_SUPL_RECV_SUPLPOS;
     }
 
-    if (ulp.pdu->message.present == UlpMessage_PR_msSUPLEND) {
+    if (ulp->pdu->message.present == UlpMessage_PR_msSUPLEND) {
       break;
     }
 
-    if (ulp.pdu->message.present != UlpMessage_PR_msSUPLPOS) {
-      supl_ulp_free(&ulp);
+    if (ulp->pdu->message.present != UlpMessage_PR_msSUPLPOS) {
+      supl_ulp_free(ulp);
       return E_SUPL_SUPLPOS;
     }
 
     /* get the beef, the RRLP payload */
 
-    if (supl_decode_rrlp(&ulp, &rrlp) < 0) {
-      supl_ulp_free(&ulp);
+    if (decode_rrlp(ulp, &rrlp, &left) < 0) {
+      supl_ulp_free(ulp);
       return E_SUPL_DECODE_RRLP;
     }
 
 #ifdef SUPL_DEBUG
-    if (debug.verbose_rrlp) {
-      fprintf(debug.log, "Embedded RRLP message\n");
-      xer_fprint(debug.log, &asn_DEF_PDU, rrlp);
+    if (left && ctx->debug.debug) fprintf(ctx->debug.log, "Warning: %lu bytes left over in RRLP decoding\n", left);
+#endif
+
+#ifdef SUPL_DEBUG
+    if (ctx->debug.verbose_rrlp) {
+      fprintf(ctx->debug.log, "Embedded RRLP message\n");
+      xer_fprint(ctx->debug.log, &asn_DEF_PDU, rrlp);
     }
 #endif
 
-    /* remember important stuff from it */
+    /* remember important stuff from it, hand it over right away if asked to */
 
-    supl_collect_rrlp(assist, rrlp, &t);
+    parts = supl_collect_rrlp(assist, rrlp, &t);
+    if (parts && ctx->assist_cb) {
+      ctx->assist_cb(assist, parts, ctx->assist_cb_arg);
+    }
 
     if (!supl_more_rrlp(rrlp)) {
       asn_DEF_ULP_PDU.free_struct(&asn_DEF_PDU, rrlp, 0);
@@ -854,15 +1567,16 @@ int EXPORT supl_get_assist(supl_ctx_t *ctx, char *server, supl_assist_t *assist)
 
     /* More data coming in, send SUPLPOS + RRLP ACK */
 
-    if (pdu_make_ulp_rrlp_ack(ctx, &ulp, rrlp) < 0) {
+    supl_ulp_free(ulp);
+    if (pdu_make_ulp_rrlp_ack(ctx, ulp, rrlp) < 0) {
       return E_SUPL_RRLP_ACK;
     }
 
-    supl_ulp_send(ctx, &ulp);
+    supl_ulp_send(ctx, ulp);
     asn_DEF_ULP_PDU.free_struct(&asn_DEF_PDU, rrlp, 0);
   }
 
-  supl_ulp_free(&ulp);
+  supl_ulp_free(ulp);
 
   /*
   ** send SUPL_END (but who really cares)
@@ -873,6 +1587,49 @@ int EXPORT supl_get_assist(supl_ctx_t *ctx, char *server, supl_assist_t *assist)
   return 0;
 }
 
+int EXPORT supl_get_assist(supl_ctx_t *ctx, char *server, supl_assist_t *assist) {
+  supl_ulp_t ulp;
+  int err;
+
+  supl_ulp_init(&ulp);
+  err = supl_session(ctx, server, assist, &ulp);
+
+  if (err < 0 && ctx->ssl) {
+    /* session was cancelled, tell the server before hanging up */
+    if (err == E_SUPL_CANCELLED && pdu_make_ulp_end(ctx, &ulp, StatusCode_unspecified) == 0) {
+      (void)supl_ulp_send(ctx, &ulp);
+      supl_ulp_free(&ulp);
+    }
+    supl_close(ctx);
+  }
+
+  supl_ulp_release(&ulp);
+
+  return err;
+}
+
+void EXPORT supl_set_assist_cb(supl_ctx_t *ctx, supl_assist_cb cb, void *arg) {
+  ctx->assist_cb = cb;
+  ctx->assist_cb_arg = arg;
+}
+
+/*
+** like supl_get_assist() but cb is called as soon as an RRLP segment has
+** been collected, parts tells which elements of assist it brought
+*/
+
+int EXPORT supl_get_assist_cb(supl_ctx_t *ctx, char *server, supl_assist_t *assist, supl_assist_cb cb, void *arg) {
+  supl_assist_cb old_cb = ctx->assist_cb;
+  void *old_arg = ctx->assist_cb_arg;
+  int err;
+
+  supl_set_assist_cb(ctx, cb, arg);
+  err = supl_get_assist(ctx, server, assist);
+  supl_set_assist_cb(ctx, old_cb, old_arg);
+
+  return err;
+}
+
 void EXPORT supl_set_gsm_cell(supl_ctx_t *ctx, int mcc, int mns, int lac, int ci) {
   ctx->p.set |= PARAM_GSM_CELL_CURRENT;
 
@@ -894,6 +1651,28 @@ void EXPORT supl_set_gsm_cell_known(supl_ctx_t *ctx, int mcc, int mns, int lac,
   ctx->p.known.uncert = uncert;
 }
 
+/* known position of the current GSM cell from db, unless one is given already */
+int EXPORT supl_set_gsm_cell_lookup(supl_ctx_t *ctx, supl_celldb_t *db) {
+  supl_cell_pos_t pos;
+
+  if (!(ctx->p.set & PARAM_GSM_CELL_CURRENT) || (ctx->p.set & PARAM_GSM_CELL_KNOWN)) return 0;
+  if (!supl_celldb_lookup(db, ctx->p.gsm.mcc, ctx->p.gsm.mnc, ctx->p.gsm.lac, ctx->p.gsm.ci, &pos)) return 0;
+
+  supl_set_gsm_cell_known(ctx, ctx->p.gsm.mcc, ctx->p.gsm.mnc, ctx->p.gsm.lac, ctx->p.gsm.ci,
+			  pos.lat, pos.lon, pos.uncert);
+
+  return 1;
+}
+
+/* neighbor measurements of the current cell, the first SUPL_NMR_MAX are kept */
+void EXPORT supl_set_nmr(supl_ctx_t *ctx, const supl_nmr_t *nmr, int n) {
+  if (n > SUPL_NMR_MAX) n = SUPL_NMR_MAX;
+  if (n < 0) n = 0;
+
+  memcpy(ctx->p.nmr.m, nmr, n * sizeof(supl_nmr_t));
+  ctx->p.nmr.cnt = n;
+}
+
 void EXPORT supl_set_wcdma_cell(supl_ctx_t *ctx, int mcc, int mns, int uc) {
   ctx->p.set |= PARAM_WCDMA_CELL_CURRENT;
 
@@ -906,12 +1685,31 @@ void EXPORT supl_request(supl_ctx_t *ctx, int request) {
   ctx->p.request = request;
 }
 
+#ifdef SUPL_DEBUG
+static void debug_flags(supl_debug_t *debug, FILE *log, int flags) {
+  debug->log = log;
+  if (flags & SUPL_DEBUG_RRLP) debug->verbose_rrlp = 1;
+  if (flags & SUPL_DEBUG_SUPL) debug->verbose_supl = 1;
+  if (flags & SUPL_DEBUG_DEBUG) debug->debug = 1;
+}
+#endif
+
+/* default for contexts created afterwards, set it before starting threads */
 void EXPORT supl_set_debug(FILE *log, int flags) {
 #ifdef SUPL_DEBUG
-  debug.log = log;
-  if (flags & SUPL_DEBUG_RRLP) debug.verbose_rrlp = 1;
-  if (flags & SUPL_DEBUG_SUPL) debug.verbose_supl = 1;
-  if (flags & SUPL_DEBUG_DEBUG) debug.debug = 1;
+  debug_flags(&debug_default, log, flags);
 #endif
 }
 
+void EXPORT supl_ctx_set_debug(supl_ctx_t *ctx, FILE *log, int flags) {
+#ifdef SUPL_DEBUG
+  debug_flags(&ctx->debug, log, flags);
+#endif
+}
+
+void EXPORT supl_get_stats(supl_ctx_t *ctx, supl_stats_t *stats) {
+  stats->sent = __atomic_load_n(&ctx->stats.sent, __ATOMIC_RELAXED);
+  stats->recv = __atomic_load_n(&ctx->stats.recv, __ATOMIC_RELAXED);
+  stats->out_msg = __atomic_load_n(&ctx->stats.out_msg, __ATOMIC_RELAXED);
+  stats->in_msg = __atomic_load_n(&ctx->stats.in_msg, __ATOMIC_RELAXED);
+}
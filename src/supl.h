@@ -16,6 +16,7 @@
 #define EXPORT
 #endif
 
+#include <pthread.h>
 #include <openssl/ssl.h>
 #include <PDU.h>
 #include <ULP-PDU.h>
@@ -39,6 +40,8 @@
 #define E_SUPL_INTERNAL (-13)
 #define E_SUPL_DECODE (-14)
 #define E_SUPL_ENCODE_RRLP (-15)
+#define E_SUPL_CANCELLED (-16)
+#define E_SUPL_TIMEOUT (-17)
 
 /* diagnostic & debug values */
 #define SUPL_DEBUG_RRLP 1
@@ -54,6 +57,8 @@
 #define SUPL_RRLP_ASSIST_IONO (4)
 #define SUPL_RRLP_ASSIST_EPHEMERIS (8)
 #define SUPL_RRLP_ASSIST_UTC (16)
+#define SUPL_RRLP_ASSIST_ALMANAC (32)
+#define SUPL_RRLP_ASSIST_ACQUIS (64)
 
 #define SUPL_ACQUIS_DOPPLER (1)
 #define SUPL_ACQUIS_ANGLE (2)
@@ -171,6 +176,19 @@ typedef struct supl_rrlp_ctx_s {
 
 } supl_assist_t;
   
+/*
+** A neighbor cell as measured by the SET: for GSM the ARFCN, BSIC and
+** RXLEV, for WCDMA the UARFCN, primary scrambling code and CPICH Ec/N0
+*/
+
+#define SUPL_NMR_MAX 15
+
+typedef struct supl_nmr_s {
+  int freq;
+  int id;
+  int level; /* higher is stronger */
+} supl_nmr_t;
+
 typedef struct supl_param_s {
   int set;
   int request;
@@ -190,14 +208,78 @@ typedef struct supl_param_s {
   } known;
 
   char msisdn[8];
+
+  /* neighbors of the current cell, sent with it */
+  struct {
+    int cnt;
+    supl_nmr_t m[SUPL_NMR_MAX];
+  } nmr;
+
+  int assist; /* SUPL_RRLP_ASSIST_* parts to ask for, 0 == all */
+
+  /* ephemerides already held, sent as navigationModelData when cnt > 0 */
+  struct {
+    int cnt;
+    int gps_week;
+    int gps_toe;   /* hours, of the newest ephemeris held */
+    int toe_limit; /* hours */
+    struct {
+      int prn, iode;
+    } sat[31];
+  } nav;
 } supl_param_t;
 
+/*
+** called for every collected RRLP segment, parts has SUPL_RRLP_ASSIST_*
+** flags; parts is 0 when assist starts over empty, as a session does on
+** the next server of a pool
+*/
+typedef void (*supl_assist_cb)(supl_assist_t *assist, int parts, void *arg);
+
+typedef struct supl_debug_s {
+  FILE *log;
+  int verbose_rrlp, verbose_supl, debug;
+} supl_debug_t;
+
+/* per context traffic counters, read them with supl_get_stats() */
+typedef struct supl_stats_s {
+  unsigned long sent, recv;
+  unsigned long out_msg, in_msg;
+} supl_stats_t;
+
+/* TLS context and sessions kept between connections, see supl_set_tls() */
+
+#define SUPL_TLS_SESSIONS 16
+
+typedef struct supl_tls_s {
+  SSL_CTX *ssl_ctx;
+  struct {
+    char server[128];
+    SSL_SESSION *session;
+  } cache[SUPL_TLS_SESSIONS];
+  int next;                /* slot to replace when all are taken */
+  unsigned long resumed, full; /* handshakes */
+  pthread_mutex_t lock;
+} supl_tls_t;
+
 typedef struct supl_ctx_s {
   supl_param_t p;
 
+  supl_debug_t debug;
+  supl_stats_t stats;
+
   int fd;
   SSL *ssl;
   SSL_CTX *ssl_ctx;
+  supl_tls_t *tls;        /* shared, 0 == a new SSL_CTX per connection */
+  char tls_server[128];   /* session of this server is kept on close */
+
+  int cancel_fd; /* session is aborted when this becomes readable, -1 if none */
+  int timeout;   /* ms a server may take from connect to the end, 0 == no limit */
+  struct timeval deadline;
+
+  supl_assist_cb assist_cb;
+  void *assist_cb_arg;
 
   struct {
     void *buf;
@@ -206,18 +288,292 @@ typedef struct supl_ctx_s {
 
 } supl_ctx_t;
 
+void supl_init(void);
 int supl_ctx_new(supl_ctx_t *ctx);
 int supl_ctx_free(supl_ctx_t *ctx);
 
 void supl_set_gsm_cell(supl_ctx_t *ctx, int mcc, int mns, int lac, int ci);
 void supl_set_wcdma_cell(supl_ctx_t *ctx, int mcc, int mns, int uc);
 void supl_set_gsm_cell_known(supl_ctx_t *ctx, int mcc, int mns, int lac, int ci, double lat, double lon, int uncert);
+void supl_set_nmr(supl_ctx_t *ctx, const supl_nmr_t *nmr, int n);
 void supl_set_server(supl_ctx_t *ctx, char *server);
 void supl_set_fd(supl_ctx_t *ctx, int fd);
+void supl_set_cancel_fd(supl_ctx_t *ctx, int fd);
+void supl_set_timeout(supl_ctx_t *ctx, int ms);
+int supl_tls_new(supl_tls_t *tls);
+void supl_tls_free(supl_tls_t *tls);
+void supl_set_tls(supl_ctx_t *ctx, supl_tls_t *tls);
 void supl_request(supl_ctx_t *ctx, int flags);
 
 int supl_get_assist(supl_ctx_t *ctx, char *server, supl_assist_t *assist);
+void supl_set_assist_cb(supl_ctx_t *ctx, supl_assist_cb cb, void *arg);
+int supl_get_assist_cb(supl_ctx_t *ctx, char *server, supl_assist_t *assist, supl_assist_cb cb, void *arg);
+
+/* racing/hedging a request over several servers */
+
+typedef struct supl_race_stat_s {
+  char *server;
+  unsigned long starts, wins, failures, cancels;
+  unsigned long completed;
+  double last_ms, total_ms; /* latency of completed sessions */
+} supl_race_stat_t;
+
+typedef struct supl_race_s {
+  int n;
+  supl_race_stat_t *stat;
+  int concurrency; /* sessions started at once */
+  int hedge_ms;    /* start another one after this delay, 0 == only on failure */
+  int winner;      /* server index of the last win, -1 if none */
+  pthread_mutex_t lock;
+} supl_race_t;
+
+int supl_race_new(supl_race_t *race, char **servers, int n);
+void supl_race_free(supl_race_t *race);
+void supl_race_set(supl_race_t *race, int concurrency, int hedge_ms);
+int supl_race_get_stat(supl_race_t *race, int i, supl_race_stat_t *stat);
+int supl_get_assist_race(supl_ctx_t *ctx, supl_race_t *race, supl_assist_t *assist);
+
+/* server pool, picks the best scoring server and backs off failing ones */
+
+typedef struct supl_server_s {
+  char *name;
+  double ewma_ms;        /* latency estimate */
+  unsigned long samples; /* latency samples seen */
+  double fail_ewma;      /* failure rate estimate, 0..1 */
+  unsigned long successes, failures;
+  int fail_streak;
+  time_t retry_at;       /* not used before this unless all servers back off */
+  time_t last_used;
+} supl_server_t;
+
+typedef struct supl_pool_s {
+  int n;
+  supl_server_t *server;
+  double alpha;          /* weight of a new sample */
+  int backoff_base, backoff_max; /* seconds */
+  int last;              /* server index of the last success */
+  unsigned int seed;
+  pthread_mutex_t lock;
+} supl_pool_t;
+
+int supl_pool_new(supl_pool_t *pool, char **servers, int n);
+void supl_pool_free(supl_pool_t *pool);
+int supl_pool_load(supl_pool_t *pool, char *file);
+int supl_pool_save(supl_pool_t *pool, char *file);
+int supl_pool_rank(supl_pool_t *pool, int *order);
+int supl_pool_select(supl_pool_t *pool);
+void supl_pool_report(supl_pool_t *pool, int i, int err, double ms);
+int supl_get_assist_pool(supl_ctx_t *ctx, supl_pool_t *pool, supl_assist_t *assist);
 void supl_set_debug(FILE *log, int flags);
+void supl_ctx_set_debug(supl_ctx_t *ctx, FILE *log, int flags);
+void supl_get_stats(supl_ctx_t *ctx, supl_stats_t *stats);
+
+/* assistance cache, each part expires on its own */
+
+#define SUPL_ASSIST_PARTS 7 /* SUPL_RRLP_ASSIST_* flags */
+
+/* parts which depend on where the SET is, the rest are shared by an area */
+#define SUPL_ASSIST_LOCAL (SUPL_RRLP_ASSIST_REFLOC | SUPL_RRLP_ASSIST_ACQUIS)
+
+typedef struct supl_cell_pos_s {
+  double lat, lon;
+  int range;  /* meters */
+  int uncert; /* the same as 3GPP uncertainty code */
+} supl_cell_pos_t;
+
+typedef struct supl_valid_s {
+  int time, loc, iono, utc; /* seconds since fetched */
+  int eph;                  /* seconds after toe */
+  int alm, acq;             /* seconds since fetched */
+} supl_valid_t;
+
+typedef struct supl_cached_s {
+  supl_assist_t assist;
+  time_t at[SUPL_ASSIST_PARTS]; /* fetch time of each part */
+} supl_cached_t;
+
+typedef struct supl_cache_key_s {
+  char server[128];
+  int set;
+  int gsm[4], wcdma[3], known[4];
+} supl_cache_key_t;
+
+typedef struct supl_cache_s {
+  supl_valid_t valid;
+  int required;      /* SUPL_RRLP_ASSIST_* parts that must be fresh */
+  int min_eph;       /* fresh ephemerides needed when ephemeris is required */
+  size_t max_bytes;  /* memory budget, 0 == unbounded */
+  int grid_km;       /* share the area parts in grid squares this wide, 0 == per cell */
+  supl_pool_t *pool; /* fetches keys without a server, see supl_get_assist_cached() */
+  supl_tls_t *tls;   /* for the refresh sessions */
+  unsigned long hits, misses;
+  unsigned long shared;    /* hits for cells not seen before, from their grid square */
+  unsigned long evictions;
+  unsigned long rejections; /* new keys not admitted, less popular than the victims */
+  unsigned long flights;   /* upstream sessions started on a miss */
+  unsigned long coalesced; /* misses which waited for another caller's session */
+  int entries;
+  int almanacs;      /* distinct almanacs, shared by the entries */
+  size_t bytes;
+  int size;
+  struct supl_cache_entry_s **bucket;
+  struct supl_cache_entry_s *lru_head[2], *lru_tail[2]; /* probation, protected */
+  size_t seg_bytes[2];
+  struct supl_alm_blob_s *almanac;
+  unsigned char *sketch; /* frequency sketch for admission */
+  unsigned int sketch_mask;
+  unsigned long sketch_adds;
+  struct supl_flight_s *flight;
+  pthread_mutex_t lock;
+
+  /* refresh-ahead of hot keys, see supl_cache_refresh_start() */
+  int refresh_lead;      /* seconds before expiry, plus up to half of it as jitter */
+  int refresh_hot;       /* lookups to count as hot, halved every minute */
+  double refresh_rate;   /* refreshes per second */
+  int refresh_burst;
+  int refresh_timeout;   /* ms a refresh or prefetch session may take */
+  unsigned long refreshes, refresh_failures;
+  struct supl_cache_entry_s **refresh_heap; /* entries to refresh, soonest first */
+  int refresh_heap_n, refresh_heap_alloc;
+  unsigned int use_epoch; /* minutes of halving the lookup counts */
+
+  /* cells fetched ahead for SETs moving there, see supl_cache_prefetch() */
+  struct supl_prefetch_s *prefetch_head, *prefetch_tail;
+  int prefetch_queued, prefetch_max;
+  unsigned long prefetches;       /* fetched */
+  unsigned long prefetch_used;    /* of them looked up later */
+  unsigned long prefetch_dropped; /* queue full */
+
+  int refresh_run;
+  int refresh_cancel[2]; /* written on stop, cancels the session running */
+  unsigned int refresh_seed;
+  pthread_t refresh_thread;
+  pthread_cond_t refresh_cond;
+} supl_cache_t;
+
+typedef struct supl_cache_stats_s {
+  unsigned long hits, misses, evictions, rejections, shared;
+  unsigned long flights, coalesced;
+  unsigned long refreshes, refresh_failures;
+  unsigned long prefetches, prefetch_used, prefetch_dropped;
+  int entries, almanacs;
+  size_t bytes, max_bytes;
+} supl_cache_stats_t;
+
+int supl_assist_fresh(supl_cached_t *c, const supl_valid_t *valid, struct timeval *now, supl_assist_t *out);
+time_t supl_eph_expiry(supl_cached_t *c, int i, const supl_valid_t *valid);
+void supl_cached_merge(supl_cached_t *c, supl_assist_t *in, time_t now);
+int supl_assist_enough(supl_assist_t *assist, int required, int min_eph);
+int supl_assist_plan(supl_ctx_t *ctx, supl_cached_t *c, const supl_valid_t *valid);
+
+int supl_cache_new(supl_cache_t *cache, int size);
+void supl_cache_free(supl_cache_t *cache);
+void supl_cache_get_stats(supl_cache_t *cache, supl_cache_stats_t *stats);
+void supl_cache_key(supl_cache_key_t *key, supl_ctx_t *ctx, char *server);
+int supl_cache_lookup(supl_cache_t *cache, supl_cache_key_t *key, supl_assist_t *assist);
+int supl_cache_lookup_at(supl_cache_t *cache, supl_cache_key_t *key, supl_cell_pos_t *pos, supl_assist_t *assist);
+void supl_cache_put(supl_cache_t *cache, supl_cache_key_t *key, supl_assist_t *assist);
+int supl_get_assist_cached(supl_cache_t *cache, supl_ctx_t *ctx, char *server, supl_assist_t *assist);
+int supl_cache_prefetch(supl_cache_t *cache, char *server, supl_param_t *p);
+int supl_cache_refresh_start(supl_cache_t *cache, double rate, int burst);
+void supl_cache_refresh_stop(supl_cache_t *cache);
+
+/* assistance store in a file shared by all processes, readers take no locks */
+
+typedef struct supl_store_s {
+  int fd;
+  void *map;
+  size_t size;
+  int slots;
+  int writable;
+} supl_store_t;
+
+int supl_store_open(supl_store_t *st, char *file, int slots);
+void supl_store_close(supl_store_t *st);
+int supl_store_get(supl_store_t *st, supl_cache_key_t *key, supl_cached_t *out);
+int supl_store_put(supl_store_t *st, supl_cache_key_t *key, supl_assist_t *assist);
+
+/* cell id to position index built by supl-celldb */
+
+typedef struct supl_celldb_s {
+  int fd;
+  void *map;
+  size_t size;
+  unsigned long cells;
+} supl_celldb_t;
+
+int supl_celldb_open(supl_celldb_t *db, char *file);
+void supl_celldb_close(supl_celldb_t *db);
+int supl_celldb_lookup(supl_celldb_t *db, int mcc, int mnc, int lac, int ci, supl_cell_pos_t *pos);
+long supl_celldb_build(FILE *in, char *file, unsigned long *skipped);
+int supl_set_gsm_cell_lookup(supl_ctx_t *ctx, supl_celldb_t *db);
+
+/* latest assistance in POSIX shared memory, supl-shm.h has the reader */
+
+typedef struct supl_shm_s {
+  int fd;
+  void *map;
+  size_t size;
+} supl_shm_t;
+
+int supl_shm_create(supl_shm_t *shm, char *name);
+void supl_shm_close(supl_shm_t *shm);
+int supl_shm_publish(supl_shm_t *shm, supl_assist_t *assist);
+
+/* current assistance shared by the threads of a process, readers take no locks */
+
+#define SUPL_SNAP_SLOTS 64 /* reader threads */
+
+typedef struct supl_snap_s {
+  unsigned long version;
+  time_t published;
+  struct supl_snap_s *retired_next;
+  supl_assist_t assist;
+} supl_snap_t;
+
+typedef struct supl_snaps_s {
+  supl_snap_t *current;
+  struct {
+    supl_snap_t *hazard; /* held by the reader of the slot */
+    int used;
+  } __attribute__((aligned(64))) slot[SUPL_SNAP_SLOTS];
+  supl_snap_t *retired;  /* replaced, freed when no slot holds them */
+  int retired_cnt;
+  unsigned long version, freed;
+  pthread_mutex_t writer;
+} supl_snaps_t;
+
+int supl_snaps_new(supl_snaps_t *s);
+void supl_snaps_free(supl_snaps_t *s);
+int supl_snaps_reader(supl_snaps_t *s);
+void supl_snaps_reader_done(supl_snaps_t *s, int slot);
+const supl_snap_t *supl_snap_get(supl_snaps_t *s, int slot);
+void supl_snap_put(supl_snaps_t *s, int slot);
+int supl_snaps_publish(supl_snaps_t *s, supl_assist_t *assist);
+void supl_snaps_reclaim(supl_snaps_t *s);
+
+/* next cells of moving SETs, learnt from their handovers */
+
+#define SUPL_PREDICT_MAX 4
+
+typedef struct supl_predict_s {
+  struct supl_predict_cell_s *cell;
+  struct supl_predict_set_s *set;
+  int cells, sets;
+  unsigned long reports, handovers;
+  unsigned long predicted; /* handovers to a cell predicted at the last report */
+  pthread_mutex_t lock;
+} supl_predict_t;
+
+typedef struct supl_predict_stats_s {
+  unsigned long reports, handovers, predicted;
+} supl_predict_stats_t;
+
+int supl_predict_new(supl_predict_t *pr, int cells, int sets);
+void supl_predict_free(supl_predict_t *pr);
+int supl_predict_report(supl_predict_t *pr, const void *id, size_t len, supl_param_t *p,
+			supl_param_t *next, int max);
+void supl_predict_get_stats(supl_predict_t *pr, supl_predict_stats_t *stats);
 
 /*
 ** stuff above should be enough for supl client implementation
@@ -225,24 +581,103 @@ void supl_set_debug(FILE *log, int flags);
 
 typedef void (*supl_debug_cb)(char format, ...);
 
+/* ULP length field is 16 bits, PDU buffers never need to be larger */
+#define SUPL_PDU_MAX_SIZE 65535
+
+/*
+** PDU buffers come from a size-class pool and grow on demand, call
+** supl_ulp_init() before first use and supl_ulp_release() to give
+** the buffer back to the pool
+*/
+
 typedef struct supl_ulp_s {
   ULP_PDU_t *pdu;
   size_t size;
-  unsigned char buffer[8192];
+  unsigned char *buffer;
+  size_t alloc;
 } supl_ulp_t;
 
 typedef struct supl_rrlp_s {
   PDU_t *pdu;
   size_t size;
-  unsigned char buffer[8192];
+  unsigned char *buffer;
+  size_t alloc;
 } supl_rrlp_t;
 
+void supl_ulp_init(supl_ulp_t *pdu);
+int supl_ulp_reserve(supl_ulp_t *pdu, size_t size);
+void supl_ulp_release(supl_ulp_t *pdu);
+void supl_rrlp_init(supl_rrlp_t *pdu);
+int supl_rrlp_reserve(supl_rrlp_t *pdu, size_t size);
+void supl_rrlp_release(supl_rrlp_t *pdu);
+
 void supl_ulp_free(supl_ulp_t *pdu);
 int supl_ulp_encode(supl_ulp_t *pdu);
 int supl_ulp_decode(supl_ulp_t *pdu);
+
+/* what the head of an encoded ULP PDU tells, see supl_ulp_peek() */
+typedef struct supl_ulp_peek_s {
+  int message;         /* UlpMessage_PR_* */
+  int set_id;          /* SETId_PR_* of the SET session id */
+  unsigned char id[8]; /* MSISDN, MDN or IMSI, BCD */
+} supl_ulp_peek_t;
+
+int supl_ulp_peek(const unsigned char *buf, size_t size, supl_ulp_peek_t *peek);
 int supl_decode_rrlp(supl_ulp_t *pdu, PDU_t **rrlp);
 int supl_collect_rrlp(supl_assist_t *assist, PDU_t *rrlp, struct timeval *t);
 
+/* SLP side, assistance data sent as a series of RRLP assistanceData segments */
+
+#define SUPL_SEGMENTS_MAX 8
+#define SUPL_SEGMENT_SIZE 1400 /* bytes, a segment and its ULP frame in one TCP packet */
+
+typedef struct supl_segment_s {
+  int parts;         /* SUPL_RRLP_ASSIST_* */
+  int eph0, cnt_eph; /* range of assist->eph[] */
+  int alm0, cnt_alm; /* range of assist->alm[] */
+} supl_segment_t;
+
+int supl_rrlp_segments(supl_assist_t *assist, int parts, supl_segment_t *seg, int max, size_t target);
+int supl_rrlp_encode_assist(supl_rrlp_t *out, supl_assist_t *assist, supl_segment_t *seg, int ref, int more);
+
+/*
+** Encoded segments shared by the sessions of an area, only the reference
+** number and reference time are patched per session
+*/
+
+#define SUPL_PAYLOAD_BUCKET 60 /* seconds an encoding is used at most */
+
+typedef struct supl_payload_s {
+  struct supl_payload_s *next;
+  supl_cache_key_t area;
+  int parts;
+  time_t bucket;
+  unsigned int sig; /* of the encoded data, see assist_sig() */
+  int refs;
+  int segs;
+  int time_seg;     /* segment with the reference time, -1 if none */
+  size_t off[SUPL_SEGMENTS_MAX + 1];
+  unsigned char *data;
+} supl_payload_t;
+
+typedef struct supl_payloads_s {
+  int size;
+  supl_payload_t **bucket;
+  size_t target;  /* segment size for supl_rrlp_segments() */
+  time_t swept;   /* time bucket of the last sweep */
+  int tow_bit;    /* bit offset of gpsTOW23b, -1 until known */
+  int entries;
+  size_t bytes;
+  unsigned long hits, misses, invalidations;
+  supl_rrlp_t scratch;
+} supl_payloads_t;
+
+int supl_payloads_new(supl_payloads_t *pc, int size);
+void supl_payloads_free(supl_payloads_t *pc);
+supl_payload_t *supl_payload_get(supl_payloads_t *pc, supl_cache_key_t *area, supl_assist_t *assist, int parts, time_t now);
+void supl_payload_put(supl_payloads_t *pc, supl_payload_t *p);
+int supl_payload_segment(supl_payloads_t *pc, supl_payload_t *p, int i, supl_assist_t *assist, int ref, supl_rrlp_t *out);
+
 int supl_server_connect(supl_ctx_t *ctx, char *server);
 void supl_close(supl_ctx_t *ctx);
 int supl_ulp_send(supl_ctx_t *ctx, supl_ulp_t *pdu);